@@ -1,7 +1,85 @@
+#define _POSIX_MONOTONIC_CLOCK 200809L
+#define _POSIX_TIMERS
 #include <errno.h>
-#include <sys/time.h>
+#include <metal/cpu.h>
+#include <metal/time.h>
+#include <metal/timer.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef TIMER_ABSTIME
+#define TIMER_ABSTIME 4
+#endif
+
+/* Convert a timespec to mtime ticks, rounding up so that sleeps are never
+ * short */
+static int timespec_to_mtime(const struct timespec *ts,
+                             unsigned long long *ticks) {
+    unsigned long long rate;
+
+    if ((ts->tv_sec < 0) || (ts->tv_nsec < 0) || (ts->tv_nsec >= 1000000000)) {
+        return EINVAL;
+    }
+    if ((metal_timer_get_timebase_frequency(metal_cpu_get_current_hartid(),
+                                            &rate) != 0) ||
+        (rate == 0)) {
+        return ENOSYS;
+    }
+
+    if ((unsigned long long)ts->tv_sec > (~0ULL / rate) - 1) {
+        *ticks = ~0ULL;
+        return 0;
+    }
+    *ticks = ((unsigned long long)ts->tv_sec * rate) +
+             (((unsigned long long)ts->tv_nsec * rate + 999999999) /
+              1000000000);
+    return 0;
+}
+
+int clock_nanosleep(clockid_t clock_id, int flags, const struct timespec *rqtp,
+                    struct timespec *rmtp) {
+    unsigned long long deadline, now;
+    int rc;
+
+    if (clock_id != CLOCK_MONOTONIC) {
+        return EINVAL;
+    }
+
+    rc = timespec_to_mtime(rqtp, &deadline);
+    if (rc != 0) {
+        return rc;
+    }
+    if (!(flags & TIMER_ABSTIME)) {
+        if (metal_time_get_mtime(&now) != 0) {
+            return ENOSYS;
+        }
+        deadline = (deadline > ~0ULL - now) ? ~0ULL : deadline + now;
+    }
+
+    /* Nothing interrupts a sleep, so rmtp is never written. The first sleep
+     * on a hart takes over its timer interrupt and mtimecmp, unless the
+     * application handles the interrupt itself, see metal_time_sleep_until() */
+    if (metal_time_sleep_until(deadline) != 0) {
+        return ENOSYS;
+    }
+    return 0;
+}
 
 int nanosleep(const struct timespec *rqtp, struct timespec *rmtp) {
-    errno = ENOSYS;
-    return -1;
+    int rc = clock_nanosleep(CLOCK_MONOTONIC, 0, rqtp, rmtp);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int usleep(useconds_t usec) {
+    struct timespec ts = {
+        .tv_sec = usec / 1000000,
+        .tv_nsec = (usec % 1000000) * 1000,
+    };
+
+    return nanosleep(&ts, NULL);
 }
@@ -1,60 +1,76 @@
 #define _POSIX_MONOTONIC_CLOCK 200809L
 #define _POSIX_TIMERS
+#define _POSIX_CPUTIME
 #include <errno.h>
-#include <metal/drivers/riscv_cpu.h>
-#include <metal/machine.h>
+#include <metal/time.h>
 #include <time.h>
 
-#ifdef MTIME_RATE_HZ_DEF
-#undef MTIME_RATE_HZ
-#define MTIME_RATE_HZ MTIME_RATE_HZ_DEF
-#endif
-
-#ifndef MTIME_RATE_HZ
-#define MTIME_RATE_HZ 32768
-#endif
-
-#if !defined(mtime_interrupt_controller) &&                                    \
-    defined(__METAL_DT_RISCV_CLINT0_HANDLE)
-#define mtime_interrupt_controller __METAL_DT_RISCV_CLINT0_HANDLE
-#endif
-
-#if !defined(mtime_interrupt_controller) &&                                    \
-    defined(__METAL_DT_SIFIVE_CLIC0_HANDLE)
-#define mtime_interrupt_controller __METAL_DT_SIFIVE_CLIC0_HANDLE
-#endif
-
-int clock_getres(clockid_t clk_id, struct timespec *res) {
+static int clockid_to_metal(clockid_t clk_id, metal_time_clock *clock) {
     switch (clk_id) {
     case CLOCK_MONOTONIC:
-        res->tv_sec = 0;
-        res->tv_nsec = 1000000000 / MTIME_RATE_HZ;
+        *clock = METAL_TIME_MONOTONIC;
+        return 0;
+#ifdef CLOCK_MONOTONIC_RAW
+    case CLOCK_MONOTONIC_RAW:
+        *clock = METAL_TIME_MONOTONIC_RAW;
+        return 0;
+#endif
+    case CLOCK_REALTIME:
+        *clock = METAL_TIME_REALTIME;
         return 0;
-        break;
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+    case CLOCK_PROCESS_CPUTIME_ID:
+        *clock = METAL_TIME_CPUTIME;
+        return 0;
+#endif
     default:
+        return -1;
+    }
+}
+
+int clock_getres(clockid_t clk_id, struct timespec *res) {
+    metal_time_clock clock;
+    unsigned long long ns;
+    unsigned long nsec;
+
+    if ((clockid_to_metal(clk_id, &clock) != 0) ||
+        (metal_time_get_resolution_ns(clock, &ns) != 0)) {
         errno = EINVAL;
         return -1;
     }
+    if (res != NULL) {
+        res->tv_sec = metal_time_split_ns(ns, &nsec);
+        res->tv_nsec = nsec;
+    }
+    return 0;
 }
 
 int clock_gettime(clockid_t clk_id, struct timespec *tp) {
-    unsigned long long ticks;
+    metal_time_clock clock;
+    unsigned long long ns;
+    unsigned long nsec;
 
-    switch (clk_id) {
-    case CLOCK_MONOTONIC:
-        mtime_interrupt_controller->vtable->command_request(
-            mtime_interrupt_controller, METAL_TIMER_MTIME_GET, &ticks);
-        tp->tv_sec = ticks / MTIME_RATE_HZ;
-        tp->tv_nsec = ((ticks % (MTIME_RATE_HZ)) * 1000000000) / MTIME_RATE_HZ;
-        return 0;
-        break;
-    default:
+    if ((clockid_to_metal(clk_id, &clock) != 0) ||
+        (metal_time_get_ns(clock, &ns) != 0)) {
         errno = EINVAL;
         return -1;
     }
+    tp->tv_sec = metal_time_split_ns(ns, &nsec);
+    tp->tv_nsec = nsec;
+    return 0;
 }
 
 int clock_settime(clockid_t clk_id, const struct timespec *tp) {
-    errno = EINVAL;
-    return -1;
+    if ((clk_id != CLOCK_REALTIME) || (tp->tv_sec < 0) || (tp->tv_nsec < 0) ||
+        (tp->tv_nsec >= 1000000000)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (metal_time_set_realtime_ns(((unsigned long long)tp->tv_sec *
+                                    1000000000) +
+                                   tp->tv_nsec) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
 }
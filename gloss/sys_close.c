@@ -1,6 +1,29 @@
 #include <errno.h>
+#include <metal/machine/platform.h>
+#include <unistd.h>
+
+#ifdef METAL_UCB_HTIF0
+#include <metal/drivers/ucb_htif0.h>
+#endif
 
 int _close(int file) {
+    /* 0 to 2 are the console rather than files opened on the host, so
+     * closing them mustn't close the host's own stdio */
+    if ((file == STDIN_FILENO) || (file == STDOUT_FILENO) ||
+        (file == STDERR_FILENO)) {
+        return 0;
+    }
+
+#ifdef METAL_UCB_HTIF0
+    int rc = ucb_htif0_close(file);
+
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return 0;
+#else
     errno = ENOSYS;
     return -1;
+#endif
 }
@@ -1,6 +1,22 @@
 #include <errno.h>
+#include <metal/machine/platform.h>
+
+#ifdef METAL_UCB_HTIF0
+#include <metal/drivers/ucb_htif0.h>
+#endif
 
 int _open(const char *name, int flags, int mode) {
+#ifdef METAL_UCB_HTIF0
+    /* Under simulation, files are opened on the host */
+    int rc = ucb_htif0_open(name, flags, mode);
+
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return rc;
+#else
     errno = ENOSYS;
     return -1;
+#endif
 }
@@ -1,7 +1,55 @@
 #include <errno.h>
+#include <metal/machine/platform.h>
+#include <metal/tty.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#ifdef METAL_UCB_HTIF0
+#include <metal/drivers/ucb_htif0.h>
+#endif
+
+/* Once the first byte has arrived, return what has been received after the
+ * console has been idle for this long */
+#ifndef STDIN_IDLE_TIMEOUT_US
+#define STDIN_IDLE_TIMEOUT_US 10000
+#endif
 
 ssize_t _read(int file, void *ptr, size_t len) {
-    errno = ENOSYS;
-    return -1;
+    if (len == 0) {
+        return 0;
+    }
+
+    /* Make sure any prompt has been printed before waiting for input */
+    metal_tty_flush();
+
+#ifdef METAL_UCB_HTIF0
+    /* Under simulation, STDIN and any opened files are read on the host */
+    long count = ucb_htif0_read(file, ptr, len);
+
+    if (count < 0) {
+        errno = -count;
+        return -1;
+    }
+    return count;
+#else
+    int rc;
+
+    if (file != STDIN_FILENO) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Block until there is at least one byte to return */
+    do {
+        rc = metal_tty_read(ptr, len, STDIN_IDLE_TIMEOUT_US);
+    } while (rc == 0);
+
+    if (rc < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return rc;
+#endif
 }
+
+extern __typeof(_read) read __attribute__((__weak__, __alias__("_read")));
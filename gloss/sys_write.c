@@ -1,19 +1,37 @@
 #include <errno.h>
+#include <metal/machine/platform.h>
 #include <metal/tty.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef METAL_UCB_HTIF0
+#include <metal/drivers/ucb_htif0.h>
+#endif
+
 /* Write to a file.  */
 ssize_t _write(int file, const void *ptr, size_t len) {
     if (file != STDOUT_FILENO) {
+#ifdef METAL_UCB_HTIF0
+        /* Under simulation, files opened with open() are written on the
+         * host */
+        long count = ucb_htif0_write(file, ptr, len);
+
+        if (count < 0) {
+            errno = -count;
+            return -1;
+        }
+        return count;
+#else
         errno = ENOSYS;
         return -1;
+#endif
     }
 
-    const char *bptr = ptr;
-    for (size_t i = 0; i < len; ++i)
-        metal_tty_putc(bptr[i]);
-    return 0;
+    if (metal_tty_write(ptr, len) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return len;
 }
 
 extern __typeof(_write) write
@@ -156,6 +156,22 @@ typedef struct __metal_interrupt_data {
     void *exint_data;
 } __metal_interrupt_data;
 
+/* An entry of the handler table the trap entry in src/trap.S dispatches
+ * interrupts through, indexed by mcause. Its size must stay a power of two
+ * matching METAL_TRAP_VECTOR_SHIFT there. */
+typedef struct __metal_trap_vector {
+    metal_interrupt_handler_t handler;
+    void *data;
+} __metal_trap_vector;
+
+/* The trap state which an interrupt handler must keep while it lets other
+ * interrupts preempt it, see __metal_interrupt_nest_enter() */
+struct __metal_interrupt_nest {
+    uintptr_t mepc;
+    uintptr_t mcause;
+    uintptr_t mstatus;
+};
+
 /* CPU interrupt controller */
 
 uintptr_t __metal_myhart_id(void);
@@ -166,6 +182,32 @@ struct __metal_driver_vtable_riscv_cpu_intc {
 
 void __metal_interrupt_global_enable(void);
 void __metal_interrupt_global_disable(void);
+
+/* Disable interrupts on the calling hart for a critical section. Returns the
+ * previous mstatus, for __metal_interrupt_global_restore() to enable them
+ * again only if they were enabled, so that critical sections nest. Both are
+ * always inlined, so that code placed in the ITIM can use them. */
+__attribute__((always_inline)) static __inline__ uintptr_t
+__metal_interrupt_global_save(void) {
+    uintptr_t mstatus;
+
+    __asm__ volatile("csrrc %0, mstatus, %1"
+                     : "=r"(mstatus)
+                     : "r"(METAL_MIE_INTERRUPT)
+                     : "memory");
+    return mstatus;
+}
+
+__attribute__((always_inline)) static __inline__ void
+__metal_interrupt_global_restore(uintptr_t mstatus) {
+    if (mstatus & METAL_MIE_INTERRUPT) {
+        __asm__ volatile("csrs mstatus, %0" ::"r"(METAL_MIE_INTERRUPT)
+                         : "memory");
+    }
+}
+void __metal_interrupt_nest_enter(struct __metal_interrupt_nest *nest);
+void __metal_interrupt_nest_exit(struct __metal_interrupt_nest *nest);
+void __metal_exception_dispatch(void);
 metal_vector_mode __metal_controller_interrupt_vector_mode(void);
 void __metal_controller_interrupt_vector(metal_vector_mode mode,
                                          void *vec_table);
@@ -177,6 +219,7 @@ struct __metal_driver_riscv_cpu_intc {
     int init_done;
     uintptr_t metal_mtvec_table[METAL_MAX_MI];
     __metal_interrupt_data metal_int_table[METAL_MAX_MI];
+    __metal_trap_vector metal_trap_table[METAL_MAX_MI];
     __metal_interrupt_data metal_int_beu;
     metal_exception_handler_t metal_exception_table[METAL_MAX_ME];
 };
@@ -191,6 +234,11 @@ __METAL_DECLARE_VTABLE(__metal_driver_vtable_cpu)
 struct __metal_driver_cpu {
     struct metal_cpu cpu;
     unsigned int hpm_count; /* Available HPM counters per CPU */
+    unsigned long long mtimecmp; /* Last value passed to mtimecmp_set */
 };
 
+long long __metal_driver_cpu_timer_latency(struct metal_cpu *cpu);
+metal_interrupt_handler_t
+__metal_driver_cpu_timer_handler(struct metal_cpu *cpu);
+
 #endif
@@ -12,20 +12,117 @@
 #define METAL_PLIC_SOURCE_PRIORITY_SHIFT 2
 #define METAL_PLIC_SOURCE_PENDING_SHIFT 0
 
+/* The most interrupts the PLIC handler claims before returning from the trap.
+ * Anything still pending after that takes the trap again. */
+#ifndef METAL_RISCV_PLIC0_CLAIM_BUDGET
+#define METAL_RISCV_PLIC0_CLAIM_BUDGET 8
+#endif
+
+/*! @def METAL_RISCV_PLIC0_BALANCE_THRESHOLD
+ * @brief How much less time, as a percentage of the busiest hart's handler
+ * time, the least busy hart must have spent in handlers before
+ * riscv_plic0_irq_balance() moves sources between them
+ */
+#ifndef METAL_RISCV_PLIC0_BALANCE_THRESHOLD
+#define METAL_RISCV_PLIC0_BALANCE_THRESHOLD 25
+#endif
+
 struct __metal_driver_vtable_riscv_plic0 {
     struct metal_interrupt_vtable plic_vtable;
 };
 
 __METAL_DECLARE_VTABLE(__metal_driver_vtable_riscv_plic0)
 
+/*! @brief Dispatch statistics of a PLIC interrupt source */
+struct riscv_plic0_irq_stats {
+    /*! @brief Number of times the handler has been called */
+    unsigned long dispatches;
+    /*! @brief Total mcycle count spent in the handler */
+    unsigned long long cycles;
+    /*! @brief The hart the source is routed to, or -1 if it is disabled or
+     * was routed with the affinity API */
+    int hartid;
+    /*! @brief Whether riscv_plic0_irq_balance() leaves the source alone */
+    int pinned;
+};
+
+/* Routing and accounting for one interrupt source. context is the only PLIC
+ * context the source is routed to, or -1 if it is disabled or its contexts
+ * are managed with the affinity API. Pinned sources keep their context while
+ * disabled. next_context is where the balancer wants
+ * it moved once its current handler has completed. cycles_seq is odd while
+ * the handling hart updates dispatches and cycles. */
+struct __metal_plic0_source {
+    volatile unsigned int cycles_seq;
+    unsigned long dispatches;
+    unsigned long long cycles;
+    unsigned long long balanced_cycles;
+    unsigned long long load;
+    int context;
+    int next_context;
+    int pinned;
+};
+
 #define __METAL_MACHINE_MACROS
 #include <metal/machine.h>
 struct __metal_driver_riscv_plic0 {
     struct metal_interrupt controller;
     int init_done;
+    int nesting;
     metal_interrupt_handler_t metal_exint_table[__METAL_PLIC_SUBINTERRUPTS];
     __metal_interrupt_data metal_exdata_table[__METAL_PLIC_SUBINTERRUPTS];
+    struct __metal_plic0_source metal_source_table[__METAL_PLIC_SUBINTERRUPTS];
+    int online_contexts[__METAL_PLIC_NUM_PARENTS];
 };
 #undef __METAL_MACHINE_MACROS
 
+/*!
+ * @brief Let riscv_plic0_irq_balance() move interrupt sources to the calling
+ * hart
+ *
+ * Enables the external interrupt on the calling hart. The hart which
+ * initializes the PLIC is added by metal_interrupt_init().
+ *
+ * @param controller The PLIC
+ * @return 0 on success, or -1 if the calling hart has no PLIC context
+ */
+int riscv_plic0_add_hart(struct metal_interrupt *controller);
+
+/*!
+ * @brief Move an interrupt source to a hart and keep it there
+ * @param controller The PLIC
+ * @param id The interrupt source
+ * @param hartid The hart to move the source to, or -1 to leave the source
+ * where it is and let riscv_plic0_irq_balance() move it again
+ * @return 0 on success, or -1 if the source or hart is invalid
+ */
+int riscv_plic0_irq_pin(struct metal_interrupt *controller, int id,
+                        int hartid);
+
+/*!
+ * @brief Spread the interrupt handler time evenly across harts
+ *
+ * Measures how long each hart has spent in the handlers of its sources since
+ * the last call, then moves the heaviest sources which narrow the difference
+ * from the busiest hart to the least busy one. Pinned sources and sources
+ * routed with the affinity API are never moved. A source moves once its
+ * handler next completes, so no claim is lost.
+ *
+ * Call it periodically, for example from a timer interrupt, on any hart.
+ *
+ * @param controller The PLIC
+ * @return The number of sources moved
+ */
+int riscv_plic0_irq_balance(struct metal_interrupt *controller);
+
+/*!
+ * @brief Get the dispatch statistics of an interrupt source
+ * @param controller The PLIC
+ * @param id The interrupt source
+ * @param stats Filled in with the statistics
+ * @return 0 on success, or -1 if the source is invalid
+ */
+int riscv_plic0_get_irq_stats(struct metal_interrupt *controller, int id,
+                              struct riscv_plic0_irq_stats *stats);
+
 #endif
@@ -34,6 +34,7 @@ __METAL_DECLARE_VTABLE(__metal_driver_vtable_sifive_clic0)
 struct __metal_driver_sifive_clic0 {
     struct metal_interrupt controller;
     int init_done;
+    int nesting;
     struct {
     } __attribute__((aligned(64)));
     metal_interrupt_vector_handler_t
@@ -45,4 +46,43 @@ struct __metal_driver_sifive_clic0 {
 int __metal_driver_sifive_clic0_command_request(
     struct metal_interrupt *controller, int command, void *data);
 
+void __metal_clic0_tail_chain(void);
+
+/*!
+ * @def SIFIVE_CLIC0_FAST_HANDLER
+ * @brief Define an entry for sifive_clic0_set_fast_handler() which calls a C
+ * function
+ *
+ * The entry saves the registers the calling convention doesn't preserve, calls
+ * fn, then services any non-vectored interrupt that became pending meanwhile
+ * before restoring them, rather than returning only to be trapped again.
+ *
+ * @param name The name of the entry
+ * @param fn A function taking no arguments
+ */
+#define SIFIVE_CLIC0_FAST_HANDLER(name, fn)                                    \
+    void __attribute__((interrupt, aligned(4))) name(void) {                   \
+        fn();                                                                  \
+        __metal_clic0_tail_chain();                                            \
+    }
+
+/*!
+ * @brief Send an interrupt straight to its own handler
+ *
+ * Hardware vectoring jumps to the handler on the interrupt, without going
+ * through the trap entry or the handler table. Enables selective hardware
+ * vectoring on the CLIC if it isn't enabled yet. The handler is called as the
+ * trap entry, so it must be an interrupt function, naked, or defined with
+ * SIFIVE_CLIC0_FAST_HANDLER().
+ *
+ * @param controller The CLIC
+ * @param id The interrupt
+ * @param handler The handler, or NULL to return the interrupt to the handler
+ * registered with metal_interrupt_register_handler()
+ * @return 0 on success, or -1 if the interrupt is invalid or the CLIC is in a
+ * mode where every interrupt is vectored
+ */
+int sifive_clic0_set_fast_handler(struct metal_interrupt *controller, int id,
+                                  metal_interrupt_vector_handler_t handler);
+
 #endif
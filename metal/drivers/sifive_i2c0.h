@@ -19,6 +19,16 @@ struct __metal_driver_sifive_i2c0 {
     unsigned int baud_rate;
     metal_clock_callback pre_rate_change_callback;
     metal_clock_callback post_rate_change_callback;
+    /* Queue of asynchronous transfers, serviced by the I2C interrupt */
+    struct metal_interrupt *async_intc;
+    struct metal_i2c_request *async_head;
+    struct metal_i2c_request *async_tail;
+    int async_state;
+    unsigned int async_msg;
+    unsigned int async_index;
+    int async_result;
+    /* Finished transfers whose callbacks haven't been called yet */
+    struct metal_i2c_request *async_done;
 };
 
 #endif
@@ -9,6 +9,15 @@
 #include <metal/drivers/sifive_gpio0.h>
 #include <metal/io.h>
 #include <metal/spi.h>
+#include <stdint.h>
+
+/*! @def METAL_SIFIVE_SPI0_PREPARED_CONFIGS
+ * @brief The number of configurations each SPI device can hold prepared by
+ * metal_spi_prepare()
+ */
+#ifndef METAL_SIFIVE_SPI0_PREPARED_CONFIGS
+#define METAL_SIFIVE_SPI0_PREPARED_CONFIGS 4
+#endif
 
 struct __metal_driver_vtable_sifive_spi0 {
     const struct metal_spi_vtable spi;
@@ -16,11 +25,136 @@ struct __metal_driver_vtable_sifive_spi0 {
 
 __METAL_DECLARE_VTABLE(__metal_driver_vtable_sifive_spi0)
 
+/*! @brief The format of the reads issued by the memory-mapped flash
+ * interface
+ *
+ * Used with sifive_spi0_set_flash_format(). For example, a quad I/O fast read
+ * (1-4-4, command 0xEB) on most parts uses a 3 byte address, the command sent
+ * on one line, the address and data on four lines, and 6 dummy cycles, the
+ * first two of which carry the mode bits in pad_code.
+ */
+struct sifive_spi0_flash_format {
+    /*! @brief Send cmd_code before the address. Parts which support a
+     * continuous read mode can leave it out once they have been put in that
+     * mode with the mode bits in pad_code. */
+    unsigned int cmd_enable;
+    /*! @brief Number of address bytes, 0 to 4 */
+    unsigned int addr_len;
+    /*! @brief Number of dummy cycles between the address and the data */
+    unsigned int dummy_cycles;
+    /*! @brief Protocol for the command, METAL_SPI_SINGLE, METAL_SPI_DUAL or
+     * METAL_SPI_QUAD */
+    unsigned int cmd_proto;
+    /*! @brief Protocol for the address */
+    unsigned int addr_proto;
+    /*! @brief Protocol for the data */
+    unsigned int data_proto;
+    /*! @brief The read command */
+    uint8_t cmd_code;
+    /*! @brief Sent during the first dummy cycles, for the mode bits */
+    uint8_t pad_code;
+};
+
+/*!
+ * @brief Set the format of the reads issued by the memory-mapped flash
+ * interface
+ *
+ * Safe to call while executing from the flash, the interface is only switched
+ * out of memory-mapped mode by code placed in the ITIM.
+ *
+ * @param spi The handle for the SPI device with the flash interface
+ * @param format The read format
+ * @return 0 on success, or -1 if the format cannot be represented
+ */
+int sifive_spi0_set_flash_format(struct metal_spi *spi,
+                                 const struct sifive_spi0_flash_format *format);
+
+/*!
+ * @brief Switch the flash interface to memory-mapped mode
+ *
+ * While memory-mapped mode is enabled, synchronous transfers through the
+ * metal_spi API are refused until sifive_spi0_xip_allow_pio() is called, and
+ * asynchronous transfers are always refused. See sifive_spi0_xip_allow_pio().
+ *
+ * Memory-mapped mode is enabled at init if the flash interface was left in
+ * that mode, usually by the boot ROM.
+ *
+ * @param spi The handle for the SPI device with the flash interface
+ */
+void sifive_spi0_xip_enable(struct metal_spi *spi);
+
+/*!
+ * @brief Leave the flash interface in programmed I/O mode
+ *
+ * Nothing can be fetched from the flash afterwards, so the caller, the
+ * library and every interrupt handler must be linked outside of it. Refused
+ * unless sifive_spi0_xip_allow_pio() has been called.
+ *
+ * @param spi The handle for the SPI device with the flash interface
+ * @return 0 on success, or -1 if it was refused
+ */
+int sifive_spi0_xip_disable(struct metal_spi *spi);
+
+/*!
+ * @brief Allow programmed I/O on the flash interface in memory-mapped mode
+ *
+ * A transfer through the metal_spi API switches the flash interface to
+ * programmed I/O mode while it runs and back to memory-mapped mode
+ * afterwards. Nothing can be fetched from the flash in between, so the
+ * transfer runs with interrupts disabled, and the caller and the library must
+ * be linked outside of the flash, for example in RAM. Call this to say that
+ * they are. Until then such transfers fail.
+ *
+ * The instruction cache is invalidated after the transfer which follows a
+ * Write Enable command (0x06), which is the only one that can change the
+ * flash, so reads cost no refetches.
+ *
+ * @param spi The handle for the SPI device with the flash interface
+ * @param allow Non-zero to allow programmed I/O, 0 to refuse it again
+ */
+void sifive_spi0_xip_allow_pio(struct metal_spi *spi, int allow);
+
+/* The registers programmed from a struct metal_spi_config */
+struct __metal_sifive_spi0_regs {
+    uint32_t fmt;
+    uint32_t sckmode;
+    uint32_t csdef;
+    uint32_t csid;
+    uint32_t fctrl;
+};
+
+struct __metal_sifive_spi0_prepared {
+    int used;
+    struct metal_spi_config config;
+    struct __metal_sifive_spi0_regs regs;
+};
+
 struct __metal_driver_sifive_spi0 {
     struct metal_spi spi;
     unsigned long baud_rate;
     metal_clock_callback pre_rate_change_callback;
     metal_clock_callback post_rate_change_callback;
+    /* The values last written to the configuration registers, so that
+     * transfers only need to write the ones which change */
+    int shadow_valid;
+    struct __metal_sifive_spi0_regs shadow;
+    int xip_enabled;
+    /* Set by sifive_spi0_xip_allow_pio() */
+    int xip_pio_allowed;
+    /* The last transfer was a Write Enable command */
+    int xip_write_enabled;
+    struct __metal_sifive_spi0_prepared
+        prepared[METAL_SIFIVE_SPI0_PREPARED_CONFIGS];
+    /* Queue of asynchronous transfers, serviced by the RXWM interrupt */
+    struct metal_interrupt *async_intc;
+    struct metal_spi_request *async_head;
+    struct metal_spi_request *async_tail;
+    /* Finished transfers whose callbacks haven't been called yet */
+    struct metal_spi_request *async_done;
+    int async_started;
+    int async_phase;
+    size_t async_tx;
+    size_t async_rx;
 };
 
 #endif
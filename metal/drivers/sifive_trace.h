@@ -4,9 +4,43 @@
 #ifndef METAL__DRIVERS__SIFIVE_TRACE_H
 #define METAL__DRIVERS__SIFIVE_TRACE_H
 
+/*!
+ * @file sifive_trace.h
+ *
+ * @brief API for writing to the SiFive trace encoder's ITC stimulus channels
+ *
+ * Written through the UART interface, each hart's output goes to its own ITC
+ * channel, selected by METAL_SIFIVE_TRACE_HART_CHANNEL(). Other subsystems can
+ * write to channels of their own with sifive_trace_channel_write().
+ */
+
 #include <metal/compiler.h>
 #include <metal/io.h>
 #include <metal/uart.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief The number of ITC stimulus channels */
+#define METAL_SIFIVE_TRACE_ITC_CHANNELS 32
+
+/*! @def METAL_SIFIVE_TRACE_HART_CHANNEL
+ * @brief The ITC channel written by a hart through the UART interface
+ */
+#ifndef METAL_SIFIVE_TRACE_HART_CHANNEL
+#define METAL_SIFIVE_TRACE_HART_CHANNEL(hartid) (hartid)
+#endif
+
+/*! @def METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL
+ * @brief The ITC channel which timestamp markers are written to
+ *
+ * A marker is the low and then the high 32 bits of mtime, which are never
+ * separated by another hart's marker. If
+ * METAL_SIFIVE_TRACE_TIMESTAMPS is defined, a marker is written before each
+ * write through the UART interface or sifive_trace_channel_write().
+ */
+#ifndef METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL
+#define METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL 31
+#endif
 
 struct __metal_driver_vtable_sifive_trace {
     const struct metal_uart_vtable uart;
@@ -20,4 +54,34 @@ struct __metal_driver_sifive_trace {
     struct metal_uart uart;
 };
 
+/*! @brief Enable an ITC stimulus channel.
+ * @param trace The trace encoder.
+ * @param channel The channel to enable.
+ * @return 0 If no error.*/
+int sifive_trace_channel_enable(struct metal_uart *trace, unsigned int channel);
+
+/*! @brief Write bytes to an ITC stimulus channel.
+ *         Whole 32-bit words are written back-to-back, followed by a 16 and/or
+ *         8-bit write for any remaining bytes.
+ * @param trace The trace encoder.
+ * @param channel The channel to write to.
+ * @param buf The bytes to write.
+ * @param len The number of bytes to write.
+ * @return 0 If no error.*/
+int sifive_trace_channel_write(struct metal_uart *trace, unsigned int channel,
+                               const void *buf, size_t len);
+
+/*! @brief Write a single 32-bit word to an ITC stimulus channel.
+ * @param trace The trace encoder.
+ * @param channel The channel to write to.
+ * @param value The word to write.
+ * @return 0 If no error.*/
+int sifive_trace_channel_write_uint32(struct metal_uart *trace,
+                                      unsigned int channel, uint32_t value);
+
+/*! @brief Write the current mtime to METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL.
+ * @param trace The trace encoder.
+ * @return 0 If no error.*/
+int sifive_trace_timestamp(struct metal_uart *trace);
+
 #endif /* METAL__DRIVERS__SIFIVE_TRACE_H */
@@ -11,6 +11,18 @@
 #include <metal/io.h>
 #include <metal/uart.h>
 
+/* Size of the software transmit ring used by metal_uart_write(). Must be a
+ * power of two. */
+#ifndef METAL_SIFIVE_UART0_TX_RING_SIZE
+#define METAL_SIFIVE_UART0_TX_RING_SIZE 256
+#endif
+
+/* Size of the software receive ring filled by the RXWM interrupt and by
+ * metal_uart_read(). Must be a power of two. */
+#ifndef METAL_SIFIVE_UART0_RX_RING_SIZE
+#define METAL_SIFIVE_UART0_RX_RING_SIZE 256
+#endif
+
 struct __metal_driver_vtable_sifive_uart0 {
     const struct metal_uart_vtable uart;
 };
@@ -24,6 +36,34 @@ struct __metal_driver_sifive_uart0 {
     unsigned long baud_rate;
     metal_clock_callback pre_rate_change_callback;
     metal_clock_callback post_rate_change_callback;
+    int buffered;
+    volatile unsigned int tx_head;
+    volatile unsigned int tx_tail;
+    unsigned char tx_ring[METAL_SIFIVE_UART0_TX_RING_SIZE];
+    volatile unsigned int rx_head;
+    volatile unsigned int rx_tail;
+    unsigned char rx_ring[METAL_SIFIVE_UART0_RX_RING_SIZE];
 };
 
+/*!
+ * @brief Service the UART from its interrupt
+ *
+ * By default the UART interrupt is left to the application, and
+ * metal_uart_write() returns once every character is in the hardware FIFO.
+ * Once enabled, the driver takes over the interrupt: metal_uart_write()
+ * returns as soon as the characters fit in the transmit ring, which the TXWM
+ * interrupt then empties, and the RXWM interrupt moves received characters
+ * into the receive ring.
+ *
+ * The interrupt may be delivered to any hart. metal_uart_flush() and writes
+ * to a full ring empty the ring from the calling hart, so they don't depend
+ * on that hart taking interrupts. Disable buffering before installing another
+ * handler for the UART interrupt.
+ *
+ * @param uart The UART device handle
+ * @param enable Non-zero to take over the interrupt, 0 to hand it back
+ * @return 0 on success, or -1 if the UART interrupt can't be used
+ */
+int sifive_uart0_set_buffered(struct metal_uart *uart, int enable);
+
 #endif
@@ -7,6 +7,15 @@
 #include <metal/compiler.h>
 #include <metal/shutdown.h>
 #include <metal/uart.h>
+#include <stddef.h>
+
+/*! @def METAL_UCB_HTIF0_BUFFER_SIZE
+ * @brief Size in bytes of the buffer which collects console output written a
+ * character at a time
+ */
+#ifndef METAL_UCB_HTIF0_BUFFER_SIZE
+#define METAL_UCB_HTIF0_BUFFER_SIZE 64
+#endif
 
 struct __metal_driver_vtable_ucb_htif0_shutdown {
     const struct __metal_shutdown_vtable shutdown;
@@ -23,6 +32,9 @@ void __metal_driver_ucb_htif0_exit(const struct __metal_shutdown *test,
 
 void __metal_driver_ucb_htif0_init(struct metal_uart *uart, int baud_rate);
 int __metal_driver_ucb_htif0_putc(struct metal_uart *uart, int c);
+int __metal_driver_ucb_htif0_write(struct metal_uart *uart, const char *buf,
+                                   size_t len);
+int __metal_driver_ucb_htif0_flush(struct metal_uart *uart);
 int __metal_driver_ucb_htif0_getc(struct metal_uart *uart, int *c);
 int __metal_driver_ucb_htif0_get_baud_rate(struct metal_uart *guart);
 int __metal_driver_ucb_htif0_set_baud_rate(struct metal_uart *guart,
@@ -31,6 +43,32 @@ struct metal_interrupt *
 __metal_driver_ucb_htif0_interrupt_controller(struct metal_uart *uart);
 int __metal_driver_ucb_htif0_get_interrupt_id(struct metal_uart *uart);
 
+/*! @brief Open a file on the host.
+ * @param name The path of the file on the host.
+ * @param flags The open() flags.
+ * @param mode The permissions of a newly created file.
+ * @return The host file descriptor, or a negative errno.*/
+int ucb_htif0_open(const char *name, int flags, int mode);
+
+/*! @brief Close a file on the host.
+ * @param fd The host file descriptor.
+ * @return 0, or a negative errno.*/
+int ucb_htif0_close(int fd);
+
+/*! @brief Read from a file on the host.
+ * @param fd The host file descriptor.
+ * @param buf The buffer to read into.
+ * @param len The size of buf.
+ * @return The number of bytes read, or a negative errno.*/
+long ucb_htif0_read(int fd, void *buf, size_t len);
+
+/*! @brief Write to a file on the host.
+ * @param fd The host file descriptor.
+ * @param buf The bytes to write.
+ * @param len The number of bytes to write.
+ * @return The number of bytes written, or a negative errno.*/
+long ucb_htif0_write(int fd, const void *buf, size_t len);
+
 __METAL_DECLARE_VTABLE(__metal_driver_vtable_ucb_htif0_shutdown)
 
 __METAL_DECLARE_VTABLE(__metal_driver_vtable_ucb_htif0_uart)
@@ -0,0 +1,121 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef METAL__FLASH_H
+#define METAL__FLASH_H
+
+/*!
+ * @file flash.h
+ * @brief API for serial NOR flash devices on a SPI bus
+ *
+ * metal_flash_init() reads the JEDEC ID of the part and, if it has one, its
+ * Serial Flash Discoverable Parameters (SFDP) table. The table gives the size
+ * of the part, its erase commands and the fast read commands it supports, of
+ * which the fastest the SPI controller can issue is used by
+ * metal_flash_read().
+ *
+ * Commands are issued with metal_spi_transaction(), so that the command,
+ * address and data can each be sent with their own protocol. The SPI device
+ * must be initialized with a baud rate the part supports for all of its read
+ * commands before calling metal_flash_init().
+ */
+
+#include <metal/spi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @def METAL_FLASH_TIMEOUT_US
+ * @brief How long to wait for a program or erase to finish
+ */
+#ifndef METAL_FLASH_TIMEOUT_US
+#define METAL_FLASH_TIMEOUT_US 5000000
+#endif
+
+/*! @brief A handle for a serial NOR flash device */
+struct metal_flash {
+    /*! @brief The SPI device the flash is attached to */
+    struct metal_spi *spi;
+    /*! @brief The configuration used for every transaction */
+    struct metal_spi_config config;
+    /*! @brief Manufacturer and device ID returned by the JEDEC ID command */
+    uint8_t jedec_id[3];
+    /*! @brief Size of the part in bytes, or 0 if the part has no SFDP table */
+    size_t size;
+    /*! @brief Size of a program page in bytes */
+    size_t page_size;
+    /*! @brief Number of address bytes sent with each command */
+    unsigned int addr_len;
+    /*! @brief The read command used by metal_flash_read() */
+    struct {
+        uint8_t opcode;
+        /*! @brief Protocol for the address and dummy cycles */
+        unsigned int addr_proto;
+        /*! @brief Protocol for the data */
+        unsigned int data_proto;
+        /*! @brief Number of bytes sent during the dummy cycles */
+        unsigned int dummy_len;
+    } read;
+    /*! @brief The 4 KiB erase command, or 0 if the part has none */
+    uint8_t erase_4k_opcode;
+    /*! @brief The 64 KiB erase command, or 0 if the part has none */
+    uint8_t erase_64k_opcode;
+};
+
+/*!
+ * @brief Probe a flash device
+ *
+ * Parts larger than 16 MiB are switched to 4 byte addressing. If the
+ * selected read command transfers data over four lines, the part's Quad
+ * Enable bit is set.
+ *
+ * @param flash The handle to initialize
+ * @param spi The SPI device the flash is attached to
+ * @param csid The chip select the flash is attached to
+ * @return 0 on success, or -1 if no flash responds
+ */
+int metal_flash_init(struct metal_flash *flash, struct metal_spi *spi,
+                     unsigned int csid);
+
+/*!
+ * @brief Read from the flash
+ * @param flash The handle for the flash device
+ * @param addr The address to read from
+ * @param buf The buffer to read into
+ * @param len The number of bytes to read
+ * @return 0 on success, or -1 on failure
+ */
+int metal_flash_read(struct metal_flash *flash, size_t addr, void *buf,
+                     size_t len);
+
+/*!
+ * @brief Program the flash
+ *
+ * The range is split at page boundaries and waits for each page to be
+ * programmed. Programming can only clear bits, the range should normally be
+ * erased first.
+ *
+ * @param flash The handle for the flash device
+ * @param addr The address to program
+ * @param buf The data to program
+ * @param len The number of bytes to program
+ * @return 0 on success, or -1 on failure
+ */
+int metal_flash_program(struct metal_flash *flash, size_t addr,
+                        const void *buf, size_t len);
+
+/*!
+ * @brief Erase the flash
+ *
+ * Uses 64 KiB erases wherever the range allows and 4 KiB erases for the rest,
+ * and waits for each erase to finish.
+ *
+ * @param flash The handle for the flash device
+ * @param addr The start of the range to erase, which must be aligned to the
+ * smallest erase size of the part
+ * @param len The length of the range, which must be a multiple of the smallest
+ * erase size of the part
+ * @return 0 on success, or -1 on failure
+ */
+int metal_flash_erase(struct metal_flash *flash, size_t addr, size_t len);
+
+#endif
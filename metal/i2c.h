@@ -4,6 +4,8 @@
 #ifndef METAL__I2C_H
 #define METAL__I2C_H
 
+#include <stddef.h>
+
 /*! @brief Enums to enable/disable stop condition. */
 typedef enum {
     METAL_I2C_STOP_DISABLE = 0,
@@ -14,6 +16,75 @@ typedef enum {
 typedef enum { METAL_I2C_SLAVE = 0, METAL_I2C_MASTER = 1 } metal_i2c_mode_t;
 
 struct metal_i2c;
+struct metal_i2c_request;
+struct metal_interrupt;
+
+/*! @brief Flags for struct metal_i2c_msg */
+typedef enum {
+    /*! @brief Write the message to the slave */
+    METAL_I2C_MSG_WRITE = 0,
+    /*! @brief Read the message from the slave */
+    METAL_I2C_MSG_READ = 1
+} metal_i2c_msg_flags_t;
+
+/*! @brief One message of a multi-message I2C transfer */
+struct metal_i2c_msg {
+    /*! @brief The I2C slave address for the message */
+    unsigned int addr;
+    /*! @brief METAL_I2C_MSG_WRITE or METAL_I2C_MSG_READ */
+    unsigned int flags;
+    /*! @brief The number of bytes to transfer. A message of 0 bytes only
+     * addresses the slave, and fails if the slave doesn't acknowledge. */
+    unsigned int len;
+    /*! @brief The data to write, or the buffer to read into */
+    unsigned char *buf;
+};
+
+/*! @brief Called when an asynchronous I2C transfer finishes
+ *
+ * The next queued transfer has already been started by then, and the callback
+ * may queue more transfers, including the one which finished.
+ *
+ * @param i2c The handle for the I2C device which performed the transfer
+ * @param request The transfer which finished
+ */
+typedef void (*metal_i2c_callback)(struct metal_i2c *i2c,
+                                   struct metal_i2c_request *request);
+
+/*! @brief An asynchronous I2C transfer
+ *
+ * Writes txlen bytes and then reads rxlen bytes, with a repeated start in
+ * between, like metal_i2c_transfer(). If msgs is not NULL, the nmsgs messages
+ * it points to are transferred instead, like metal_i2c_transfer_msgs(). The
+ * request and its buffers belong to the driver from the call to
+ * metal_i2c_transfer_async() until done is set.
+ */
+struct metal_i2c_request {
+    /*! @brief The I2C slave address */
+    unsigned int addr;
+    /*! @brief The data to write */
+    unsigned char *txbuf;
+    /*! @brief The number of bytes to write, may be 0 */
+    unsigned int txlen;
+    /*! @brief The buffer to read into */
+    unsigned char *rxbuf;
+    /*! @brief The number of bytes to read, may be 0 */
+    unsigned int rxlen;
+    /*! @brief Messages to transfer instead of txbuf and rxbuf, or NULL */
+    struct metal_i2c_msg *msgs;
+    /*! @brief The number of messages */
+    unsigned int nmsgs;
+    /*! @brief Called when the transfer finishes, may be NULL */
+    metal_i2c_callback callback;
+    /*! @brief Passed through to the callback */
+    void *priv;
+    /*! @brief Set to 1 once the transfer has finished */
+    volatile int done;
+    /*! @brief 0 if the transfer succeeded, valid once done is set */
+    int result;
+    /* The next request queued on the same device */
+    struct metal_i2c_request *next;
+};
 
 struct metal_i2c_vtable {
     void (*init)(struct metal_i2c *i2c, unsigned int baud_rate,
@@ -27,6 +98,12 @@ struct metal_i2c_vtable {
                     unsigned char rxbuf[], unsigned int rxlen);
     int (*get_baud_rate)(struct metal_i2c *i2c);
     int (*set_baud_rate)(struct metal_i2c *i2c, unsigned int baud_rate);
+    int (*transfer_msgs)(struct metal_i2c *i2c, struct metal_i2c_msg msgs[],
+                         unsigned int count);
+    int (*async_init)(struct metal_i2c *i2c, struct metal_interrupt *intc,
+                      int id);
+    int (*transfer_async)(struct metal_i2c *i2c,
+                          struct metal_i2c_request *request);
 };
 
 /*! @brief A handle for a I2C device. */
@@ -92,6 +169,68 @@ inline int metal_i2c_transfer(struct metal_i2c *i2c, unsigned int addr,
     return i2c->vtable->transfer(i2c, addr, txbuf, txlen, rxbuf, rxlen);
 }
 
+/*! @brief Performs several I2C reads and writes as one bus transaction.
+ *
+ * The messages are transferred in order with a repeated START condition
+ * between them and a single STOP condition at the end, so no other master
+ * can take the bus part way through. Messages may be addressed to different
+ * slaves. A message with a length of 0 sends only the START and the
+ * address, and the transfer fails if the slave doesn't acknowledge it.
+ *
+ * @param i2c The handle for the I2C device to perform the transfer operation.
+ * @param msgs The messages to transfer.
+ * @param count The number of messages.
+ * @return 0 if the transfer succeeds.
+ */
+inline int metal_i2c_transfer_msgs(struct metal_i2c *i2c,
+                                   struct metal_i2c_msg msgs[],
+                                   unsigned int count) {
+    if (i2c->vtable->transfer_msgs == NULL) {
+        return -1;
+    }
+    return i2c->vtable->transfer_msgs(i2c, msgs, count);
+}
+
+/*! @brief Enable asynchronous transfers on a I2C device.
+ *
+ * Asynchronous transfers are driven by the I2C device's interrupt, which the
+ * driver takes ownership of.
+ *
+ * @param i2c The handle for the I2C device.
+ * @param intc The interrupt controller the I2C device's interrupt is routed to.
+ * @param id The I2C device's interrupt id on intc.
+ * @return 0 on success, or -1 if the interrupt could not be registered or the
+ * device does not support asynchronous transfers.
+ */
+inline int metal_i2c_async_init(struct metal_i2c *i2c,
+                                struct metal_interrupt *intc, int id) {
+    if (i2c->vtable->async_init == NULL) {
+        return -1;
+    }
+    return i2c->vtable->async_init(i2c, intc, id);
+}
+
+/*! @brief Queue a I2C transfer and return without waiting for it.
+ *
+ * Transfers are performed in the order they are queued, each advanced by one
+ * interrupt per byte. When a transfer finishes request->done is set and
+ * request->callback is called, usually from the I2C interrupt handler.
+ * Synchronous transfers and changes to the clock rate wait for the queue to
+ * empty first, in which case callbacks are called from there instead.
+ *
+ * @param i2c The handle for the I2C device to perform the transfer.
+ * @param request The transfer to perform.
+ * @return 0 if the transfer was queued, or -1 if asynchronous transfers have
+ * not been enabled with metal_i2c_async_init().
+ */
+inline int metal_i2c_transfer_async(struct metal_i2c *i2c,
+                                    struct metal_i2c_request *request) {
+    if (i2c->vtable->transfer_async == NULL) {
+        return -1;
+    }
+    return i2c->vtable->transfer_async(i2c, request);
+}
+
 /*! @brief Get the current baud rate of the I2C device.
  * @param i2c The handle for the I2C device.
  * @return The baud rate in Hz.
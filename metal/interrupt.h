@@ -109,6 +109,8 @@ struct metal_interrupt_vtable {
         unsigned int threshold);
     unsigned int (*interrupt_affinity_get_threshold)(
         struct metal_interrupt *controller, int context_id);
+    int (*interrupt_set_nesting)(struct metal_interrupt *controller,
+                                 int enable);
 };
 
 /*!
@@ -359,6 +361,29 @@ metal_interrupt_get_preemptive_level(struct metal_interrupt *controller,
         return 0;
 }
 
+/*!
+ * @brief Let higher priority interrupts preempt the handlers of a controller
+ *
+ * Handlers are normally run with interrupts disabled. With nesting enabled,
+ * the controller re-enables them around each handler once it has masked the
+ * interrupts which must not preempt it. The PLIC raises its threshold to the
+ * priority of the interrupt being handled, which leaves the CPU's own timer
+ * and software interrupts able to preempt any PLIC handler. The CLIC lets
+ * interrupts of a higher level preempt, see
+ * metal_interrupt_set_preemptive_level().
+ *
+ * @param controller The handle for the interrupt controller
+ * @param enable Non-zero to enable nesting, 0 to disable it
+ * @return 0 upon success, or -1 if the controller doesn't support nesting
+ */
+__inline__ int metal_interrupt_set_nesting(struct metal_interrupt *controller,
+                                           int enable) {
+    if (controller->vtable->interrupt_set_nesting)
+        return controller->vtable->interrupt_set_nesting(controller, enable);
+    else
+        return -1;
+}
+
 /*!
  * @brief Enable an interrupt vector
  * @param controller The handle for the interrupt controller
@@ -0,0 +1,160 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef METAL__IRQSTAT_H
+#define METAL__IRQSTAT_H
+
+/*!
+ * @file irqstat.h
+ * @brief API for measuring interrupt handlers
+ *
+ * When the library is built with METAL_IRQSTAT defined, the CPU, PLIC and
+ * CLIC dispatchers count the calls to each handler and measure the mcycle
+ * count spent in it. For the timer interrupt they also measure how many
+ * mtime ticks after the programmed mtimecmp the handler was entered. Each
+ * hart keeps its own statistics, with the handler times and latencies in
+ * histograms of power of two buckets.
+ *
+ * Recording starts once metal_irqstat_enable() is called. It costs a few
+ * instructions per interrupt while stopped, and nothing when the library is
+ * built without METAL_IRQSTAT, in which case metal_irqstat_get() fails and
+ * metal_irqstat_dump() prints nothing.
+ *
+ * Handlers installed with sifive_clic0_set_fast_handler() or in the CLINT
+ * vector table aren't measured, as they don't go through a dispatcher.
+ */
+
+#include <metal/interrupt.h>
+
+/*! @def METAL_IRQSTAT_MAX_ID
+ * @brief The number of interrupt IDs of each controller which are measured
+ */
+#ifndef METAL_IRQSTAT_MAX_ID
+#define METAL_IRQSTAT_MAX_ID 32
+#endif
+
+/*! @def METAL_IRQSTAT_BUCKETS
+ * @brief The number of histogram buckets. Bucket n counts the values from
+ * 2^n to 2^(n+1) - 1, the first bucket also counts 0, and the last bucket
+ * counts everything above it.
+ */
+#ifndef METAL_IRQSTAT_BUCKETS
+#define METAL_IRQSTAT_BUCKETS 16
+#endif
+
+/*! @brief The interrupt controllers which are measured */
+typedef enum {
+    METAL_IRQSTAT_CPU,
+    METAL_IRQSTAT_PLIC,
+    METAL_IRQSTAT_CLIC,
+    METAL_IRQSTAT_CONTROLLERS,
+} metal_irqstat_controller;
+
+/*! @brief The statistics of one interrupt on one hart */
+struct metal_irqstat {
+    /*! @brief Number of times the handler was called */
+    unsigned long count;
+    /*! @brief Total mcycle count spent in the handler */
+    unsigned long long cycles;
+    /*! @brief The longest call of the handler, in cycles */
+    unsigned long max_cycles;
+    /*! @brief Histogram of the cycles spent in each call */
+    unsigned long cycles_hist[METAL_IRQSTAT_BUCKETS];
+    /*! @brief Histogram of the mtime ticks from mtimecmp to the timer handler
+     * being called */
+    unsigned long latency_hist[METAL_IRQSTAT_BUCKETS];
+    /*! @brief Number of times the rate budget masked the interrupt */
+    unsigned long throttled;
+    /*! @brief Calls since window_start, for the rate budget */
+    unsigned long window_count;
+    /*! @brief mcycle at the start of the current rate budget window */
+    unsigned long window_start;
+};
+
+/*!
+ * @brief Decide whether to mask an interrupt which exceeded its rate budget
+ *
+ * Called from the dispatcher right after a handler which has been called more
+ * than the budget allows returns.
+ *
+ * @param controller The interrupt controller the interrupt belongs to
+ * @param id The interrupt
+ * @param stat The statistics of the interrupt on the calling hart
+ * @return Non-zero to disable the interrupt, 0 to leave it enabled
+ */
+typedef int (*metal_irqstat_policy_t)(struct metal_interrupt *controller,
+                                      int id,
+                                      const struct metal_irqstat *stat);
+
+/*!
+ * @brief Start or stop recording interrupt statistics
+ * @param enable Non-zero to start recording, 0 to stop
+ */
+void metal_irqstat_enable(int enable);
+
+/*!
+ * @brief Clear the statistics of every hart
+ */
+void metal_irqstat_reset(void);
+
+/*!
+ * @brief Get the statistics of an interrupt
+ * @param hartid The hart the interrupt was handled on
+ * @param controller The controller the interrupt belongs to
+ * @param id The interrupt
+ * @param stat Filled in with the statistics
+ * @return 0 on success, or -1 if the interrupt isn't measured
+ */
+int metal_irqstat_get(int hartid, metal_irqstat_controller controller, int id,
+                      struct metal_irqstat *stat);
+
+/*!
+ * @brief Limit how often an interrupt may be handled
+ *
+ * An interrupt whose handler is called more than count times within window
+ * cycles is passed to the policy set with metal_irqstat_set_policy(). By
+ * default it is disabled, so that a storm can't starve the rest of the
+ * system. It stays disabled until it is enabled again with
+ * metal_interrupt_enable().
+ *
+ * The external interrupt line of the CPU and of the CLIC isn't limited, since
+ * every PLIC interrupt comes in through it. The PLIC interrupts are limited
+ * one by one instead.
+ *
+ * @param count The most calls allowed in a window, or 0 for no limit
+ * @param window The length of a window in mcycle counts
+ */
+void metal_irqstat_set_budget(unsigned long count, unsigned long window);
+
+/*!
+ * @brief Set the policy for interrupts which exceed their rate budget
+ * @param policy The policy, or NULL to disable every such interrupt
+ */
+void metal_irqstat_set_policy(metal_irqstat_policy_t policy);
+
+/*!
+ * @brief Print the statistics of every interrupt that has been handled
+ *
+ * Writes one line per hart and interrupt to the console, with the call
+ * count, the total and longest handler time and the non-zero histogram
+ * buckets.
+ */
+void metal_irqstat_dump(void);
+
+/* Whether recording is running, for the dispatchers */
+extern volatile int __metal_irqstat_enabled;
+
+static __inline__ unsigned long __metal_irqstat_cycles(void) {
+    unsigned long cycles;
+
+    __asm__ volatile("csrr %0, mcycle" : "=r"(cycles));
+    return cycles;
+}
+
+/* Record a call of a handler from a dispatcher. latency is the number of
+ * mtime ticks the handler was entered after its timer expired, or -1. */
+void __metal_irqstat_record(struct metal_interrupt *controller,
+                            metal_irqstat_controller type, int id,
+                            unsigned long cycles, long long latency);
+
+#endif
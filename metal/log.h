@@ -0,0 +1,164 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef METAL__LOG_H
+#define METAL__LOG_H
+
+/*!
+ * @file log.h
+ * @brief API for deferred binary logging
+ *
+ * METAL_LOG() records a message without formatting it on the target. The
+ * format string is placed in the non-loaded ELF section .metal.log.fmt and
+ * only its offset in that section, a timestamp and the raw argument words are
+ * stored in a per-hart ring buffer. The ring buffers are written out in binary
+ * by metal_log_flush() and turned back into text on the host by
+ * scripts/metal-log-decode, which reads the format strings from the ELF file.
+ *
+ * Each record is a sequence of little-endian 32-bit words:
+ *
+ * | Word | Contents                                                    |
+ * |------|-------------------------------------------------------------|
+ * | 0    | METAL_LOG_SYNC, argument count, hart id, words per argument |
+ * | 1    | Offset of the format string in .metal.log.fmt               |
+ * | 2    | Low 32 bits of mtime when the message was logged            |
+ * | 3... | The arguments, each cast to uintptr_t                       |
+ *
+ * Records may be interleaved with ordinary text on the same device, the
+ * decoder passes through anything which does not start with METAL_LOG_SYNC.
+ *
+ * Arguments are passed as integers, so %s and floating point conversions are
+ * not supported.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct metal_uart;
+
+/*! @def METAL_LOG_BUFFER_SIZE
+ * @brief Size in 32-bit words of the ring buffer kept for each hart
+ *
+ * Must be a power of two. Messages logged while the ring buffer is full are
+ * dropped and reported by metal_log_flush().
+ */
+#ifndef METAL_LOG_BUFFER_SIZE
+#define METAL_LOG_BUFFER_SIZE 256
+#endif
+
+/*! @def METAL_LOG_MAX_ARGS
+ * @brief The maximum number of arguments to METAL_LOG()
+ */
+#define METAL_LOG_MAX_ARGS 8
+
+/*! @def METAL_LOG_SYNC
+ * @brief The first byte of every record
+ *
+ * 0xF5 never occurs in ASCII or UTF-8 text.
+ */
+#define METAL_LOG_SYNC 0xF5
+
+/*! @def METAL_LOG_ID_DROPPED
+ * @brief Format id of the record which reports dropped messages
+ *
+ * The single argument is the number of messages dropped by that hart since
+ * the previous report.
+ */
+#define METAL_LOG_ID_DROPPED 0xFFFFFFFFUL
+
+/* The format strings must not take up space in the loaded image. Naming the
+ * section this way makes the assembler treat the section flags which GCC
+ * emits after the name, on the same line, as a comment, leaving a
+ * non-allocated @progbits section which starts at address 0 in the linked
+ * ELF. */
+#define __METAL_LOG_SECTION                                                    \
+    __attribute__((section(".metal.log.fmt,\"\",@progbits #"), used))
+
+/* The address of a format string is near 0, out of reach of the PC-relative
+ * and absolute addressing of the code models when the code is linked high,
+ * such as at 0x80000000 under medany. So the address is stored in a pointer
+ * in .rodata, which takes a data relocation that reaches anywhere, and the
+ * empty asm keeps the compiler from folding the load back into a direct
+ * reference to the string. */
+#define __METAL_LOG_FMT_ID(fmt, id)                                            \
+    static const char __metal_log_fmt[] __METAL_LOG_SECTION = fmt;             \
+    static const char *const __metal_log_fmt_ptr                              \
+        __attribute__((used)) = __metal_log_fmt;                               \
+    const char *const *__metal_log_fmt_ref = &__metal_log_fmt_ptr;             \
+    __asm__("" : "+r"(__metal_log_fmt_ref));                                   \
+    const char *id = *__metal_log_fmt_ref
+
+#define __METAL_LOG_NARGS(...)                                                 \
+    __METAL_LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __METAL_LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+#define __METAL_LOG_ARGS_0()
+#define __METAL_LOG_ARGS_1(a) (uintptr_t)(a)
+#define __METAL_LOG_ARGS_2(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_1(__VA_ARGS__)
+#define __METAL_LOG_ARGS_3(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_2(__VA_ARGS__)
+#define __METAL_LOG_ARGS_4(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_3(__VA_ARGS__)
+#define __METAL_LOG_ARGS_5(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_4(__VA_ARGS__)
+#define __METAL_LOG_ARGS_6(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_5(__VA_ARGS__)
+#define __METAL_LOG_ARGS_7(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_6(__VA_ARGS__)
+#define __METAL_LOG_ARGS_8(a, ...)                                             \
+    (uintptr_t)(a), __METAL_LOG_ARGS_7(__VA_ARGS__)
+#define __METAL_LOG_ARGS__(n, ...) __METAL_LOG_ARGS_##n(__VA_ARGS__)
+#define __METAL_LOG_ARGS_(n, ...) __METAL_LOG_ARGS__(n, __VA_ARGS__)
+#define __METAL_LOG_ARGS(...)                                                  \
+    __METAL_LOG_ARGS_(__METAL_LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+
+void __metal_log_emit(const char *fmt, unsigned int nargs,
+                      const uintptr_t *args);
+
+/*! @def METAL_LOG
+ * @brief Log a message without formatting it on the target
+ *
+ * Takes a string literal printf() format and up to METAL_LOG_MAX_ARGS integer
+ * or pointer arguments. Safe to call from interrupt handlers. Never blocks,
+ * if the calling hart's ring buffer is full the message is dropped.
+ */
+#define METAL_LOG(fmt, ...)                                                    \
+    do {                                                                       \
+        __METAL_LOG_FMT_ID(fmt, __metal_log_id);                               \
+        const uintptr_t __metal_log_args[] = {                                 \
+            0, __METAL_LOG_ARGS(__VA_ARGS__)};                                 \
+        __metal_log_emit(__metal_log_id, __METAL_LOG_NARGS(__VA_ARGS__),       \
+                         __metal_log_args + 1);                                \
+    } while (0)
+
+/*!
+ * @brief Select the device which logged messages are written to
+ *
+ * By default messages are written to the default output device through
+ * metal_tty_write(). Any device implementing the UART interface, such as the
+ * sifive_trace ITC or ucb_htif0, can be selected instead.
+ *
+ * @param uart The device to write to, or NULL for the default output device
+ */
+void metal_log_set_device(struct metal_uart *uart);
+
+/*!
+ * @brief Write out all logged messages
+ *
+ * Empties the ring buffers of every hart. Messages are never written out
+ * from METAL_LOG() itself, so this should be called regularly from a context
+ * where blocking on the output device is acceptable, such as the main loop.
+ * metal_log_flush() is also called by metal_fini() and metal_shutdown().
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+int metal_log_flush(void);
+
+/*!
+ * @brief Get the number of messages dropped because a ring buffer was full
+ * @return The total number of messages dropped by all harts
+ */
+unsigned int metal_log_dropped(void);
+
+#endif
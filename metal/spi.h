@@ -4,7 +4,11 @@
 #ifndef METAL__SPI_H
 #define METAL__SPI_H
 
+#include <stddef.h>
+
+struct metal_interrupt;
 struct metal_spi;
+struct metal_spi_request;
 
 /*! @brief The configuration for a SPI transfer */
 struct metal_spi_config {
@@ -35,12 +39,74 @@ struct metal_spi_config {
     } multi_wire;
 };
 
+/*! @brief One segment of a SPI transaction */
+struct metal_spi_segment {
+    /*! @brief The buffer to send, or NULL to send the value 0 */
+    char *tx_buf;
+    /*! @brief The buffer to receive into, or NULL to ignore received bytes */
+    char *rx_buf;
+    /*! @brief The number of bytes to transfer */
+    size_t len;
+    /*! @brief The protocol for the segment, one of METAL_SPI_SINGLE,
+     * METAL_SPI_DUAL or METAL_SPI_QUAD. Dual and quad segments are half
+     * duplex, they send if rx_buf is NULL and receive otherwise. */
+    unsigned int protocol;
+};
+
+/*! @brief Called when an asynchronous SPI transfer finishes
+ *
+ * The next queued transfer has already been started by then, and the callback
+ * may queue more transfers, including the one which finished.
+ *
+ * @param spi The handle for the SPI device which performed the transfer
+ * @param request The transfer which finished
+ */
+typedef void (*metal_spi_callback)(struct metal_spi *spi,
+                                   struct metal_spi_request *request);
+
+/*! @brief An asynchronous SPI transfer
+ *
+ * The request and everything it points to belongs to the driver from the call
+ * to metal_spi_transfer_async() until done is set, and must not be modified
+ * or go out of scope before then.
+ */
+struct metal_spi_request {
+    /*! @brief The configuration for the SPI transfer */
+    struct metal_spi_config *config;
+    /*! @brief The number of bytes to transfer */
+    size_t len;
+    /*! @brief The buffer to send, or NULL to send the value 0 */
+    char *tx_buf;
+    /*! @brief The buffer to receive into, or NULL to ignore received bytes */
+    char *rx_buf;
+    /*! @brief Called when the transfer finishes, may be NULL */
+    metal_spi_callback callback;
+    /*! @brief Passed through to the callback */
+    void *priv;
+    /*! @brief Set to 1 once the transfer has finished */
+    volatile int done;
+    /*! @brief 0 if the transfer succeeded, valid once done is set */
+    int result;
+    /* The next request queued on the same device */
+    struct metal_spi_request *next;
+};
+
 struct metal_spi_vtable {
     void (*init)(struct metal_spi *spi, int baud_rate);
     int (*transfer)(struct metal_spi *spi, struct metal_spi_config *config,
                     size_t len, char *tx_buf, char *rx_buf);
     int (*get_baud_rate)(struct metal_spi *spi);
     int (*set_baud_rate)(struct metal_spi *spi, int baud_rate);
+    int (*prepare)(struct metal_spi *spi, struct metal_spi_config *config);
+    int (*transfer_prepared)(struct metal_spi *spi, int handle, size_t len,
+                             char *tx_buf, char *rx_buf);
+    void (*unprepare)(struct metal_spi *spi, int handle);
+    int (*transaction)(struct metal_spi *spi, struct metal_spi_config *config,
+                       struct metal_spi_segment *segments, unsigned int count);
+    int (*async_init)(struct metal_spi *spi, struct metal_interrupt *intc,
+                      int id);
+    int (*transfer_async)(struct metal_spi *spi,
+                          struct metal_spi_request *request);
 };
 
 /*! @brief A handle for a SPI device */
@@ -68,7 +134,8 @@ __inline__ void metal_spi_init(struct metal_spi *spi, int baud_rate) {
  * @param tx_buf The buffer to send over the SPI bus. Must be len bytes long. If
  * NULL, the SPI will transfer the value 0.
  * @param rx_buf The buffer to receive data into. Must be len bytes long. If
- * NULL, the SPI will ignore received bytes.
+ * NULL, the SPI will ignore received bytes, and may not wait for them at all,
+ * which makes transmit-only transfers faster.
  * @return 0 if the transfer succeeds
  */
 __inline__ int metal_spi_transfer(struct metal_spi *spi,
@@ -77,6 +144,119 @@ __inline__ int metal_spi_transfer(struct metal_spi *spi,
     return spi->vtable->transfer(spi, config, len, tx_buf, rx_buf);
 }
 
+/*! @brief Perform a SPI transaction made up of several segments
+ *
+ * The chip select line is held for the whole transaction, so a command and
+ * its payload can be sent from separate buffers without copying them
+ * together first. Each segment is sent with its own protocol.
+ *
+ * @param spi The handle for the SPI device to perform the transaction
+ * @param config The configuration for the transaction. The protocol,
+ * cmd_num, addr_num, dummy_num and multi_wire fields are ignored, the
+ * segments take their place.
+ * @param segments The segments to transfer, in order
+ * @param count The number of segments
+ * @return 0 if the transaction succeeds
+ */
+__inline__ int metal_spi_transaction(struct metal_spi *spi,
+                                     struct metal_spi_config *config,
+                                     struct metal_spi_segment *segments,
+                                     unsigned int count) {
+    if (spi->vtable->transaction == NULL) {
+        return -1;
+    }
+    return spi->vtable->transaction(spi, config, segments, count);
+}
+
+/*! @brief Prepare a SPI configuration for repeated transfers
+ *
+ * Works out the controller settings for the configuration once, so that
+ * transfers made with the returned handle only have to update the registers
+ * which differ from the previous transfer. The configuration is copied, later
+ * changes to it have no effect on the handle.
+ *
+ * @param spi The handle for the SPI device
+ * @param config The configuration to prepare
+ * @return A handle for the prepared configuration, or -1 if the configuration
+ * is invalid, the device has no room for another prepared configuration or
+ * the device does not support them.
+ */
+__inline__ int metal_spi_prepare(struct metal_spi *spi,
+                                 struct metal_spi_config *config) {
+    if (spi->vtable->prepare == NULL) {
+        return -1;
+    }
+    return spi->vtable->prepare(spi, config);
+}
+
+/*! @brief Perform a SPI transfer with a prepared configuration
+ * @param spi The handle for the SPI device to perform the transfer
+ * @param handle The handle returned by metal_spi_prepare()
+ * @param len The number of bytes to transfer
+ * @param tx_buf The buffer to send over the SPI bus, as for
+ * metal_spi_transfer()
+ * @param rx_buf The buffer to receive data into, as for metal_spi_transfer()
+ * @return 0 if the transfer succeeds
+ */
+__inline__ int metal_spi_transfer_prepared(struct metal_spi *spi, int handle,
+                                           size_t len, char *tx_buf,
+                                           char *rx_buf) {
+    if (spi->vtable->transfer_prepared == NULL) {
+        return -1;
+    }
+    return spi->vtable->transfer_prepared(spi, handle, len, tx_buf, rx_buf);
+}
+
+/*! @brief Release a prepared SPI configuration
+ * @param spi The handle for the SPI device
+ * @param handle The handle returned by metal_spi_prepare()
+ */
+__inline__ void metal_spi_unprepare(struct metal_spi *spi, int handle) {
+    if (spi->vtable->unprepare != NULL) {
+        spi->vtable->unprepare(spi, handle);
+    }
+}
+
+/*! @brief Enable asynchronous transfers on a SPI device
+ *
+ * Asynchronous transfers are driven by the SPI device's interrupt, which the
+ * driver takes ownership of.
+ *
+ * @param spi The handle for the SPI device
+ * @param intc The interrupt controller the SPI device's interrupt is routed to
+ * @param id The SPI device's interrupt id on intc
+ * @return 0 on success, or -1 if the interrupt could not be registered or the
+ * device does not support asynchronous transfers.
+ */
+__inline__ int metal_spi_async_init(struct metal_spi *spi,
+                                    struct metal_interrupt *intc, int id) {
+    if (spi->vtable->async_init == NULL) {
+        return -1;
+    }
+    return spi->vtable->async_init(spi, intc, id);
+}
+
+/*! @brief Queue a SPI transfer and return without waiting for it
+ *
+ * Transfers are performed in the order they are queued. When a transfer
+ * finishes, request->done is set and request->callback is called, usually from
+ * the SPI interrupt handler. Synchronous transfers and changes to the clock
+ * rate wait for the queue to empty first, in which case callbacks are called
+ * from there instead.
+ *
+ * @param spi The handle for the SPI device to perform the transfer
+ * @param request The transfer to perform
+ * @return 0 if the transfer was queued, or -1 if asynchronous transfers have
+ * not been enabled with metal_spi_async_init().
+ */
+__inline__ int metal_spi_transfer_async(struct metal_spi *spi,
+                                        struct metal_spi_request *request) {
+    if (spi->vtable->transfer_async == NULL) {
+        return -1;
+    }
+    return spi->vtable->transfer_async(spi, request);
+}
+
 /*! @brief Get the current baud rate of the SPI device
  * @param spi The handle for the SPI device
  * @return The baud rate in Hz
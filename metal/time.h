@@ -14,8 +14,198 @@
  * @brief API for dealing with time
  */
 
+struct metal_clock;
+
+/*!
+ * @brief The clocks which can be read with metal_time_get_ns()
+ */
+typedef enum {
+    /*! @brief The machine timer (mtime), from reset */
+    METAL_TIME_MONOTONIC,
+    /*! @brief The machine timer. Nothing adjusts it, so it is the same as
+     * METAL_TIME_MONOTONIC. */
+    METAL_TIME_MONOTONIC_RAW,
+    /*! @brief The first RTC if the machine has one, or else the machine timer,
+     * plus the offset set by metal_time_set_realtime_ns() */
+    METAL_TIME_REALTIME,
+    /*! @brief The cycle counter (mcycle) of the calling hart, at the rate
+     * measured by metal_delay_calibrate() */
+    METAL_TIME_CPUTIME,
+} metal_time_clock;
+
+/*!
+ * @brief Get the time of day from METAL_TIME_REALTIME
+ * @param tp The variable to hold the time
+ * @param tzp Ignored
+ * @return 0 upon success, or -1 if there is no clock
+ */
 int metal_gettimeofday(struct timeval *tp, void *tzp);
 
 time_t metal_time(void);
 
+/*!
+ * @brief Read a clock in nanoseconds
+ *
+ * Counts are converted with a multiplier and shift which are computed when
+ * the rate of the clock is first read, and again by
+ * metal_time_update_rates(), so each read takes one multiply and one shift.
+ *
+ * @param clock The clock to read
+ * @param ns The variable to hold the time
+ * @return 0 upon success, or -1 if the clock isn't available
+ */
+int metal_time_get_ns(metal_time_clock clock, unsigned long long *ns);
+
+/*!
+ * @brief Get the resolution of a clock
+ * @param clock The clock to get the resolution of
+ * @param ns The variable to hold the length of one count in nanoseconds,
+ * rounded up
+ * @return 0 upon success, or -1 if the clock isn't available
+ */
+int metal_time_get_resolution_ns(metal_time_clock clock,
+                                 unsigned long long *ns);
+
+/*!
+ * @brief Split nanoseconds into seconds and the nanoseconds left over
+ *
+ * Divides by 10^9 with a precomputed reciprocal, which is much cheaper than
+ * the 64-bit division routine on RV32.
+ *
+ * @param ns The time in nanoseconds
+ * @param nsec The variable to hold the nanoseconds past the whole seconds
+ * @return The whole seconds in ns
+ */
+unsigned long long metal_time_split_ns(unsigned long long ns,
+                                       unsigned long *nsec);
+
+/*!
+ * @brief Set METAL_TIME_REALTIME
+ *
+ * The RTC, if there is one, keeps counting from where it is, the offset to
+ * it is what changes.
+ *
+ * @param ns The new time in nanoseconds
+ * @return 0 upon success, or -1 if there is no clock
+ */
+int metal_time_set_realtime_ns(unsigned long long ns);
+
+/*!
+ * @brief Recompute the conversions of the clocks
+ *
+ * Call after changing the rate of the RTC or the clock of the hart. This is
+ * done on each rate change of the clock registered with
+ * metal_time_register_clock(). METAL_TIME_REALTIME carries on from the time
+ * it had before.
+ */
+void metal_time_update_rates(void);
+
+/*!
+ * @brief A timeout measured on the machine timer
+ *
+ * Deadlines are cheap enough to restart for every byte of a transfer. Nothing
+ * is read or converted until the first time metal_deadline_expired() is
+ * called, so a deadline costs nothing if the condition being waited for is
+ * already true.
+ */
+struct metal_deadline {
+    unsigned int timeout;
+    int running;
+    unsigned long long expiry;
+};
+
+/*!
+ * @brief Read the machine timer (mtime)
+ * @param mtime The variable to hold the value
+ * @return 0 upon success
+ */
+int metal_time_get_mtime(unsigned long long *mtime);
+
+/*! @def METAL_DELAY_CALIBRATE_TICKS
+ * @brief The number of mtime ticks metal_delay_calibrate() counts cycles for
+ */
+#ifndef METAL_DELAY_CALIBRATE_TICKS
+#define METAL_DELAY_CALIBRATE_TICKS 4
+#endif
+
+/*!
+ * @brief Sleep until the machine timer reaches a deadline
+ *
+ * Starts a software timer for the deadline with metal_timer_start() and waits
+ * for interrupts with wfi until mtime passes it. Other interrupts are handled
+ * while waiting, as long as interrupts are enabled. If they aren't, the hart
+ * still wakes up at the deadline, but no handlers run.
+ *
+ * The first sleep on a hart, including through usleep() and nanosleep(),
+ * hands the hart's timer interrupt and mtimecmp to the timer wheel, after
+ * which metal_timer_set_tick() and metal_timer_set_machine_time() fail on the
+ * hart. If the application has already registered its own handler for the
+ * timer interrupt, it is left alone and the sleep polls mtime instead, without
+ * wfi. A handler installed directly in the vector table can't be detected, so
+ * such applications mustn't sleep.
+ *
+ * @param deadline The value of mtime to wait for
+ * @return 0 upon success, or -1 if there is no machine timer
+ */
+int metal_time_sleep_until(unsigned long long deadline);
+
+/*!
+ * @brief Measure the rate of the cycle counter against the machine timer
+ *
+ * Called by the first metal_delay_ns() or read of METAL_TIME_CPUTIME, by
+ * metal_time_update_rates(), and after each rate change of the clock
+ * registered with metal_time_register_clock().
+ */
+void metal_delay_calibrate(void);
+
+/*!
+ * @brief Follow the rate changes of the clock which drives the harts
+ *
+ * Registers rate change callbacks on the clock. METAL_TIME_REALTIME is read
+ * before each rate change, then the conversions are recomputed as by
+ * metal_time_update_rates() and the realtime clock is set to carry on,
+ * counting the time the change took on mtime. On machines with an FE310 PLL,
+ * this is done for the PLL at startup.
+ *
+ * @param clock The clock which drives the harts
+ * @return 0 upon success, or -1 if another clock is already registered
+ */
+int metal_time_register_clock(struct metal_clock *clock);
+
+/*!
+ * @brief Busy-wait for a number of nanoseconds
+ *
+ * Delays of at least one mtime tick wait on mtime. Shorter delays wait on
+ * mcycle, at the rate measured by metal_delay_calibrate(). Either way the
+ * delay is never shorter than asked, but can be longer if interrupts are
+ * handled while waiting. If there is no machine timer, it returns at once.
+ *
+ * @param ns The number of nanoseconds to wait
+ */
+void metal_delay_ns(unsigned long long ns);
+
+/*!
+ * @brief Start a deadline
+ *
+ * The timeout starts from the first call to metal_deadline_expired().
+ *
+ * @param deadline The deadline to start
+ * @param timeout The timeout in microseconds
+ */
+__inline__ void metal_deadline_start(struct metal_deadline *deadline,
+                                     unsigned int timeout) {
+    deadline->timeout = timeout;
+    deadline->running = 0;
+}
+
+/*!
+ * @brief Check whether a deadline has passed
+ *
+ * If there is no machine timer, deadlines never pass.
+ *
+ * @param deadline The deadline to check
+ * @return 1 if the timeout has passed, 0 otherwise
+ */
+int metal_deadline_expired(struct metal_deadline *deadline);
+
 #endif
@@ -7,8 +7,49 @@
 /*!
  * @file timer.h
  * @brief API for reading and manipulating the machine timer
+ *
+ * Software timers multiplex any number of timeouts onto the machine timer of
+ * each hart. Pending timers are kept in a hierarchical timer wheel, so
+ * starting and cancelling a timer takes constant time however many are
+ * pending, and mtimecmp is only ever programmed with the earliest expiry.
+ * Timers which expire together are run from a single timer interrupt.
  */
 
+/*! @def METAL_TIMER_WHEEL_LEVELS
+ * @brief The number of levels of the timer wheel. Each level has 64 slots, so
+ * the wheel spans 64^levels mtime ticks. Timers further out than that are
+ * parked in the last level and placed again as it turns.
+ */
+#ifndef METAL_TIMER_WHEEL_LEVELS
+#define METAL_TIMER_WHEEL_LEVELS 4
+#endif
+
+struct metal_timer;
+
+/*!
+ * @brief Function signature for software timer callbacks
+ *
+ * Callbacks are called from the timer interrupt, on the hart which started
+ * the timer. They may start or cancel any timer of that hart, including the
+ * one being run.
+ */
+typedef void (*metal_timer_callback)(struct metal_timer *timer);
+
+/*!
+ * @brief A software timer
+ *
+ * The fields are private to the timer wheel. A timer needs no initialization
+ * beyond being zeroed before it is first started.
+ */
+struct metal_timer {
+    struct metal_timer *next;
+    struct metal_timer **pprev;
+    unsigned long long expires;
+    unsigned long long period;
+    metal_timer_callback callback;
+    int slot;
+};
+
 /*!
  * @brief Read the machine cycle count
  * @param hartid The hart ID to read the cycle count of
@@ -30,8 +71,57 @@ int metal_timer_get_timebase_frequency(int hartid,
  * @brief Set the machine timer tick interval in seconds
  * @param hartid The hart ID to read the timebase of
  * @param second The number of seconds to set the tick interval to
- * @return 0 upon success
+ * @return 0 upon success, or -1 once the timer wheel owns mtimecmp on the
+ * hart, see metal_timer_start()
  */
 int metal_timer_set_tick(int hartid, int second);
 
+/*!
+ * @brief Start a software timer
+ *
+ * The timer runs on the calling hart, whose timer interrupt and mtimecmp are
+ * taken over by the timer wheel the first time a timer is started on it, or
+ * the first time it sleeps with metal_time_sleep_until(). This fails instead
+ * if the application has registered its own handler for the timer interrupt.
+ * Interrupts must be enabled on the hart for the callback to be called.
+ * Starting a timer which is already pending moves it to the new deadline.
+ *
+ * @param timer The timer to start
+ * @param deadline The value of mtime at which the timer expires
+ * @param callback The function to call when the timer expires
+ * @return 0 upon success, or -1 if the hart has no machine timer or the
+ * application handles its timer interrupt
+ */
+int metal_timer_start(struct metal_timer *timer, unsigned long long deadline,
+                      metal_timer_callback callback);
+
+/*!
+ * @brief Start a periodic software timer
+ *
+ * Like metal_timer_start(), but once the timer expires it is started again
+ * period mtime ticks after its previous deadline, until it is cancelled.
+ *
+ * @param timer The timer to start
+ * @param deadline The value of mtime at which the timer first expires
+ * @param period The number of mtime ticks between expiries
+ * @param callback The function to call each time the timer expires
+ * @return 0 upon success, or -1 if the hart has no machine timer, the
+ * application handles its timer interrupt or period is 0
+ */
+int metal_timer_start_periodic(struct metal_timer *timer,
+                               unsigned long long deadline,
+                               unsigned long long period,
+                               metal_timer_callback callback);
+
+/*!
+ * @brief Cancel a software timer
+ *
+ * Must be called on the hart which started the timer. Once it returns the
+ * callback won't be called, unless the timer is started again.
+ *
+ * @param timer The timer to cancel
+ * @return 1 if the timer was pending, 0 otherwise
+ */
+int metal_timer_cancel(struct metal_timer *timer);
+
 #endif
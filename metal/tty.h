@@ -9,6 +9,39 @@
  * @brief API for emulated serial teriminals
  */
 
+#include <stddef.h>
+
+/*! @def METAL_TTY_BUFFER_MODE
+ * @brief Buffering applied to metal_tty_write()
+ *
+ * Selected at build time by defining METAL_TTY_BUFFER_MODE to one of
+ * METAL_TTY_UNBUFFERED, METAL_TTY_LINE_BUFFERED (the default) or
+ * METAL_TTY_FULLY_BUFFERED. Line buffered output is handed to the device
+ * whenever a newline is written, fully buffered output only once the buffer
+ * fills. Buffered output is always flushed by metal_tty_flush(), by
+ * metal_fini() and by metal_shutdown().
+ *
+ * Each hart buffers its output separately, and buffered output is handed to
+ * the device a whole line at a time, so lines printed by different harts are
+ * never mixed together.
+ */
+#define METAL_TTY_UNBUFFERED 0
+#define METAL_TTY_LINE_BUFFERED 1
+#define METAL_TTY_FULLY_BUFFERED 2
+
+#ifndef METAL_TTY_BUFFER_MODE
+#define METAL_TTY_BUFFER_MODE METAL_TTY_LINE_BUFFERED
+#endif
+
+/*! @def METAL_TTY_BUFFER_SIZE
+ * @brief Size in bytes of the output buffer kept for each hart
+ *
+ * Must be a power of two. Lines longer than the buffer are split.
+ */
+#ifndef METAL_TTY_BUFFER_SIZE
+#define METAL_TTY_BUFFER_SIZE 128
+#endif
+
 /*!
  * @brief Write a character to the default output device
  *
@@ -20,6 +53,59 @@
  */
 int metal_tty_putc(int c);
 
+/*!
+ * @brief Write a buffer of bytes to the default output device
+ *
+ * The bytes are copied into the calling hart's output buffer and handed to
+ * the default output device according to METAL_TTY_BUFFER_MODE. Only waits
+ * for the device if the calling hart's buffer is full.
+ *
+ * @param buf The bytes to write to the terminal
+ * @param len The number of bytes in buf
+ * @return 0 on success, or -1 on failure.
+ */
+int metal_tty_write(const char *buf, size_t len);
+
+/*!
+ * @brief Write a buffer of bytes to the default output device in one piece
+ *
+ * Like metal_tty_write(), but newlines don't commit the output, so binary
+ * data can be written. The bytes are handed to the device together, without
+ * output from other harts in between, as long as len is at most
+ * METAL_TTY_BUFFER_SIZE.
+ *
+ * @param buf The bytes to write to the terminal
+ * @param len The number of bytes in buf
+ * @return 0 on success, or -1 on failure.
+ */
+int metal_tty_write_raw(const char *buf, size_t len);
+
+/*!
+ * @brief Hand buffered output from every hart to the default output device
+ *
+ * Returns immediately if another hart is already doing so.
+ *
+ * By default, whichever hart has just buffered a complete line does this
+ * itself. When the library is built with METAL_TTY_DRAIN_HART defined to a
+ * hart ID, other harts only do so when their own buffer is full or being
+ * flushed, and that hart is expected to call metal_tty_drain() regularly.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+int metal_tty_drain(void);
+
+/*!
+ * @brief Flush buffered output to the default output device
+ *
+ * Hands everything buffered by the calling hart to the default output device
+ * and waits until the device has accepted it. Harts other than the one which
+ * calls exit() should call this before they stop if fully buffered output is
+ * in use.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+int metal_tty_flush(void);
+
 /*!
  * @brief Get a byte from the default output device
  *
@@ -32,4 +118,20 @@ int metal_tty_putc(int c);
  */
 int metal_tty_getc(int *c);
 
+/*!
+ * @brief Read a buffer of bytes from the default output device
+ *
+ * The default output device, is typically the UART serial port.
+ *
+ * Waits up to timeout microseconds for the first byte, then returns once
+ * len bytes have been read or the device has been idle for timeout
+ * microseconds.
+ *
+ * @param buf The buffer to hold the bytes read
+ * @param len The size of buf
+ * @param timeout The idle timeout in microseconds
+ * @return The number of bytes read, or -1 on failure.
+ */
+int metal_tty_read(char *buf, size_t len, unsigned int timeout);
+
 #endif
@@ -31,6 +31,9 @@ struct metal_uart_vtable {
     size_t (*get_tx_watermark)(struct metal_uart *uart);
     int (*set_rx_watermark)(struct metal_uart *uart, size_t length);
     size_t (*get_rx_watermark)(struct metal_uart *uart);
+    int (*write)(struct metal_uart *uart, const char *buf, size_t len);
+    int (*flush)(struct metal_uart *uart);
+    int (*read)(struct metal_uart *uart, char *buf, size_t len);
 };
 
 /*!
@@ -70,6 +73,47 @@ __inline__ int metal_uart_putc(struct metal_uart *uart, int c) {
     return uart->vtable->putc(uart, c);
 }
 
+/*!
+ * @brief Write a buffer of characters over the UART
+ *
+ * Drivers which support interrupt-driven transmission copy the buffer into
+ * a software transmit ring and return without waiting for the characters
+ * to be shifted out. Drivers without such support fall back to calling
+ * metal_uart_putc() for each character.
+ *
+ * @param uart The UART device handle
+ * @param buf The characters to send over the UART
+ * @param len The number of characters in buf
+ * @return 0 upon success
+ */
+__inline__ int metal_uart_write(struct metal_uart *uart, const char *buf,
+                                size_t len) {
+    if (uart->vtable->write)
+        return uart->vtable->write(uart, buf, len);
+
+    for (size_t i = 0; i < len; i++) {
+        if (uart->vtable->putc(uart, (unsigned char)buf[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief Wait until all characters queued by metal_uart_write() are sent
+ *
+ * Once this function returns, every character previously passed to
+ * metal_uart_write() has been handed to the UART hardware.
+ *
+ * @param uart The UART device handle
+ * @return 0 upon success
+ */
+__inline__ int metal_uart_flush(struct metal_uart *uart) {
+    if (uart->vtable->flush)
+        return uart->vtable->flush(uart);
+    else
+        return 0;
+}
+
 /*!
  * @brief Test, determine if tx output is blocked(full/busy)
  * @param uart The UART device handle
@@ -92,6 +136,27 @@ __inline__ int metal_uart_getc(struct metal_uart *uart, int *c) {
     return uart->vtable->getc(uart, c);
 }
 
+/*!
+ * @brief Read a buffer of characters sent over the UART
+ *
+ * Waits up to timeout microseconds for the first character to arrive, then
+ * keeps collecting characters until either len characters have been read or
+ * no new character has arrived for timeout microseconds. A timeout of 0
+ * returns only the characters which have already been received.
+ *
+ * Drivers which support interrupt-driven reception buffer incoming
+ * characters in a software receive ring, so no characters are lost between
+ * calls. Other drivers are polled with metal_uart_getc().
+ *
+ * @param uart The UART device handle
+ * @param buf The buffer to hold the read characters
+ * @param len The size of buf
+ * @param timeout The idle timeout in microseconds
+ * @return The number of characters read, or -1 upon failure
+ */
+int metal_uart_read(struct metal_uart *uart, char *buf, size_t len,
+                    unsigned int timeout);
+
 /*!
  * @brief Get the baud rate of the UART peripheral
  * @param uart The UART device handle
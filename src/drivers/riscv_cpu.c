@@ -2,6 +2,7 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 
 #include <metal/io.h>
+#include <metal/irqstat.h>
 #include <metal/machine.h>
 #include <metal/shutdown.h>
 #include <stdint.h>
@@ -56,6 +57,29 @@ void __metal_interrupt_global_disable(void) {
                      : "r"(METAL_MIE_INTERRUPT));
 }
 
+/* Called from an interrupt handler to let other interrupts preempt it. The
+ * caller must first mask the interrupt it is handling, and whatever else must
+ * not preempt it. A nested trap overwrites mepc and mcause, and with the CLIC
+ * the previous interrupt level in mcause, so they are saved for
+ * __metal_interrupt_nest_exit() to put back before the handler returns. */
+void __metal_interrupt_nest_enter(struct __metal_interrupt_nest *nest) {
+    __asm__ volatile("csrr %0, mepc" : "=r"(nest->mepc));
+    __asm__ volatile("csrr %0, mcause" : "=r"(nest->mcause));
+    __asm__ volatile("csrr %0, mstatus" : "=r"(nest->mstatus));
+    __asm__ volatile("csrs mstatus, %0" ::"r"(METAL_MIE_INTERRUPT));
+}
+
+void __metal_interrupt_nest_exit(struct __metal_interrupt_nest *nest) {
+    uintptr_t mask = METAL_MSTATUS_MPIE | METAL_MSTATUS_MPP;
+
+    __asm__ volatile("csrc mstatus, %0" ::"r"(METAL_MIE_INTERRUPT));
+    __asm__ volatile("csrw mepc, %0" ::"r"(nest->mepc));
+    __asm__ volatile("csrw mcause, %0" ::"r"(nest->mcause));
+    /* Only the fields mret uses, so that the FP state stays current */
+    __asm__ volatile("csrc mstatus, %0" ::"r"(mask));
+    __asm__ volatile("csrs mstatus, %0" ::"r"(nest->mstatus & mask));
+}
+
 void __metal_interrupt_software_enable(void) {
     uintptr_t m;
     __asm__ volatile("csrrs %0, mie, %1"
@@ -165,8 +189,33 @@ metal_external_interrupt_vector_handler(void) {
     __METAL_IRQ_VECTOR_HANDLER(METAL_INTERRUPT_ID_EXT);
 }
 
-void __metal_exception_handler(void) __attribute__((interrupt, aligned(128)));
-void __metal_exception_handler(void) {
+/* The trap entry in src/trap.S, which calls __metal_exception_dispatch() for
+ * everything it doesn't dispatch itself */
+extern void __metal_exception_handler(void);
+
+static void __metal_cpu_call_handler(struct __metal_driver_cpu *cpu,
+                                     struct __metal_driver_riscv_cpu_intc *intc,
+                                     __metal_interrupt_data *entry, int id) {
+#ifdef METAL_IRQSTAT
+    if (__metal_irqstat_enabled) {
+        long long latency = -1;
+        unsigned long start;
+
+        if (id == METAL_INTERRUPT_ID_TMR) {
+            latency =
+                __metal_driver_cpu_timer_latency((struct metal_cpu *)cpu);
+        }
+        start = __metal_irqstat_cycles();
+        entry->handler(id, entry->exint_data);
+        __metal_irqstat_record(&intc->controller, METAL_IRQSTAT_CPU, id,
+                               __metal_irqstat_cycles() - start, latency);
+        return;
+    }
+#endif
+    entry->handler(id, entry->exint_data);
+}
+
+void __metal_exception_dispatch(void) {
     int id;
     void *priv;
     uintptr_t mcause, mepc, mtval, mtvec;
@@ -184,14 +233,13 @@ void __metal_exception_handler(void) {
         id = mcause & METAL_MCAUSE_CAUSE;
         if (mcause & METAL_MCAUSE_INTR) {
             if (id == METAL_INTERRUPT_ID_BEU) {
-                priv = intc->metal_int_beu.exint_data;
-                intc->metal_int_beu.handler(id, priv);
+                __metal_cpu_call_handler(cpu, intc, &intc->metal_int_beu, id);
                 return;
             }
             if ((id < METAL_INTERRUPT_ID_CSW) ||
                 ((mtvec & METAL_MTVEC_MASK) == METAL_MTVEC_DIRECT)) {
-                priv = intc->metal_int_table[id].exint_data;
-                intc->metal_int_table[id].handler(id, priv);
+                __metal_cpu_call_handler(cpu, intc, &intc->metal_int_table[id],
+                                         id);
                 return;
             }
             if ((mtvec & METAL_MTVEC_MASK) == METAL_MTVEC_CLIC) {
@@ -449,6 +497,19 @@ int __metal_exception_register(struct metal_interrupt *controller, int ecode,
     return -1;
 }
 
+/* Point the trap entry of the calling hart at the handler table of its CPU
+ * interrupt controller */
+static void
+__metal_trap_table_install(struct __metal_driver_riscv_cpu_intc *intc) {
+    struct __metal_driver_cpu *cpu = __metal_cpu_table[__metal_myhart_id()];
+
+    if (cpu && ((struct metal_interrupt *)intc ==
+                __metal_driver_cpu_interrupt_controller(
+                    (struct metal_cpu *)cpu))) {
+        __asm__ volatile("csrw mscratch, %0" ::"r"(intc->metal_trap_table));
+    }
+}
+
 extern void early_trap_vector(void);
 void __metal_driver_riscv_cpu_controller_interrupt_init(
     struct metal_interrupt *controller) {
@@ -460,6 +521,8 @@ void __metal_driver_riscv_cpu_controller_interrupt_init(
             intc->metal_int_table[i].handler = NULL;
             intc->metal_int_table[i].sub_int = NULL;
             intc->metal_int_table[i].exint_data = NULL;
+            intc->metal_trap_table[i].handler = NULL;
+            intc->metal_trap_table[i].data = NULL;
         }
 
         for (int i = 0; i < METAL_MAX_ME; i++) {
@@ -478,6 +541,7 @@ void __metal_driver_riscv_cpu_controller_interrupt_init(
                 METAL_DIRECT_MODE,
                 (void *)(uintptr_t)&__metal_exception_handler);
         }
+        __metal_trap_table_install(intc);
         intc->init_done = 1;
     }
 }
@@ -545,6 +609,11 @@ int __metal_driver_riscv_cpu_controller_interrupt_register(
             rc = -12;
         }
     }
+
+    if ((rc == 0) && (id != METAL_INTERRUPT_ID_BEU)) {
+        intc->metal_trap_table[id].data = intc->metal_int_table[id].exint_data;
+        intc->metal_trap_table[id].handler = intc->metal_int_table[id].handler;
+    }
     return rc;
 }
 
@@ -681,9 +750,41 @@ int __metal_driver_cpu_mtimecmp_set(struct metal_cpu *cpu,
                 tmr_intc, __metal_driver_cpu_hartid(cpu), time);
         }
     }
+    if (rc == 0) {
+        ((struct __metal_driver_cpu *)cpu)->mtimecmp = time;
+    }
     return rc;
 }
 
+/* How many mtime ticks ago the timer of cpu expired, or -1 if it hasn't been
+ * programmed through __metal_driver_cpu_mtimecmp_set() */
+long long __metal_driver_cpu_timer_latency(struct metal_cpu *cpu) {
+    unsigned long long mtimecmp = ((struct __metal_driver_cpu *)cpu)->mtimecmp;
+    unsigned long long mtime;
+
+    if (mtimecmp == 0) {
+        return -1;
+    }
+    mtime = __metal_driver_cpu_mtime_get(cpu);
+    return (mtime >= mtimecmp) ? (long long)(mtime - mtimecmp) : -1;
+}
+
+/* The handler registered for the timer interrupt of cpu, or NULL if there is
+ * only the default one */
+metal_interrupt_handler_t
+__metal_driver_cpu_timer_handler(struct metal_cpu *cpu) {
+    struct __metal_driver_riscv_cpu_intc *intc =
+        (struct __metal_driver_riscv_cpu_intc *)
+            __metal_driver_cpu_interrupt_controller(cpu);
+    metal_interrupt_handler_t handler;
+
+    if (intc == NULL) {
+        return NULL;
+    }
+    handler = intc->metal_int_table[METAL_INTERRUPT_ID_TMR].handler;
+    return (handler == __metal_default_timer_handler) ? NULL : handler;
+}
+
 struct metal_interrupt *
 __metal_driver_cpu_timer_controller_interrupt(struct metal_cpu *cpu) {
 #ifdef __METAL_DT_RISCV_CLINT0_HANDLE
@@ -10,9 +10,93 @@
 #include <metal/drivers/riscv_plic0.h>
 #include <metal/interrupt.h>
 #include <metal/io.h>
+#include <metal/irqstat.h>
+#include <metal/lock.h>
 #include <metal/machine.h>
 #include <metal/shutdown.h>
 
+#if METAL_RISCV_PLIC0_CLAIM_BUDGET < 1
+#error "METAL_RISCV_PLIC0_CLAIM_BUDGET must be at least 1"
+#endif
+
+/* Serializes changes to the enable registers and the routing of sources, which
+ * harts make to each other's contexts when sources move */
+METAL_LOCK_DECLARE(__metal_plic0_lock);
+
+static uintptr_t __metal_plic0_lock_take(void) {
+    uintptr_t mstatus;
+
+    /* The handler takes the lock too, so it mustn't interrupt the holder */
+    mstatus = __metal_interrupt_global_save();
+#ifdef __riscv_atomic
+    metal_lock_take(&__metal_plic0_lock);
+#endif
+    return mstatus;
+}
+
+static void __metal_plic0_lock_give(uintptr_t mstatus) {
+#ifdef __riscv_atomic
+    metal_lock_give(&__metal_plic0_lock);
+#endif
+    __metal_interrupt_global_restore(mstatus);
+}
+
+static unsigned long __metal_plic0_cycles(void) {
+    unsigned long cycles;
+
+    __asm__ volatile("csrr %0, mcycle" : "=r"(cycles));
+    return cycles;
+}
+
+/* A source's counters are written by whichever hart handles it and read by
+ * the balancer on any hart. cycles takes two accesses on RV32, so readers
+ * retry until no update has started or finished while they read. */
+static void __metal_plic0_account(struct __metal_plic0_source *src,
+                                  unsigned long cycles) {
+    src->cycles_seq++;
+    __asm__ volatile("fence w, w" ::: "memory");
+    src->cycles += cycles;
+    src->dispatches++;
+    __asm__ volatile("fence w, w" ::: "memory");
+    src->cycles_seq++;
+}
+
+static void __metal_plic0_snapshot(struct __metal_plic0_source *src,
+                                   unsigned long *dispatches,
+                                   unsigned long long *cycles) {
+    unsigned int seq;
+
+    do {
+        seq = src->cycles_seq;
+        __asm__ volatile("fence r, r" ::: "memory");
+        *dispatches = src->dispatches;
+        *cycles = src->cycles;
+        __asm__ volatile("fence r, r" ::: "memory");
+    } while ((seq & 1) || (seq != src->cycles_seq));
+}
+
+static int __metal_plic0_hart_context(int hartid) {
+    int context;
+
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS)) {
+        return -1;
+    }
+    context = __metal_driver_sifive_plic0_context_ids(hartid);
+    if ((context < 0) || (context >= __METAL_PLIC_NUM_PARENTS)) {
+        return -1;
+    }
+    return context;
+}
+
+static int __metal_plic0_context_hart(int context) {
+    for (int hartid = 0; hartid < __METAL_DT_MAX_HARTS; hartid++) {
+        if (__metal_driver_sifive_plic0_context_ids(hartid) == context) {
+            return hartid;
+        }
+    }
+    return -1;
+}
+
 unsigned int
 __metal_plic0_claim_interrupt(struct __metal_driver_riscv_plic0 *plic,
                               int context_id) {
@@ -102,31 +186,119 @@ int __metal_plic0_enable(struct __metal_driver_riscv_plic0 *plic,
     return 0;
 }
 
+/* Enable a source on one context only. Called with the lock held. */
+static void __metal_plic0_route(struct __metal_driver_riscv_plic0 *plic,
+                                int id, int context) {
+    struct __metal_plic0_source *src = &plic->metal_source_table[id];
+
+    /* Enable on the new context first so that a request raised in between is
+     * taken by one of them */
+    __metal_plic0_enable(plic, context, id, METAL_ENABLE);
+    if ((src->context >= 0) && (src->context != context)) {
+        __metal_plic0_enable(plic, src->context, id, METAL_DISABLE);
+    }
+    src->context = context;
+    src->next_context = -1;
+}
+
+/* Move a source the balancer has picked. The PLIC ignores a completion from a
+ * context the source is no longer enabled on, so this is only done once the
+ * source has been completed. */
+static void __metal_plic0_migrate(struct __metal_driver_riscv_plic0 *plic,
+                                  int id) {
+    struct __metal_plic0_source *src = &plic->metal_source_table[id];
+    uintptr_t mstatus = __metal_plic0_lock_take();
+
+    if ((src->next_context >= 0) && !src->pinned) {
+        __metal_plic0_route(plic, id, src->next_context);
+    }
+    src->next_context = -1;
+    __metal_plic0_lock_give(mstatus);
+}
+
 void __metal_plic0_default_handler(int id, void *priv) { metal_shutdown(300); }
 
+/* Run the handler of a claimed source. With nesting, the threshold of the
+ * context is raised to the priority of the source while the handler runs
+ * with interrupts enabled, so that only sources of a higher priority and the
+ * CPU's own interrupts can preempt it. */
+static void __metal_plic0_dispatch(struct __metal_driver_riscv_plic0 *plic,
+                                   int contextid, unsigned int idx) {
+    struct metal_interrupt *controller = (struct metal_interrupt *)plic;
+    struct __metal_interrupt_nest nest;
+    unsigned int threshold, priority;
+
+    if (!plic->nesting) {
+        plic->metal_exint_table[idx](idx,
+                                     plic->metal_exdata_table[idx].exint_data);
+        return;
+    }
+
+    threshold = __metal_plic0_get_threshold(controller, contextid);
+    priority = __metal_driver_riscv_plic0_get_priority(controller, idx);
+    __metal_plic0_set_threshold(controller, contextid,
+                                __METAL_MAX(threshold, priority));
+
+    __metal_interrupt_nest_enter(&nest);
+    plic->metal_exint_table[idx](idx, plic->metal_exdata_table[idx].exint_data);
+    __metal_interrupt_nest_exit(&nest);
+
+    __metal_plic0_set_threshold(controller, contextid, threshold);
+}
+
 void __metal_plic0_handler(int id, void *priv) {
     struct __metal_driver_riscv_plic0 *plic = priv;
     int contextid =
         __metal_driver_sifive_plic0_context_ids(__metal_myhart_id());
-    unsigned int idx = __metal_plic0_claim_interrupt(plic, contextid);
     unsigned int num_interrupts = __metal_driver_sifive_plic0_num_interrupts(
         (struct metal_interrupt *)plic);
 
-    if ((idx < num_interrupts) && (plic->metal_exint_table[idx])) {
-        plic->metal_exint_table[idx](idx,
-                                     plic->metal_exdata_table[idx].exint_data);
-    }
+    /* Keep claiming until the PLIC has nothing left for this context, so
+     * sources which fire together share a single trap */
+    for (int n = 0; n < METAL_RISCV_PLIC0_CLAIM_BUDGET; n++) {
+        unsigned int idx = __metal_plic0_claim_interrupt(plic, contextid);
+
+        if (idx == 0) {
+            break;
+        }
+
+        if ((idx < num_interrupts) && (plic->metal_exint_table[idx])) {
+            struct __metal_plic0_source *src = &plic->metal_source_table[idx];
+            unsigned long start = __metal_plic0_cycles();
+            unsigned long cycles;
+
+            __metal_plic0_dispatch(plic, contextid, idx);
+
+            cycles = __metal_plic0_cycles() - start;
+            __metal_plic0_account(src, cycles);
+#ifdef METAL_IRQSTAT
+            if (__metal_irqstat_enabled) {
+                __metal_irqstat_record((struct metal_interrupt *)plic,
+                                       METAL_IRQSTAT_PLIC, idx, cycles, -1);
+            }
+#endif
+            __metal_plic0_complete_interrupt(plic, contextid, idx);
 
-    __metal_plic0_complete_interrupt(plic, contextid, idx);
+            if (src->next_context >= 0) {
+                __metal_plic0_migrate(plic, idx);
+            }
+        } else {
+            __metal_plic0_complete_interrupt(plic, contextid, idx);
+        }
+    }
 }
 
 void __metal_driver_riscv_plic0_init(struct metal_interrupt *controller) {
     struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
 
     if (!plic->init_done) {
-        int num_interrupts, line;
+        int num_interrupts, line, context;
         struct metal_interrupt *intc;
 
+#ifdef __riscv_atomic
+        metal_lock_init(&__metal_plic0_lock);
+#endif
+
         for (int parent = 0; parent < __METAL_PLIC_NUM_PARENTS; parent++) {
             num_interrupts =
                 __metal_driver_sifive_plic0_num_interrupts(controller);
@@ -145,10 +317,19 @@ void __metal_driver_riscv_plic0_init(struct metal_interrupt *controller) {
                     plic->metal_exint_table[i] = NULL;
                     plic->metal_exdata_table[i].sub_int = NULL;
                     plic->metal_exdata_table[i].exint_data = NULL;
+                    plic->metal_source_table[i].cycles_seq = 0;
+                    plic->metal_source_table[i].dispatches = 0;
+                    plic->metal_source_table[i].cycles = 0;
+                    plic->metal_source_table[i].balanced_cycles = 0;
+                    plic->metal_source_table[i].load = 0;
+                    plic->metal_source_table[i].context = -1;
+                    plic->metal_source_table[i].next_context = -1;
+                    plic->metal_source_table[i].pinned = 0;
                 }
             }
 
             __metal_plic0_set_threshold(controller, parent, 0);
+            plic->online_contexts[parent] = 0;
 
             /* Register plic (ext) interrupt with with parent controller */
             intc->vtable->interrupt_register(intc, line, NULL, plic);
@@ -158,6 +339,11 @@ void __metal_driver_riscv_plic0_init(struct metal_interrupt *controller) {
             /* Enable plic (ext) interrupt with with parent controller */
             intc->vtable->interrupt_enable(intc, line);
         }
+
+        context = __metal_plic0_hart_context(__metal_myhart_id());
+        if (context >= 0) {
+            plic->online_contexts[context] = 1;
+        }
         plic->init_done = 1;
     }
 }
@@ -187,23 +373,55 @@ int __metal_driver_riscv_plic0_register(struct metal_interrupt *controller,
 int __metal_driver_riscv_plic0_enable(struct metal_interrupt *controller,
                                       int id) {
     struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    struct __metal_plic0_source *src;
+    int context = __metal_plic0_hart_context(__metal_myhart_id());
+    uintptr_t mstatus;
 
-    if (id >= __metal_driver_sifive_plic0_num_interrupts(controller)) {
+    if ((id >= __metal_driver_sifive_plic0_num_interrupts(controller)) ||
+        (context < 0)) {
         return -1;
     }
 
-    __metal_plic0_enable(plic, __metal_myhart_id(), id, METAL_ENABLE);
+    src = &plic->metal_source_table[id];
+
+    /* Pinned sources stay where they were pinned, sources routed with the
+     * affinity API are enabled on the calling hart as well */
+    mstatus = __metal_plic0_lock_take();
+    if (!src->pinned) {
+        __metal_plic0_route(plic, id, context);
+    } else if (src->context >= 0) {
+        __metal_plic0_enable(plic, src->context, id, METAL_ENABLE);
+    } else {
+        __metal_plic0_enable(plic, context, id, METAL_ENABLE);
+    }
+    __metal_plic0_lock_give(mstatus);
     return 0;
 }
 
 int __metal_driver_riscv_plic0_disable(struct metal_interrupt *controller,
                                        int id) {
     struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    struct __metal_plic0_source *src;
+    int context = __metal_plic0_hart_context(__metal_myhart_id());
+    uintptr_t mstatus;
 
-    if (id >= __metal_driver_sifive_plic0_num_interrupts(controller)) {
+    if ((id >= __metal_driver_sifive_plic0_num_interrupts(controller)) ||
+        (context < 0)) {
         return -1;
     }
-    __metal_plic0_enable(plic, __metal_myhart_id(), id, METAL_DISABLE);
+    src = &plic->metal_source_table[id];
+
+    mstatus = __metal_plic0_lock_take();
+    if (src->context >= 0) {
+        __metal_plic0_enable(plic, src->context, id, METAL_DISABLE);
+        src->next_context = -1;
+        if (!src->pinned) {
+            src->context = -1;
+        }
+    } else {
+        __metal_plic0_enable(plic, context, id, METAL_DISABLE);
+    }
+    __metal_plic0_lock_give(mstatus);
     return 0;
 }
 
@@ -223,6 +441,7 @@ __metal_driver_riscv_plic0_affinity_enable(struct metal_interrupt *controller,
                                            metal_affinity bitmask, int id) {
     metal_affinity ret = {0};
     int context;
+    uintptr_t mstatus;
 
     struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
 
@@ -231,12 +450,18 @@ __metal_driver_riscv_plic0_affinity_enable(struct metal_interrupt *controller,
         return ret;
     }
 
+    /* The caller has taken over routing the source */
+    mstatus = __metal_plic0_lock_take();
+    plic->metal_source_table[id].context = -1;
+    plic->metal_source_table[id].next_context = -1;
+    plic->metal_source_table[id].pinned = 1;
     for_each_metal_affinity(context, bitmask) {
         if (context != 0)
             metal_affinity_set_bit(
                 ret, context,
                 __metal_plic0_enable(plic, context, id, METAL_ENABLE));
     }
+    __metal_plic0_lock_give(mstatus);
 
     return ret;
 }
@@ -246,6 +471,7 @@ __metal_driver_riscv_plic0_affinity_disable(struct metal_interrupt *controller,
                                             metal_affinity bitmask, int id) {
     metal_affinity ret = {0};
     int context;
+    uintptr_t mstatus;
 
     struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
 
@@ -254,12 +480,18 @@ __metal_driver_riscv_plic0_affinity_disable(struct metal_interrupt *controller,
         return ret;
     }
 
+    /* The caller has taken over routing the source */
+    mstatus = __metal_plic0_lock_take();
+    plic->metal_source_table[id].context = -1;
+    plic->metal_source_table[id].next_context = -1;
+    plic->metal_source_table[id].pinned = 1;
     for_each_metal_affinity(context, bitmask) {
         if (context != 0)
             metal_affinity_set_bit(
                 ret, context,
                 __metal_plic0_enable(plic, context, id, METAL_DISABLE));
     }
+    __metal_plic0_lock_give(mstatus);
 
     return ret;
 }
@@ -286,6 +518,150 @@ unsigned int __metal_driver_riscv_plic0_affinity_get_threshold(
     return 0;
 }
 
+int __metal_driver_riscv_plic0_set_nesting(struct metal_interrupt *controller,
+                                           int enable) {
+    struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+
+    plic->nesting = enable;
+    return 0;
+}
+
+int riscv_plic0_add_hart(struct metal_interrupt *controller) {
+    struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    int context = __metal_plic0_hart_context(__metal_myhart_id());
+    struct metal_interrupt *intc;
+    int line;
+
+    if (context < 0) {
+        return -1;
+    }
+    intc = __metal_driver_sifive_plic0_interrupt_parents(controller, context);
+    line = __metal_driver_sifive_plic0_interrupt_lines(controller, context);
+
+    __metal_plic0_set_threshold(controller, context, 0);
+    intc->vtable->interrupt_init(intc);
+    intc->vtable->interrupt_enable(intc, line);
+    plic->online_contexts[context] = 1;
+    return 0;
+}
+
+int riscv_plic0_irq_pin(struct metal_interrupt *controller, int id,
+                        int hartid) {
+    struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    int context = __metal_plic0_hart_context(hartid);
+    uintptr_t mstatus;
+
+    if ((id <= 0) ||
+        (id >= __metal_driver_sifive_plic0_num_interrupts(controller))) {
+        return -1;
+    }
+    if ((hartid >= 0) && (context < 0)) {
+        return -1;
+    }
+
+    mstatus = __metal_plic0_lock_take();
+    if (hartid >= 0) {
+        __metal_plic0_route(plic, id, context);
+        plic->metal_source_table[id].pinned = 1;
+    } else {
+        plic->metal_source_table[id].pinned = 0;
+    }
+    __metal_plic0_lock_give(mstatus);
+    return 0;
+}
+
+int riscv_plic0_irq_balance(struct metal_interrupt *controller) {
+    struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    int num_interrupts = __metal_driver_sifive_plic0_num_interrupts(controller);
+    unsigned long long load[__METAL_PLIC_NUM_PARENTS] = {0};
+    int moved = 0;
+    uintptr_t mstatus = __metal_plic0_lock_take();
+
+    /* Handler time of each source and context since the last pass. Moves
+     * picked by the last pass whose sources haven't fired since are
+     * reconsidered. */
+    for (int i = 1; i < num_interrupts; i++) {
+        struct __metal_plic0_source *src = &plic->metal_source_table[i];
+        unsigned long dispatches;
+        unsigned long long cycles;
+
+        __metal_plic0_snapshot(src, &dispatches, &cycles);
+        src->load = cycles - src->balanced_cycles;
+        src->balanced_cycles = cycles;
+        src->next_context = -1;
+        if (src->context >= 0) {
+            load[src->context] += src->load;
+        }
+    }
+
+    /* Each move takes a different source, which bounds the passes */
+    for (;;) {
+        int busiest = -1, idlest = -1, candidate = -1;
+        unsigned long long gap;
+
+        for (int c = 0; c < __METAL_PLIC_NUM_PARENTS; c++) {
+            if ((busiest < 0) || (load[c] > load[busiest])) {
+                busiest = c;
+            }
+            if (plic->online_contexts[c] &&
+                ((idlest < 0) || (load[c] < load[idlest]))) {
+                idlest = c;
+            }
+        }
+        if ((idlest < 0) || (busiest == idlest)) {
+            break;
+        }
+        gap = load[busiest] - load[idlest];
+        if ((gap * 100) <=
+            (load[busiest] * METAL_RISCV_PLIC0_BALANCE_THRESHOLD)) {
+            break;
+        }
+
+        /* Any source lighter than the gap leaves both contexts below the
+         * busiest one's load, the heaviest of them narrows it most */
+        for (int i = 1; i < num_interrupts; i++) {
+            struct __metal_plic0_source *src = &plic->metal_source_table[i];
+
+            if ((src->context == busiest) && !src->pinned &&
+                (src->next_context < 0) && (src->load > 0) &&
+                (src->load < gap) &&
+                ((candidate < 0) ||
+                 (src->load > plic->metal_source_table[candidate].load))) {
+                candidate = i;
+            }
+        }
+        if (candidate < 0) {
+            break;
+        }
+
+        plic->metal_source_table[candidate].next_context = idlest;
+        load[busiest] -= plic->metal_source_table[candidate].load;
+        load[idlest] += plic->metal_source_table[candidate].load;
+        moved++;
+    }
+
+    __metal_plic0_lock_give(mstatus);
+    return moved;
+}
+
+int riscv_plic0_get_irq_stats(struct metal_interrupt *controller, int id,
+                              struct riscv_plic0_irq_stats *stats) {
+    struct __metal_driver_riscv_plic0 *plic = (void *)(controller);
+    struct __metal_plic0_source *src;
+
+    if ((id <= 0) ||
+        (id >= __metal_driver_sifive_plic0_num_interrupts(controller))) {
+        return -1;
+    }
+    src = &plic->metal_source_table[id];
+
+    __metal_plic0_snapshot(src, &stats->dispatches, &stats->cycles);
+    stats->hartid =
+        (src->context >= 0) ? __metal_plic0_context_hart(src->context) : -1;
+    stats->pinned = src->pinned;
+    return 0;
+}
+
 __METAL_DEFINE_VTABLE(__metal_driver_vtable_riscv_plic0) = {
     .plic_vtable.interrupt_init = __metal_driver_riscv_plic0_init,
     .plic_vtable.interrupt_register = __metal_driver_riscv_plic0_register,
@@ -307,6 +683,7 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_riscv_plic0) = {
         __metal_driver_riscv_plic0_affinity_get_threshold,
     .plic_vtable.interrupt_affinity_set_threshold =
         __metal_driver_riscv_plic0_affinity_set_threshold,
+    .plic_vtable.interrupt_set_nesting = __metal_driver_riscv_plic0_set_nesting,
 };
 
 #endif /* METAL_RISCV_PLIC0 */
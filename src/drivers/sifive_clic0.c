@@ -7,6 +7,7 @@
 
 #include <metal/drivers/sifive_clic0.h>
 #include <metal/io.h>
+#include <metal/irqstat.h>
 #include <metal/machine.h>
 #include <metal/shutdown.h>
 #include <stdint.h>
@@ -452,13 +453,62 @@ void __metal_clic0_handler(int id, void *priv) {
         (struct metal_interrupt *)clic);
 
     if ((id < num_subinterrupts) && (clic->metal_exint_table[id].handler)) {
-        clic->metal_exint_table[id].handler(
-            id, clic->metal_exint_table[id].exint_data);
+#ifdef METAL_IRQSTAT
+        long long latency = -1;
+        unsigned long start = 0;
+
+        if (__metal_irqstat_enabled) {
+            if (id == METAL_INTERRUPT_ID_TMR) {
+                latency = __metal_driver_cpu_timer_latency(
+                    metal_cpu_get(__metal_myhart_id()));
+            }
+            start = __metal_irqstat_cycles();
+        }
+#endif
+        /* The CLIC has already raised the interrupt level to that of id, so
+         * only interrupts of a higher level can preempt the handler */
+        if (clic->nesting) {
+            struct __metal_interrupt_nest nest;
+
+            __metal_interrupt_nest_enter(&nest);
+            clic->metal_exint_table[id].handler(
+                id, clic->metal_exint_table[id].exint_data);
+            __metal_interrupt_nest_exit(&nest);
+        } else {
+            clic->metal_exint_table[id].handler(
+                id, clic->metal_exint_table[id].exint_data);
+        }
+#ifdef METAL_IRQSTAT
+        if (__metal_irqstat_enabled) {
+            __metal_irqstat_record((struct metal_interrupt *)clic,
+                                   METAL_IRQSTAT_CLIC, id,
+                                   __metal_irqstat_cycles() - start, latency);
+        }
+#endif
     }
 }
 
 void __metal_clic0_default_handler(int id, void *priv) { metal_shutdown(300); }
 
+/* Service the non-vectored interrupts of a higher level than the interrupted
+ * code which are pending, as a fast handler returns. Writing mnxti claims the
+ * highest of them, moving the interrupt level and mcause to it, and returns
+ * its mtvt entry. Vectored interrupts are left for the hardware to take on
+ * mret. */
+void __metal_clic0_tail_chain(void) {
+    uintptr_t entry;
+
+    for (;;) {
+        __asm__ volatile("csrrci %0, 0x345, %1"
+                         : "=r"(entry)
+                         : "i"(METAL_MIE_INTERRUPT));
+        if ((entry == 0) || (*(uintptr_t *)entry != 0)) {
+            break;
+        }
+        __metal_exception_dispatch();
+    }
+}
+
 void __metal_clic0_default_vector_handler(void) { metal_shutdown(400); }
 
 void __metal_driver_sifive_clic0_init(struct metal_interrupt *controller) {
@@ -709,6 +759,49 @@ int __metal_driver_sifive_clic0_set_preemptive_level(
     return (__metal_clic0_interrupt_set_priority(clic, id, level));
 }
 
+int sifive_clic0_set_fast_handler(struct metal_interrupt *controller, int id,
+                                  metal_interrupt_vector_handler_t handler) {
+    struct __metal_driver_sifive_clic0 *clic =
+        (struct __metal_driver_sifive_clic0 *)(controller);
+    int num_subinterrupts =
+        __metal_driver_sifive_clic0_num_subinterrupts(controller);
+    metal_vector_mode mode = __metal_clic0_configure_get_vector_mode(clic);
+
+    /* Entry 0 holds the handler for all the non-vectored interrupts */
+    if ((id <= 0) || (id >= num_subinterrupts)) {
+        return -1;
+    }
+    if (mode == METAL_SELECTIVE_NONVECTOR_MODE) {
+        __metal_clic0_configure_set_vector_mode(clic,
+                                                METAL_SELECTIVE_VECTOR_MODE);
+    } else if (mode != METAL_SELECTIVE_VECTOR_MODE) {
+        return -1;
+    }
+
+    /* The hardware fetches the table entry as it takes the interrupt, so the
+     * entry must be in place whenever the interrupt is vectored */
+    if (handler) {
+        clic->metal_mtvt_table[id] = handler;
+        __asm__ volatile("fence rw, rw" ::: "memory");
+        __asm__ volatile("fence.i" ::: "memory");
+        __metal_clic0_interrupt_set_vector_mode(clic, id, METAL_ENABLE);
+    } else {
+        __metal_clic0_interrupt_set_vector_mode(clic, id, METAL_DISABLE);
+        __asm__ volatile("fence rw, rw" ::: "memory");
+        clic->metal_mtvt_table[id] = NULL;
+    }
+    return 0;
+}
+
+int __metal_driver_sifive_clic0_set_nesting(struct metal_interrupt *controller,
+                                            int enable) {
+    struct __metal_driver_sifive_clic0 *clic =
+        (struct __metal_driver_sifive_clic0 *)(controller);
+
+    clic->nesting = enable;
+    return 0;
+}
+
 int __metal_driver_sifive_clic0_clear_interrupt(
     struct metal_interrupt *controller, int id) {
     struct __metal_driver_sifive_clic0 *clic =
@@ -814,6 +907,8 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_clic0) = {
     .clic_vtable.interrupt_set = __metal_driver_sifive_clic0_set_interrupt,
     .clic_vtable.command_request = __metal_driver_sifive_clic0_command_request,
     .clic_vtable.mtimecmp_set = __metal_driver_sifive_clic0_mtimecmp_set,
+    .clic_vtable.interrupt_set_nesting =
+        __metal_driver_sifive_clic0_set_nesting,
 };
 
 #endif /* METAL_SIFIVE_CLIC0 */
@@ -6,6 +6,7 @@
 #ifdef METAL_SIFIVE_I2C0
 #include <metal/clock.h>
 #include <metal/compiler.h>
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/drivers/sifive_gpio0.h>
 #include <metal/drivers/sifive_i2c0.h>
 #include <metal/io.h>
@@ -40,11 +41,13 @@
     (__METAL_ACCESS_ONCE((__metal_io_u32 *)METAL_I2C_REG(offset)))
 
 /* Timeout macros for register status checks */
-#define METAL_I2C_RXDATA_TIMEOUT 1
+#ifndef METAL_I2C_RXDATA_TIMEOUT_US
+#define METAL_I2C_RXDATA_TIMEOUT_US 1000000
+#endif
 #define METAL_I2C_TIMEOUT_RESET(timeout)                                       \
-    timeout = metal_time() + METAL_I2C_RXDATA_TIMEOUT
+    metal_deadline_start(&timeout, METAL_I2C_RXDATA_TIMEOUT_US)
 #define METAL_I2C_TIMEOUT_CHECK(timeout)                                       \
-    if (metal_time() > timeout) {                                              \
+    if (metal_deadline_expired(&timeout)) {                                    \
         METAL_I2C_LOG("I2C timeout error.\n");                                 \
         return METAL_I2C_RET_ERR;                                              \
     }
@@ -74,9 +77,333 @@
 #define METAL_I2C_RET_OK 0
 #define METAL_I2C_RET_ERR -1
 
+/* States of the asynchronous transfer engine, named after the command whose
+ * completion it is waiting for */
+#define METAL_I2C_ASYNC_IDLE 0
+#define METAL_I2C_ASYNC_ADDR 1
+#define METAL_I2C_ASYNC_WRITE 2
+#define METAL_I2C_ASYNC_READ 3
+#define METAL_I2C_ASYNC_STOP 4
+
+/* A request is made up of its messages, or a write message followed by a read
+ * message */
+static int __metal_driver_sifive_i2c0_async_get_msg(
+    struct metal_i2c_request *request, unsigned int n, unsigned int *addr,
+    int *read, unsigned char **buf, unsigned int *len) {
+    if (request->msgs != NULL) {
+        if (n >= request->nmsgs) {
+            return METAL_I2C_RET_ERR;
+        }
+        *addr = request->msgs[n].addr;
+        *read = (request->msgs[n].flags & METAL_I2C_MSG_READ) != 0;
+        *buf = request->msgs[n].buf;
+        *len = request->msgs[n].len;
+        return METAL_I2C_RET_OK;
+    }
+
+    *addr = request->addr;
+    switch (n) {
+    case 0:
+        *read = 0;
+        *buf = request->txbuf;
+        *len = request->txlen;
+        return METAL_I2C_RET_OK;
+    case 1:
+        *read = 1;
+        *buf = request->rxbuf;
+        *len = request->rxlen;
+        return METAL_I2C_RET_OK;
+    default:
+        return METAL_I2C_RET_ERR;
+    }
+}
+
+/* Find the first message from n on that is put on the bus. Zero-length
+ * messages only address the slave, which is how devices are probed, but an
+ * empty txbuf or rxbuf just leaves that half of the transfer out. */
+static int
+__metal_driver_sifive_i2c0_async_next_msg(struct metal_i2c_request *request,
+                                          unsigned int n) {
+    unsigned int addr, len;
+    unsigned char *buf;
+    int read;
+
+    while (__metal_driver_sifive_i2c0_async_get_msg(request, n, &addr, &read,
+                                                    &buf, &len) ==
+           METAL_I2C_RET_OK) {
+        if ((len != 0) || (request->msgs != NULL)) {
+            return n;
+        }
+        n++;
+    }
+    return -1;
+}
+
+static void
+__metal_driver_sifive_i2c0_async_finish(struct __metal_driver_sifive_i2c0 *i2c,
+                                        int result) {
+    struct metal_i2c_request *request = i2c->async_head;
+    struct metal_i2c_request **done = &i2c->async_done;
+
+    i2c->async_head = request->next;
+    if (i2c->async_head == NULL) {
+        i2c->async_tail = NULL;
+    }
+    i2c->async_state = METAL_I2C_ASYNC_IDLE;
+
+    /* Reported by __metal_driver_sifive_i2c0_async_complete() */
+    while (*done != NULL) {
+        done = &(*done)->next;
+    }
+    request->result = result;
+    request->next = NULL;
+    *done = request;
+}
+
+/* Report the transfers which have finished. Called once the next queued
+ * request has been started, so that a callback which queues another request
+ * finds the engine either busy or idle, never about to start one. */
+static void __metal_driver_sifive_i2c0_async_complete(
+    struct __metal_driver_sifive_i2c0 *i2c) {
+    struct metal_i2c_request *request;
+
+    while ((request = i2c->async_done) != NULL) {
+        i2c->async_done = request->next;
+
+        __asm__ volatile("fence rw, w" ::: "memory");
+        request->done = 1;
+        if (request->callback != NULL) {
+            request->callback(&i2c->i2c, request);
+        }
+    }
+}
+
+/* Whether the command in flight for the current message ends the request with
+ * a STOP condition: the one for its last byte, or for the address if it has
+ * no data, when no more messages follow */
+static int __metal_driver_sifive_i2c0_async_stop_sent(
+    struct __metal_driver_sifive_i2c0 *i2c, struct metal_i2c_request *request,
+    unsigned int len) {
+    if (len == 0) {
+        if (i2c->async_state != METAL_I2C_ASYNC_ADDR) {
+            return 0;
+        }
+    } else if ((i2c->async_state == METAL_I2C_ASYNC_ADDR) ||
+               (i2c->async_index != (len - 1))) {
+        return 0;
+    }
+    return __metal_driver_sifive_i2c0_async_next_msg(request,
+                                                     i2c->async_msg + 1) < 0;
+}
+
+/* Issue the command for the next byte of the current message */
+static void
+__metal_driver_sifive_i2c0_async_data(struct __metal_driver_sifive_i2c0 *i2c) {
+    unsigned long base =
+        __metal_driver_sifive_i2c0_control_base((struct metal_i2c *)i2c);
+    struct metal_i2c_request *request = i2c->async_head;
+    unsigned int addr, len;
+    unsigned char *buf;
+    int read;
+    __metal_io_u8 command;
+
+    __metal_driver_sifive_i2c0_async_get_msg(request, i2c->async_msg, &addr,
+                                             &read, &buf, &len);
+
+    if (read) {
+        command = METAL_I2C_CMD_READ;
+        /* NACK the last byte to end the read */
+        if (i2c->async_index == (len - 1)) {
+            command |= METAL_I2C_CMD_ACK;
+        }
+        i2c->async_state = METAL_I2C_ASYNC_READ;
+    } else {
+        METAL_I2C_REGB(METAL_SIFIVE_I2C0_TRANSMIT) = buf[i2c->async_index];
+        command = METAL_I2C_CMD_WRITE;
+        i2c->async_state = METAL_I2C_ASYNC_WRITE;
+    }
+
+    /* Generate STOP condition after the last byte of the request */
+    if (__metal_driver_sifive_i2c0_async_stop_sent(i2c, request, len)) {
+        command |= METAL_I2C_CMD_STOP;
+    }
+
+    METAL_I2C_REGB(METAL_SIFIVE_I2C0_COMMAND) = command;
+}
+
+/* Start the next message of the current request with a (repeated) START
+ * condition, or start the next request if there are no more messages */
+static void
+__metal_driver_sifive_i2c0_async_start(struct __metal_driver_sifive_i2c0 *i2c,
+                                       unsigned int n) {
+    unsigned long base =
+        __metal_driver_sifive_i2c0_control_base((struct metal_i2c *)i2c);
+
+    while (i2c->async_head != NULL) {
+        struct metal_i2c_request *request = i2c->async_head;
+        int msg = __metal_driver_sifive_i2c0_async_next_msg(request, n);
+        unsigned int addr, len;
+        unsigned char *buf;
+        int read;
+        __metal_io_u8 command;
+
+        if (msg < 0) {
+            /* Nothing left to transfer */
+            __metal_driver_sifive_i2c0_async_finish(i2c, METAL_I2C_RET_OK);
+            n = 0;
+            continue;
+        }
+
+        __metal_driver_sifive_i2c0_async_get_msg(request, msg, &addr, &read,
+                                                 &buf, &len);
+        if (n == 0) {
+            i2c->async_result = METAL_I2C_RET_OK;
+        }
+        i2c->async_msg = msg;
+        i2c->async_index = 0;
+        i2c->async_state = METAL_I2C_ASYNC_ADDR;
+
+        command = METAL_I2C_CMD_WRITE | METAL_I2C_CMD_START;
+        if (__metal_driver_sifive_i2c0_async_stop_sent(i2c, request, len)) {
+            command |= METAL_I2C_CMD_STOP;
+        }
+
+        METAL_I2C_REGB(METAL_SIFIVE_I2C0_TRANSMIT) =
+            METAL_SIFIVE_I2C_INSERT_RW_BIT(
+                addr, (read ? METAL_I2C_READ : METAL_I2C_WRITE));
+        METAL_I2C_REGB(METAL_SIFIVE_I2C0_CONTROL) |= METAL_I2C_CONTROL_IE;
+        METAL_I2C_REGB(METAL_SIFIVE_I2C0_COMMAND) = command;
+        return;
+    }
+
+    /* Idle */
+    METAL_I2C_REGB(METAL_SIFIVE_I2C0_CONTROL) &= ~METAL_I2C_CONTROL_IE;
+}
+
+/* Advance the current request by one step once the last command completes.
+ * Called from the I2C interrupt handler, or with interrupts disabled. */
+static void __metal_driver_sifive_i2c0_async_service(
+    struct __metal_driver_sifive_i2c0 *i2c) {
+    unsigned long base =
+        __metal_driver_sifive_i2c0_control_base((struct metal_i2c *)i2c);
+    struct metal_i2c_request *request = i2c->async_head;
+    __metal_io_u8 status = METAL_I2C_REGB(METAL_SIFIVE_I2C0_STATUS);
+    unsigned int addr, len;
+    unsigned char *buf;
+    int read;
+
+    if (!(status & METAL_I2C_STATUS_IP)) {
+        return;
+    }
+    METAL_I2C_REGB(METAL_SIFIVE_I2C0_COMMAND) = METAL_I2C_CMD_IACK;
+
+    if ((request == NULL) || (i2c->async_state == METAL_I2C_ASYNC_IDLE)) {
+        return;
+    }
+
+    if (status & METAL_I2C_STATUS_AL) {
+        /* Arbitration lost, the bus has already been released */
+        METAL_I2C_LOG("I2C arbitration lost.\n");
+        __metal_driver_sifive_i2c0_async_finish(i2c, METAL_I2C_RET_ERR);
+        __metal_driver_sifive_i2c0_async_start(i2c, 0);
+        return;
+    }
+
+    __metal_driver_sifive_i2c0_async_get_msg(request, i2c->async_msg, &addr,
+                                             &read, &buf, &len);
+
+    switch (i2c->async_state) {
+    case METAL_I2C_ASYNC_STOP:
+        __metal_driver_sifive_i2c0_async_finish(i2c, i2c->async_result);
+        __metal_driver_sifive_i2c0_async_start(i2c, 0);
+        return;
+    case METAL_I2C_ASYNC_ADDR:
+    case METAL_I2C_ASYNC_WRITE:
+        if (status & METAL_I2C_STATUS_RXACK) {
+            /* No ACK, end the request */
+            METAL_I2C_LOG("I2C RX ACK failed.\n");
+            i2c->async_result = METAL_I2C_RET_ERR;
+            if (__metal_driver_sifive_i2c0_async_stop_sent(i2c, request,
+                                                            len)) {
+                /* The STOP condition has been sent already */
+                __metal_driver_sifive_i2c0_async_finish(i2c,
+                                                        METAL_I2C_RET_ERR);
+                __metal_driver_sifive_i2c0_async_start(i2c, 0);
+            } else {
+                METAL_I2C_REGB(METAL_SIFIVE_I2C0_COMMAND) = METAL_I2C_CMD_STOP;
+                i2c->async_state = METAL_I2C_ASYNC_STOP;
+            }
+            return;
+        }
+        if (i2c->async_state == METAL_I2C_ASYNC_WRITE) {
+            i2c->async_index++;
+        }
+        break;
+    case METAL_I2C_ASYNC_READ:
+        /* Store the received byte */
+        buf[i2c->async_index++] = METAL_I2C_REGB(METAL_SIFIVE_I2C0_TRANSMIT);
+        break;
+    }
+
+    if (i2c->async_index < len) {
+        __metal_driver_sifive_i2c0_async_data(i2c);
+    } else {
+        /* Finishes the request if the STOP condition was sent with the last
+         * byte */
+        __metal_driver_sifive_i2c0_async_start(i2c, i2c->async_msg + 1);
+    }
+}
+
+static void __metal_driver_sifive_i2c0_async_handler(int id, void *priv) {
+    __metal_driver_sifive_i2c0_async_service(priv);
+    __metal_driver_sifive_i2c0_async_complete(priv);
+}
+
+/* Service the queue by polling with interrupts disabled until request is done,
+ * or until the queue is empty if request is NULL. A request which makes no
+ * progress for METAL_I2C_RXDATA_TIMEOUT_US is ended with an error. */
+static void
+__metal_driver_sifive_i2c0_async_poll(struct __metal_driver_sifive_i2c0 *i2c,
+                                      struct metal_i2c_request *request) {
+    unsigned long base =
+        __metal_driver_sifive_i2c0_control_base((struct metal_i2c *)i2c);
+    struct metal_deadline timeout;
+    uintptr_t mstatus = __metal_interrupt_global_save();
+
+    METAL_I2C_TIMEOUT_RESET(timeout);
+
+    while ((request != NULL) ? !request->done : (i2c->async_head != NULL)) {
+        if (METAL_I2C_REGB(METAL_SIFIVE_I2C0_STATUS) & METAL_I2C_STATUS_IP) {
+            __metal_driver_sifive_i2c0_async_service(i2c);
+            METAL_I2C_TIMEOUT_RESET(timeout);
+        } else if (metal_deadline_expired(&timeout)) {
+            METAL_I2C_LOG("I2C timeout error.\n");
+            METAL_I2C_REGB(METAL_SIFIVE_I2C0_COMMAND) = METAL_I2C_CMD_STOP;
+            __metal_driver_sifive_i2c0_async_finish(i2c, METAL_I2C_RET_ERR);
+            __metal_driver_sifive_i2c0_async_start(i2c, 0);
+            METAL_I2C_TIMEOUT_RESET(timeout);
+        }
+        __metal_driver_sifive_i2c0_async_complete(i2c);
+    }
+
+    __metal_interrupt_global_restore(mstatus);
+}
+
+/* Perform every queued transfer before returning */
+static void
+__metal_driver_sifive_i2c0_async_drain(struct __metal_driver_sifive_i2c0 *i2c) {
+    if (i2c->async_head != NULL) {
+        __metal_driver_sifive_i2c0_async_poll(i2c, NULL);
+    }
+}
+
 static void pre_rate_change_callback(void *priv) {
     unsigned long base =
         __metal_driver_sifive_i2c0_control_base((struct metal_i2c *)priv);
+
+    /* Finish the queued transfers at the old rate */
+    __metal_driver_sifive_i2c0_async_drain(priv);
+
     /* Check for any pending transfers */
     while (METAL_I2C_REGB(METAL_SIFIVE_I2C0_STATUS) & METAL_I2C_STATUS_TIP)
         ;
@@ -169,7 +496,7 @@ static int __metal_driver_sifive_i2c0_set_baud_rate(struct metal_i2c *gi2c,
 static int __metal_driver_sifive_i2c0_write_addr(unsigned long base,
                                                  unsigned int addr,
                                                  unsigned char rw_flag) {
-    time_t timeout;
+    struct metal_deadline timeout;
     int ret = METAL_I2C_RET_OK;
     /* Reset timeout */
     METAL_I2C_TIMEOUT_RESET(timeout);
@@ -209,13 +536,14 @@ static int __metal_driver_sifive_i2c0_write(struct metal_i2c *i2c,
                                             unsigned char buf[],
                                             metal_i2c_stop_bit_t stop_bit) {
     __metal_io_u8 command;
-    time_t timeout;
+    struct metal_deadline timeout;
     int ret;
     unsigned long base = __metal_driver_sifive_i2c0_control_base(i2c);
     unsigned int i;
 
     if ((i2c != NULL) &&
         ((struct __metal_driver_sifive_i2c0 *)i2c)->init_done) {
+        __metal_driver_sifive_i2c0_async_drain((void *)i2c);
 
         /* Send address over I2C bus, current driver supports only 7bit
          * addressing */
@@ -273,12 +601,13 @@ static int __metal_driver_sifive_i2c0_read(struct metal_i2c *i2c,
                                            metal_i2c_stop_bit_t stop_bit) {
     int ret;
     __metal_io_u8 command;
-    time_t timeout;
+    struct metal_deadline timeout;
     unsigned int i;
     unsigned long base = __metal_driver_sifive_i2c0_control_base(i2c);
 
     if ((i2c != NULL) &&
         ((struct __metal_driver_sifive_i2c0 *)i2c)->init_done) {
+        __metal_driver_sifive_i2c0_async_drain((void *)i2c);
 
         /* Send address over I2C bus, current driver supports only 7bit
          * addressing */
@@ -326,13 +655,14 @@ __metal_driver_sifive_i2c0_transfer(struct metal_i2c *i2c, unsigned int addr,
                                     unsigned char txbuf[], unsigned int txlen,
                                     unsigned char rxbuf[], unsigned int rxlen) {
     __metal_io_u8 command;
-    time_t timeout;
+    struct metal_deadline timeout;
     int ret;
     unsigned int i;
     unsigned long base = __metal_driver_sifive_i2c0_control_base(i2c);
 
     if ((i2c != NULL) &&
         ((struct __metal_driver_sifive_i2c0 *)i2c)->init_done) {
+        __metal_driver_sifive_i2c0_async_drain((void *)i2c);
         if (txlen) {
             /* Set command flags */
             command = METAL_I2C_CMD_WRITE;
@@ -414,6 +744,96 @@ __metal_driver_sifive_i2c0_transfer(struct metal_i2c *i2c, unsigned int addr,
     return ret;
 }
 
+static int
+__metal_driver_sifive_i2c0_transfer_msgs(struct metal_i2c *gi2c,
+                                         struct metal_i2c_msg msgs[],
+                                         unsigned int count) {
+    struct __metal_driver_sifive_i2c0 *i2c = (void *)gi2c;
+    struct metal_i2c_request request = {
+        .msgs = msgs,
+        .nmsgs = count,
+    };
+    uintptr_t mstatus;
+
+    if ((gi2c == NULL) || !i2c->init_done) {
+        /* I2C device not initialized, return error */
+        METAL_I2C_LOG("I2C device not initialized.\n");
+        return METAL_I2C_RET_ERR;
+    }
+
+    /* Queue the request behind any asynchronous ones and run the engine by
+     * polling instead of waiting for interrupts */
+    mstatus = __metal_interrupt_global_save();
+
+    if (i2c->async_tail != NULL) {
+        i2c->async_tail->next = &request;
+    } else {
+        i2c->async_head = &request;
+    }
+    i2c->async_tail = &request;
+    if (i2c->async_state == METAL_I2C_ASYNC_IDLE) {
+        __metal_driver_sifive_i2c0_async_start(i2c, 0);
+    }
+    __metal_driver_sifive_i2c0_async_complete(i2c);
+    __metal_driver_sifive_i2c0_async_poll(i2c, &request);
+
+    __metal_interrupt_global_restore(mstatus);
+
+    return request.result;
+}
+
+static int __metal_driver_sifive_i2c0_async_init(struct metal_i2c *gi2c,
+                                                 struct metal_interrupt *intc,
+                                                 int id) {
+    struct __metal_driver_sifive_i2c0 *i2c = (void *)gi2c;
+
+    if (intc == NULL) {
+        return METAL_I2C_RET_ERR;
+    }
+
+    metal_interrupt_init(intc);
+    if ((metal_interrupt_register_handler(
+             intc, id, __metal_driver_sifive_i2c0_async_handler, i2c) != 0) ||
+        (metal_interrupt_enable(intc, id) != 0)) {
+        return METAL_I2C_RET_ERR;
+    }
+    i2c->async_intc = intc;
+    return METAL_I2C_RET_OK;
+}
+
+static int
+__metal_driver_sifive_i2c0_transfer_async(struct metal_i2c *gi2c,
+                                          struct metal_i2c_request *request) {
+    struct __metal_driver_sifive_i2c0 *i2c = (void *)gi2c;
+    uintptr_t mstatus;
+
+    if ((i2c->async_intc == NULL) || !i2c->init_done) {
+        return METAL_I2C_RET_ERR;
+    }
+
+    request->done = 0;
+    request->next = NULL;
+
+    /* Keep the I2C interrupt from servicing the queue while it changes */
+    mstatus = __metal_interrupt_global_save();
+
+    if (i2c->async_tail != NULL) {
+        i2c->async_tail->next = request;
+    } else {
+        i2c->async_head = request;
+    }
+    i2c->async_tail = request;
+
+    /* Start the transfer if the device is idle */
+    if (i2c->async_state == METAL_I2C_ASYNC_IDLE) {
+        __metal_driver_sifive_i2c0_async_start(i2c, 0);
+    }
+    __metal_driver_sifive_i2c0_async_complete(i2c);
+
+    __metal_interrupt_global_restore(mstatus);
+    return METAL_I2C_RET_OK;
+}
+
 __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_i2c0) = {
     .i2c.init = __metal_driver_sifive_i2c0_init,
     .i2c.write = __metal_driver_sifive_i2c0_write,
@@ -421,6 +841,9 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_i2c0) = {
     .i2c.transfer = __metal_driver_sifive_i2c0_transfer,
     .i2c.get_baud_rate = __metal_driver_sifive_i2c0_get_baud_rate,
     .i2c.set_baud_rate = __metal_driver_sifive_i2c0_set_baud_rate,
+    .i2c.transfer_msgs = __metal_driver_sifive_i2c0_transfer_msgs,
+    .i2c.async_init = __metal_driver_sifive_i2c0_async_init,
+    .i2c.transfer_async = __metal_driver_sifive_i2c0_transfer_async,
 };
 
 #endif /* METAL_SIFIVE_I2C0 */
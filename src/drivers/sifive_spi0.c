@@ -4,11 +4,12 @@
 #include <metal/machine/platform.h>
 
 #ifdef METAL_SIFIVE_SPI0
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/drivers/sifive_spi0.h>
 #include <metal/io.h>
+#include <metal/itim.h>
 #include <metal/machine.h>
 #include <metal/time.h>
-#include <time.h>
 
 /* Register fields */
 #define METAL_SPI_SCKDIV_MASK 0xFFF
@@ -36,7 +37,9 @@
 #define METAL_SPI_TXDATA_FULL (1 << 31)
 #define METAL_SPI_RXDATA_EMPTY (1 << 31)
 #define METAL_SPI_TXMARK_MASK 7
+#define METAL_SPI_RXMARK_MASK 7
 #define METAL_SPI_TXWM 1
+#define METAL_SPI_RXWM 2
 #define METAL_SPI_TXRXDATA_MASK (0xFF)
 
 #define METAL_SPI_INTERVAL_SHIFT 16
@@ -44,113 +47,229 @@
 #define METAL_SPI_CONTROL_IO 0
 #define METAL_SPI_CONTROL_MAPPED 1
 
+#define METAL_SPI_FFMT_CMD_EN 1
+#define METAL_SPI_FFMT_ADDR_LEN_SHIFT 1
+#define METAL_SPI_FFMT_ADDR_LEN_MASK 7
+#define METAL_SPI_FFMT_PAD_CNT_SHIFT 4
+#define METAL_SPI_FFMT_PAD_CNT_MASK 0xF
+#define METAL_SPI_FFMT_CMD_PROTO_SHIFT 8
+#define METAL_SPI_FFMT_ADDR_PROTO_SHIFT 10
+#define METAL_SPI_FFMT_DATA_PROTO_SHIFT 12
+#define METAL_SPI_FFMT_CMD_CODE_SHIFT 16
+#define METAL_SPI_FFMT_PAD_CODE_SHIFT 24
+
 #define METAL_SPI_REG(offset) (((unsigned long)control_base + offset))
 #define METAL_SPI_REGB(offset)                                                 \
     (__METAL_ACCESS_ONCE((__metal_io_u8 *)METAL_SPI_REG(offset)))
 #define METAL_SPI_REGW(offset)                                                 \
     (__METAL_ACCESS_ONCE((__metal_io_u32 *)METAL_SPI_REG(offset)))
 
-#define METAL_SPI_RXDATA_TIMEOUT 1
-
-static int configure_spi(struct __metal_driver_sifive_spi0 *spi,
-                         struct metal_spi_config *config) {
-    long control_base =
-        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+/* How long to wait for each byte to be received */
+#ifndef METAL_SPI_RXDATA_TIMEOUT_US
+#define METAL_SPI_RXDATA_TIMEOUT_US 1000000
+#endif
+
+/* Every SPI flash needs the Write Enable command before a program, erase or
+ * register write */
+#define METAL_SPI_FLASH_CMD_WREN 0x06
+
+/* Depth of the TX and RX FIFOs */
+#ifndef METAL_SIFIVE_SPI0_FIFO_DEPTH
+#define METAL_SIFIVE_SPI0_FIFO_DEPTH 8
+#endif
+
+/* Work out the register values for a configuration without touching the
+ * controller. The chip select lines share CSDEF, so only the bit for csid is
+ * set in regs->csdef and the rest are left as they are when it is written. */
+static int spi_config_regs(struct metal_spi_config *config,
+                           struct __metal_sifive_spi0_regs *regs) {
     /* Set protocol */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) &= ~(METAL_SPI_PROTO_MASK);
     switch (config->protocol) {
     case METAL_SPI_SINGLE:
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_SINGLE;
+        regs->fmt = METAL_SPI_PROTO_SINGLE;
         break;
     case METAL_SPI_DUAL:
         if (config->multi_wire == MULTI_WIRE_ALL)
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_DUAL;
+            regs->fmt = METAL_SPI_PROTO_DUAL;
         else
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_SINGLE;
+            regs->fmt = METAL_SPI_PROTO_SINGLE;
         break;
     case METAL_SPI_QUAD:
         if (config->multi_wire == MULTI_WIRE_ALL)
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_QUAD;
+            regs->fmt = METAL_SPI_PROTO_QUAD;
         else
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_SINGLE;
+            regs->fmt = METAL_SPI_PROTO_SINGLE;
         break;
     default:
         /* Unsupported value */
         return -1;
     }
 
-    /* Set Polarity */
-    if (config->polarity) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE) |=
-            (1 << METAL_SPI_SCKMODE_POL_SHIFT);
-    } else {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE) &=
-            ~(1 << METAL_SPI_SCKMODE_POL_SHIFT);
+    /* Set Endianness */
+    if (config->little_endian) {
+        regs->fmt |= METAL_SPI_ENDIAN_LSB;
     }
 
-    /* Set Phase */
+    /* Set frame length */
+    regs->fmt |= (8 << METAL_SPI_FRAME_LEN_SHIFT);
+
+    /* Set Polarity and Phase */
+    regs->sckmode = 0;
+    if (config->polarity) {
+        regs->sckmode |= (1 << METAL_SPI_SCKMODE_POL_SHIFT);
+    }
     if (config->phase) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE) |=
-            (1 << METAL_SPI_SCKMODE_PHA_SHIFT);
-    } else {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE) &=
-            ~(1 << METAL_SPI_SCKMODE_PHA_SHIFT);
+        regs->sckmode |= (1 << METAL_SPI_SCKMODE_PHA_SHIFT);
     }
 
-    /* Set Endianness */
-    if (config->little_endian) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_ENDIAN_LSB;
+    /* Set CS line and its inactive state */
+    regs->csid = config->csid;
+    if (config->cs_active_high) {
+        regs->csdef = 0;
     } else {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) &= ~(METAL_SPI_ENDIAN_LSB);
+        regs->csdef = 1UL << config->csid;
     }
 
-    /* Always populate receive FIFO */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) &= ~(METAL_SPI_DISABLE_RX);
+    /* Toggle off memory-mapped SPI flash mode, toggle on programmable IO mode
+     * for the duration of the transfer. spi_release() switches back if
+     * memory-mapped mode is enabled. */
+    regs->fctrl = METAL_SPI_CONTROL_IO;
 
-    /* Set CS Active */
-    if (config->cs_active_high) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSDEF) = 0;
-    } else {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSDEF) = 1;
+    return 0;
+}
+
+static void spi_read_regs(struct __metal_driver_sifive_spi0 *spi) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+
+    spi->shadow.fmt = METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT);
+    spi->shadow.sckmode = METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE);
+    spi->shadow.csdef = METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSDEF);
+    spi->shadow.csid = METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSID);
+    spi->shadow.fctrl = METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL);
+    spi->shadow_valid = 1;
+
+    /* Transfers put the flash interface back in memory-mapped mode if it
+     * was left there, usually by the boot ROM */
+    spi->xip_enabled = !!(spi->shadow.fctrl & METAL_SPI_CONTROL_MAPPED);
+}
+
+static void spi_write_fmt(struct __metal_driver_sifive_spi0 *spi,
+                          uint32_t fmt) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+
+    if (fmt != spi->shadow.fmt) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) = fmt;
+        spi->shadow.fmt = fmt;
     }
+}
 
-    /* Set frame length */
-    if ((METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) & METAL_SPI_FRAME_LEN_MASK) !=
-        (8 << METAL_SPI_FRAME_LEN_SHIFT)) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) &= ~(METAL_SPI_FRAME_LEN_MASK);
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |=
-            (8 << METAL_SPI_FRAME_LEN_SHIFT);
+/* Program the controller with regs, only writing the registers whose value
+ * differs from what was last written */
+static void configure_spi(struct __metal_driver_sifive_spi0 *spi,
+                          struct __metal_sifive_spi0_regs *regs,
+                          int disable_rx) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+    uint32_t csdef;
+
+    if (!spi->shadow_valid) {
+        spi_read_regs(spi);
     }
 
-    /* Set CS line */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSID) = config->csid;
+    /* The receive FIFO is populated unless the caller has no use for it */
+    spi_write_fmt(spi, regs->fmt | (disable_rx ? METAL_SPI_DISABLE_RX : 0));
 
-    /* Toggle off memory-mapped SPI flash mode, toggle on programmable IO mode
-     * It seems that with this line uncommented, the debugger cannot have access
-     * to the chip at all because it assumes the chip is in memory-mapped mode.
-     * I have to compile the code with this line commented and launch gdb,
-     * reset cores, reset $pc, set *((int *) 0x20004060) = 0, (set the flash
-     * interface control register to programmable I/O mode) and then continue
-     * Alternative, comment out the "flash" line in openocd.cfg */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = METAL_SPI_CONTROL_IO;
+    if (regs->sckmode != spi->shadow.sckmode) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_SCKMODE) = regs->sckmode;
+        spi->shadow.sckmode = regs->sckmode;
+    }
 
+    csdef = (spi->shadow.csdef & ~(1UL << regs->csid)) | regs->csdef;
+    if (csdef != spi->shadow.csdef) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSDEF) = csdef;
+        spi->shadow.csdef = csdef;
+    }
+
+    if (regs->csid != spi->shadow.csid) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSID) = regs->csid;
+        spi->shadow.csid = regs->csid;
+    }
+
+    if (regs->fctrl != spi->shadow.fctrl) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = regs->fctrl;
+        spi->shadow.fctrl = regs->fctrl;
+    }
+}
+
+/* Start a transfer in programmed I/O mode. On the flash interface nothing can
+ * be fetched from the flash until spi_release() switches it back to
+ * memory-mapped mode, so the transfer is refused unless
+ * sifive_spi0_xip_allow_pio() says the caller runs from elsewhere, and made
+ * with interrupts disabled so that no handler is fetched from the flash. */
+static int spi_acquire(struct __metal_driver_sifive_spi0 *spi,
+                       uintptr_t *mstatus) {
+    if (!spi->shadow_valid) {
+        spi_read_regs(spi);
+    }
+    if (spi->xip_enabled) {
+        if (!spi->xip_pio_allowed) {
+            return -1;
+        }
+        *mstatus = __metal_interrupt_global_save();
+    }
     return 0;
 }
 
+/* Whether a transfer sends the Write Enable command to the flash */
+static int spi_is_wren(const char *tx_buf, size_t len) {
+    return (tx_buf != NULL) && (len > 0) &&
+           ((uint8_t)tx_buf[0] == METAL_SPI_FLASH_CMD_WREN);
+}
+
+/* Release the chip select line at the end of a transfer, and hand the flash
+ * interface back to memory-mapped mode if that is where it was taken from.
+ * wren says whether the transfer was a Write Enable command. */
+static void spi_release(struct __metal_driver_sifive_spi0 *spi, int wren) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &= ~(METAL_SPI_CSMODE_MASK);
+
+    if (spi->xip_enabled) {
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = METAL_SPI_CONTROL_MAPPED;
+        spi->shadow.fctrl = METAL_SPI_CONTROL_MAPPED;
+
+        /* Only the command after a Write Enable can change the flash, so
+         * reads leave the instruction cache alone */
+        if (spi->xip_write_enabled && !wren) {
+            __asm__ volatile("fence.i" ::: "memory");
+        }
+        spi->xip_write_enabled = wren;
+    }
+}
+
+static void spi_release_pio(struct __metal_driver_sifive_spi0 *spi, int wren,
+                            uintptr_t mstatus) {
+    spi_release(spi, wren);
+    if (spi->xip_enabled) {
+        __metal_interrupt_global_restore(mstatus);
+    }
+}
+
 static void spi_mode_switch(struct __metal_driver_sifive_spi0 *spi,
                             struct metal_spi_config *config,
                             unsigned int trans_stage) {
-    long control_base =
-        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+    uint32_t fmt = spi->shadow.fmt & ~(METAL_SPI_PROTO_MASK);
 
     if (config->multi_wire == trans_stage) {
-        METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) &= ~(METAL_SPI_PROTO_MASK);
         switch (config->protocol) {
         case METAL_SPI_DUAL:
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_DUAL;
+            spi_write_fmt(spi, fmt | METAL_SPI_PROTO_DUAL);
             break;
         case METAL_SPI_QUAD:
-            METAL_SPI_REGW(METAL_SIFIVE_SPI0_FMT) |= METAL_SPI_PROTO_QUAD;
+            spi_write_fmt(spi, fmt | METAL_SPI_PROTO_QUAD);
             break;
         default:
             /* Unsupported value */
@@ -159,173 +278,628 @@ static void spi_mode_switch(struct __metal_driver_sifive_spi0 *spi,
     }
 }
 
-int __metal_driver_sifive_spi0_transfer(struct metal_spi *gspi,
-                                        struct metal_spi_config *config,
-                                        size_t len, char *tx_buf,
-                                        char *rx_buf) {
-    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
-    long control_base = __metal_driver_sifive_spi0_control_base(gspi);
-    int rc = 0;
-    size_t i = 0;
+/* Transfer bytes start to end of the buffers, keeping up to a FIFO's worth of
+ * frames in flight so that SCK never idles between frames. Returns once every
+ * frame has been received. */
+static int spi_pipeline(struct __metal_driver_sifive_spi0 *spi, char *tx_buf,
+                        char *rx_buf, size_t start, size_t end) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+    size_t tx = start;
+    size_t rx = start;
+    unsigned long rxdata;
 
-    rc = configure_spi(spi, config);
-    if (rc != 0) {
-        return rc;
-    }
+    /* Deadline to break out of infinite while loop */
+    struct metal_deadline endwait;
 
-    /* Hold the chip select line for all len transferred */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &= ~(METAL_SPI_CSMODE_MASK);
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) |= METAL_SPI_CSMODE_HOLD;
+    metal_deadline_start(&endwait, METAL_SPI_RXDATA_TIMEOUT_US);
 
-    unsigned long rxdata;
+    while (rx < end) {
+        /* Frames in flight are either in the TX FIFO, being shifted, or in
+         * the RX FIFO, so neither FIFO can overflow */
+        while ((tx < end) && ((tx - rx) < METAL_SIFIVE_SPI0_FIFO_DEPTH)) {
+            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf ? tx_buf[tx] : 0;
+            tx++;
+        }
 
-    /* Declare time_t variables to break out of infinite while loop */
-    time_t endwait;
+        rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA);
+        if (rxdata & METAL_SPI_RXDATA_EMPTY) {
+            if (metal_deadline_expired(&endwait)) {
+                return 1;
+            }
+            continue;
+        }
 
-    for (i = 0; i < config->cmd_num; i++) {
+        /* Only store the dequeued byte if the receive_buffer is not NULL */
+        if (rx_buf) {
+            rx_buf[rx] = (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
+        }
+        rx++;
+        metal_deadline_start(&endwait, METAL_SPI_RXDATA_TIMEOUT_US);
+    }
 
-        while (METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXDATA) & METAL_SPI_TXDATA_FULL)
-            ;
+    return 0;
+}
 
-        if (tx_buf) {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf[i];
-        } else {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = 0;
-        }
+/* Like spi_pipeline(), but with the receive FIFO disabled, so frames are only
+ * limited by how fast the TX FIFO can be filled. Returns once every frame has
+ * been shifted out. */
+static int spi_pipeline_tx(struct __metal_driver_sifive_spi0 *spi,
+                           char *tx_buf, size_t start, size_t end) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+    size_t tx = start;
 
-        endwait = metal_time() + METAL_SPI_RXDATA_TIMEOUT;
+    /* Deadline to break out of infinite while loop */
+    struct metal_deadline endwait;
 
-        while ((rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA)) &
-               METAL_SPI_RXDATA_EMPTY) {
-            if (metal_time() > endwait) {
-                METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &=
-                    ~(METAL_SPI_CSMODE_MASK);
+    metal_deadline_start(&endwait, METAL_SPI_RXDATA_TIMEOUT_US);
 
+    while (tx < end) {
+        if (METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXDATA) & METAL_SPI_TXDATA_FULL) {
+            if (metal_deadline_expired(&endwait)) {
                 return 1;
             }
+            continue;
         }
+        METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf ? tx_buf[tx] : 0;
+        tx++;
+        metal_deadline_start(&endwait, METAL_SPI_RXDATA_TIMEOUT_US);
+    }
 
-        if (rx_buf) {
-            rx_buf[i] = (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
+    /* Wait for the TX FIFO to empty */
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXMARK) &= ~(METAL_SPI_TXMARK_MASK);
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXMARK) |= (METAL_SPI_TXMARK_MASK & 1);
+    while ((METAL_SPI_REGW(METAL_SIFIVE_SPI0_IP) & METAL_SPI_TXWM) == 0) {
+        if (metal_deadline_expired(&endwait)) {
+            return 1;
         }
     }
 
+    /* Nothing reports when the last frame has been shifted out, so wait for
+     * as long as shifting it takes. That can be well under one mtime tick,
+     * which metal_delay_ns() measures on mcycle instead. */
+    if (spi->baud_rate > 0) {
+        metal_delay_ns((8 * 1000000000ULL + spi->baud_rate - 1) /
+                       spi->baud_rate);
+    }
+
+    return 0;
+}
+
+/* A transfer is sent as command, address, dummy and data frames in turn. The
+ * protocol can only be switched between phases once every frame of the
+ * previous phase has been shifted out. */
+#define SPI_PHASES 4
+
+static size_t spi_phase_end(struct metal_spi_config *config, size_t len,
+                            int phase) {
+    size_t end = len;
+
+    switch (phase) {
+    case 0:
+        end = config->cmd_num;
+        break;
+    case 1:
+        end = config->cmd_num + config->addr_num;
+        break;
+    case 2:
+        end = config->cmd_num + config->addr_num + config->dummy_num;
+        break;
+    }
+    return __METAL_MIN(len, end);
+}
+
+static void spi_phase_start(struct __metal_driver_sifive_spi0 *spi,
+                            struct metal_spi_config *config, int phase) {
     /* switch to Dual/Quad mode */
-    spi_mode_switch(spi, config, MULTI_WIRE_ADDR_DATA);
+    if (phase == 1) {
+        spi_mode_switch(spi, config, MULTI_WIRE_ADDR_DATA);
+    } else if (phase == 3) {
+        spi_mode_switch(spi, config, MULTI_WIRE_DATA_ONLY);
+    }
+}
+
+static int spi_transfer(struct __metal_driver_sifive_spi0 *spi,
+                        struct metal_spi_config *config,
+                        struct __metal_sifive_spi0_regs *regs, size_t len,
+                        char *tx_buf, char *rx_buf) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
+    uintptr_t mstatus = 0;
+    int rc = 0;
+    size_t i = 0;
+
+    if (spi_acquire(spi, &mstatus) != 0) {
+        return -1;
+    }
 
-    /* Send Addr data */
-    for (; i < (config->cmd_num + config->addr_num); i++) {
+    /* Without a receive buffer, don't populate the receive FIFO at all */
+    configure_spi(spi, regs, rx_buf == NULL);
 
-        while (METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXDATA) & METAL_SPI_TXDATA_FULL)
-            ;
+    /* Discard anything left in the receive FIFO by an earlier timeout */
+    while (!(METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA) & METAL_SPI_RXDATA_EMPTY))
+        ;
 
-        if (tx_buf) {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf[i];
-        } else {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = 0;
-        }
+    /* Hold the chip select line for all len transferred */
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &= ~(METAL_SPI_CSMODE_MASK);
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) |= METAL_SPI_CSMODE_HOLD;
 
-        endwait = metal_time() + METAL_SPI_RXDATA_TIMEOUT;
+    for (int phase = 0; (phase < SPI_PHASES) && (rc == 0); phase++) {
+        size_t end = spi_phase_end(config, len, phase);
 
-        while ((rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA)) &
-               METAL_SPI_RXDATA_EMPTY) {
-            if (metal_time() > endwait) {
-                METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &=
-                    ~(METAL_SPI_CSMODE_MASK);
+        spi_phase_start(spi, config, phase);
 
-                return 1;
-            }
+        if (i == end) {
+            continue;
         }
 
         if (rx_buf) {
-            rx_buf[i] = (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
+            rc = spi_pipeline(spi, tx_buf, rx_buf, i, end);
+        } else {
+            rc = spi_pipeline_tx(spi, tx_buf, i, end);
         }
+        i = end;
     }
 
-    /* Send Dummy data */
-    for (; i < (config->cmd_num + config->addr_num + config->dummy_num); i++) {
+    /* Set CSMODE to auto so that the chip select transitions back to high
+     * once the last frame has been shifted out, or immediately if the transfer
+     * timed out */
+    spi_release_pio(spi, spi_is_wren(tx_buf, len), mstatus);
 
-        while (METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXDATA) & METAL_SPI_TXDATA_FULL)
-            ;
+    return rc;
+}
 
-        if (tx_buf) {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf[i];
-        } else {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = 0;
+static void spi_async_finish(struct __metal_driver_sifive_spi0 *spi,
+                             int result) {
+    struct metal_spi_request *request = spi->async_head;
+    struct metal_spi_request **done = &spi->async_done;
+
+    /* Release the chip select line */
+    spi_release(spi, 0);
+
+    spi->async_head = request->next;
+    if (spi->async_head == NULL) {
+        spi->async_tail = NULL;
+    }
+    spi->async_started = 0;
+
+    /* Reported by spi_async_complete() */
+    while (*done != NULL) {
+        done = &(*done)->next;
+    }
+    request->result = result;
+    request->next = NULL;
+    *done = request;
+}
+
+/* Report the transfers which have finished. Called once spi_async_service()
+ * has started the next queued request, so that the bus stays busy while the
+ * callbacks run, and a callback which queues or performs another transfer
+ * never re-enters spi_async_service() from inside it. */
+static void spi_async_complete(struct __metal_driver_sifive_spi0 *spi) {
+    struct metal_spi_request *request;
+
+    while ((request = spi->async_done) != NULL) {
+        spi->async_done = request->next;
+
+        __asm__ volatile("fence rw, w" ::: "memory");
+        request->done = 1;
+        if (request->callback != NULL) {
+            request->callback(&spi->spi, request);
         }
+    }
+}
 
-        endwait = metal_time() + METAL_SPI_RXDATA_TIMEOUT;
+/* Move the queued transfers along as far as the FIFOs allow. Called from the
+ * SPI interrupt handler, or with interrupts disabled. */
+static void spi_async_service(struct __metal_driver_sifive_spi0 *spi) {
+    long control_base =
+        __metal_driver_sifive_spi0_control_base((struct metal_spi *)spi);
 
-        while ((rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA)) &
-               METAL_SPI_RXDATA_EMPTY) {
-            if (metal_time() > endwait) {
-                METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &=
-                    ~(METAL_SPI_CSMODE_MASK);
-                return 1;
+    while (spi->async_head != NULL) {
+        struct metal_spi_request *request = spi->async_head;
+        struct metal_spi_config *config = request->config;
+        size_t end;
+
+        if (!spi->async_started) {
+            struct __metal_sifive_spi0_regs regs;
+
+            if (spi_config_regs(config, &regs) != 0) {
+                spi_async_finish(spi, -1);
+                continue;
             }
+
+            /* The receive FIFO is always populated, it is what paces the
+             * transfer */
+            configure_spi(spi, &regs, 0);
+
+            while (!(METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA) &
+                     METAL_SPI_RXDATA_EMPTY))
+                ;
+
+            METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &=
+                ~(METAL_SPI_CSMODE_MASK);
+            METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) |= METAL_SPI_CSMODE_HOLD;
+
+            spi->async_started = 1;
+            spi->async_phase = 0;
+            spi->async_tx = 0;
+            spi->async_rx = 0;
+            spi_phase_start(spi, config, 0);
         }
-        if (rx_buf) {
-            rx_buf[i] = (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
+
+        end = spi_phase_end(config, request->len, spi->async_phase);
+
+        /* Collect the frames which have been received */
+        while (spi->async_rx < end) {
+            unsigned long rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA);
+
+            if (rxdata & METAL_SPI_RXDATA_EMPTY) {
+                break;
+            }
+            if (request->rx_buf) {
+                request->rx_buf[spi->async_rx] =
+                    (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
+            }
+            spi->async_rx++;
+        }
+
+        if (spi->async_rx == request->len) {
+            spi_async_finish(spi, 0);
+            continue;
+        }
+
+        if (spi->async_rx == end) {
+            spi->async_phase++;
+            spi_phase_start(spi, config, spi->async_phase);
+            continue;
+        }
+
+        /* Keep the FIFOs full */
+        while ((spi->async_tx < end) &&
+               ((spi->async_tx - spi->async_rx) <
+                METAL_SIFIVE_SPI0_FIFO_DEPTH)) {
+            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) =
+                request->tx_buf ? request->tx_buf[spi->async_tx] : 0;
+            spi->async_tx++;
         }
+
+        /* Interrupt once half of the frames in flight have been received, so
+         * that the rest keep the bus busy while the handler runs */
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXMARK) =
+            ((spi->async_tx - spi->async_rx - 1) / 2) & METAL_SPI_RXMARK_MASK;
+        METAL_SPI_REGW(METAL_SIFIVE_SPI0_IE) |= METAL_SPI_RXWM;
+        return;
     }
 
-    /* switch to Dual/Quad mode */
-    spi_mode_switch(spi, config, MULTI_WIRE_DATA_ONLY);
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_IE) &= ~(METAL_SPI_RXWM);
+}
+
+static void spi_async_handler(int id, void *priv) {
+    spi_async_service(priv);
+    spi_async_complete(priv);
+}
+
+/* Perform every queued transfer before returning */
+static void spi_async_drain(struct __metal_driver_sifive_spi0 *spi) {
+    uintptr_t mstatus;
+
+    if (spi->async_head == NULL) {
+        return;
+    }
+
+    mstatus = __metal_interrupt_global_save();
+
+    while (spi->async_head != NULL) {
+        spi_async_service(spi);
+        spi_async_complete(spi);
+    }
+
+    __metal_interrupt_global_restore(mstatus);
+}
+
+int __metal_driver_sifive_spi0_transfer(struct metal_spi *gspi,
+                                        struct metal_spi_config *config,
+                                        size_t len, char *tx_buf,
+                                        char *rx_buf) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    struct __metal_sifive_spi0_regs regs;
+
+    if (spi_config_regs(config, &regs) != 0) {
+        return -1;
+    }
+    spi_async_drain(spi);
+    return spi_transfer(spi, config, &regs, len, tx_buf, rx_buf);
+}
 
-    for (; i < len; i++) {
-        /* Master send bytes to the slave */
+int __metal_driver_sifive_spi0_transaction(struct metal_spi *gspi,
+                                           struct metal_spi_config *config,
+                                           struct metal_spi_segment *segments,
+                                           unsigned int count) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    long control_base = __metal_driver_sifive_spi0_control_base(gspi);
+    struct __metal_sifive_spi0_regs regs;
+    uintptr_t mstatus = 0;
+    int rc = 0;
 
-        /* Wait for TXFIFO to not be full */
-        while (METAL_SPI_REGW(METAL_SIFIVE_SPI0_TXDATA) & METAL_SPI_TXDATA_FULL)
-            ;
+    if (spi_config_regs(config, &regs) != 0) {
+        return -1;
+    }
+    regs.fmt &= ~(METAL_SPI_PROTO_MASK);
 
-        /* Transfer byte by modifying the least significant byte in the TXDATA
-         * register */
-        if (tx_buf) {
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = tx_buf[i];
+    spi_async_drain(spi);
+    if (spi_acquire(spi, &mstatus) != 0) {
+        return -1;
+    }
+    configure_spi(spi, &regs, 0);
+
+    /* Discard anything left in the receive FIFO by an earlier timeout */
+    while (!(METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA) & METAL_SPI_RXDATA_EMPTY))
+        ;
+
+    /* Hold the chip select line for all of the segments */
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &= ~(METAL_SPI_CSMODE_MASK);
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) |= METAL_SPI_CSMODE_HOLD;
+
+    for (unsigned int i = 0; (i < count) && (rc == 0); i++) {
+        struct metal_spi_segment *segment = &segments[i];
+        uint32_t fmt = regs.fmt;
+
+        switch (segment->protocol) {
+        case METAL_SPI_SINGLE:
+            fmt |= METAL_SPI_PROTO_SINGLE;
+            break;
+        case METAL_SPI_DUAL:
+            fmt |= METAL_SPI_PROTO_DUAL;
+            break;
+        case METAL_SPI_QUAD:
+            fmt |= METAL_SPI_PROTO_QUAD;
+            break;
+        default:
+            /* Unsupported value */
+            rc = -1;
+            continue;
+        }
+
+        /* The previous segment has been shifted out, so the format can
+         * change */
+        if (segment->rx_buf == NULL) {
+            fmt |= METAL_SPI_DISABLE_RX;
+        }
+        spi_write_fmt(spi, fmt);
+
+        if (segment->len == 0) {
+            continue;
+        }
+
+        if (segment->rx_buf) {
+            rc = spi_pipeline(spi, segment->tx_buf, segment->rx_buf, 0,
+                              segment->len);
         } else {
-            /* Transfer a 0 byte if the sending buffer is NULL */
-            METAL_SPI_REGB(METAL_SIFIVE_SPI0_TXDATA) = 0;
+            rc = spi_pipeline_tx(spi, segment->tx_buf, 0, segment->len);
         }
+    }
 
-        /* Master receives bytes from the RX FIFO */
+    spi_release_pio(spi,
+                    (count > 0) &&
+                        spi_is_wren(segments[0].tx_buf, segments[0].len),
+                    mstatus);
 
-        /* Wait for RXFIFO to not be empty, but break the nested loops if
-         * timeout this timeout method  needs refining, preferably taking into
-         * account the device specs */
-        endwait = metal_time() + METAL_SPI_RXDATA_TIMEOUT;
+    return rc;
+}
 
-        while ((rxdata = METAL_SPI_REGW(METAL_SIFIVE_SPI0_RXDATA)) &
-               METAL_SPI_RXDATA_EMPTY) {
-            if (metal_time() > endwait) {
-                /* If timeout, deassert the CS */
-                METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &=
-                    ~(METAL_SPI_CSMODE_MASK);
+int __metal_driver_sifive_spi0_prepare(struct metal_spi *gspi,
+                                       struct metal_spi_config *config) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
 
-                /* If timeout, return error code 1 immediately */
-                return 1;
+    for (int i = 0; i < METAL_SIFIVE_SPI0_PREPARED_CONFIGS; i++) {
+        struct __metal_sifive_spi0_prepared *prepared = &spi->prepared[i];
+
+        if (!prepared->used) {
+            if (spi_config_regs(config, &prepared->regs) != 0) {
+                return -1;
             }
+            prepared->config = *config;
+            prepared->used = 1;
+            return i;
         }
+    }
+    return -1;
+}
 
-        /* Only store the dequeued byte if the receive_buffer is not NULL */
-        if (rx_buf) {
-            rx_buf[i] = (char)(rxdata & METAL_SPI_TXRXDATA_MASK);
-        }
+int __metal_driver_sifive_spi0_transfer_prepared(struct metal_spi *gspi,
+                                                 int handle, size_t len,
+                                                 char *tx_buf, char *rx_buf) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    struct __metal_sifive_spi0_prepared *prepared;
+
+    if ((handle < 0) || (handle >= METAL_SIFIVE_SPI0_PREPARED_CONFIGS)) {
+        return -1;
+    }
+    prepared = &spi->prepared[handle];
+    if (!prepared->used) {
+        return -1;
     }
+    spi_async_drain(spi);
+    return spi_transfer(spi, &prepared->config, &prepared->regs, len, tx_buf,
+                        rx_buf);
+}
 
-    /* On the last byte, set CSMODE to auto so that the chip select transitions
-     * back to high The reason that CS pin is not deasserted after transmitting
-     * out the byte buffer is timing. The code on the host side likely executes
-     * faster than the ability of FIFO to send out bytes. After the host
-     * iterates through the array, fifo is likely not cleared yet. If host
-     * deasserts the CS pin immediately, the following bytes in the output FIFO
-     * will not be sent consecutively.
-     * There needs to be a better way to handle this. */
-    METAL_SPI_REGW(METAL_SIFIVE_SPI0_CSMODE) &= ~(METAL_SPI_CSMODE_MASK);
+void __metal_driver_sifive_spi0_unprepare(struct metal_spi *gspi, int handle) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
 
+    if ((handle >= 0) && (handle < METAL_SIFIVE_SPI0_PREPARED_CONFIGS)) {
+        spi->prepared[handle].used = 0;
+    }
+}
+
+int __metal_driver_sifive_spi0_async_init(struct metal_spi *gspi,
+                                          struct metal_interrupt *intc,
+                                          int id) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+
+    if (intc == NULL) {
+        return -1;
+    }
+
+    metal_interrupt_init(intc);
+    if ((metal_interrupt_register_handler(intc, id, spi_async_handler, spi) !=
+         0) ||
+        (metal_interrupt_enable(intc, id) != 0)) {
+        return -1;
+    }
+    spi->async_intc = intc;
+    return 0;
+}
+
+int __metal_driver_sifive_spi0_transfer_async(
+    struct metal_spi *gspi, struct metal_spi_request *request) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    uintptr_t mstatus;
+
+    /* The flash interface would be out of memory-mapped mode with interrupts
+     * enabled for the whole transfer */
+    if ((spi->async_intc == NULL) || spi->xip_enabled) {
+        return -1;
+    }
+
+    request->done = 0;
+    request->next = NULL;
+
+    /* Keep the SPI interrupt from servicing the queue while it changes */
+    mstatus = __metal_interrupt_global_save();
+
+    if (spi->async_tail != NULL) {
+        spi->async_tail->next = request;
+    } else {
+        spi->async_head = request;
+    }
+    spi->async_tail = request;
+
+    /* Start the transfer if the device is idle */
+    spi_async_service(spi);
+    spi_async_complete(spi);
+
+    __metal_interrupt_global_restore(mstatus);
+    return 0;
+}
+
+static int spi_ffmt_proto(unsigned int protocol, int shift,
+                          uint32_t *ffmt) {
+    switch (protocol) {
+    case METAL_SPI_SINGLE:
+        *ffmt |= METAL_SPI_PROTO_SINGLE << shift;
+        return 0;
+    case METAL_SPI_DUAL:
+        *ffmt |= METAL_SPI_PROTO_DUAL << shift;
+        return 0;
+    case METAL_SPI_QUAD:
+        *ffmt |= METAL_SPI_PROTO_QUAD << shift;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Switching the flash interface out of memory-mapped mode stops instruction
+ * fetches from the flash, so this must run from elsewhere with interrupts
+ * disabled and without calling anything */
+METAL_PLACE_IN_ITIM __attribute__((noinline)) static void
+spi_write_ffmt(long control_base, uint32_t ffmt, uint32_t fctrl) {
+    uintptr_t mstatus = __metal_interrupt_global_save();
+
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = METAL_SPI_CONTROL_IO;
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FFMT) = ffmt;
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = fctrl;
+
+    /* Discard anything fetched with the old format */
+    __asm__ volatile("fence.i" ::: "memory");
+
+    __metal_interrupt_global_restore(mstatus);
+}
+
+int sifive_spi0_set_flash_format(
+    struct metal_spi *gspi, const struct sifive_spi0_flash_format *format) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    long control_base = __metal_driver_sifive_spi0_control_base(gspi);
+    uint32_t ffmt = 0;
+
+    if ((format->addr_len > METAL_SPI_FFMT_ADDR_LEN_MASK) ||
+        (format->dummy_cycles > METAL_SPI_FFMT_PAD_CNT_MASK)) {
+        return -1;
+    }
+
+    if (format->cmd_enable) {
+        ffmt |= METAL_SPI_FFMT_CMD_EN;
+    }
+    ffmt |= format->addr_len << METAL_SPI_FFMT_ADDR_LEN_SHIFT;
+    ffmt |= format->dummy_cycles << METAL_SPI_FFMT_PAD_CNT_SHIFT;
+    if ((spi_ffmt_proto(format->cmd_proto, METAL_SPI_FFMT_CMD_PROTO_SHIFT,
+                        &ffmt) != 0) ||
+        (spi_ffmt_proto(format->addr_proto, METAL_SPI_FFMT_ADDR_PROTO_SHIFT,
+                        &ffmt) != 0) ||
+        (spi_ffmt_proto(format->data_proto, METAL_SPI_FFMT_DATA_PROTO_SHIFT,
+                        &ffmt) != 0)) {
+        return -1;
+    }
+    ffmt |= (uint32_t)format->cmd_code << METAL_SPI_FFMT_CMD_CODE_SHIFT;
+    ffmt |= (uint32_t)format->pad_code << METAL_SPI_FFMT_PAD_CODE_SHIFT;
+
+    if (!spi->shadow_valid) {
+        spi_read_regs(spi);
+    }
+
+    spi_async_drain(spi);
+    spi_write_ffmt(control_base, ffmt, spi->shadow.fctrl);
     return 0;
 }
 
+void sifive_spi0_xip_enable(struct metal_spi *gspi) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    long control_base = __metal_driver_sifive_spi0_control_base(gspi);
+
+    if (!spi->shadow_valid) {
+        spi_read_regs(spi);
+    }
+
+    spi_async_drain(spi);
+    spi->xip_enabled = 1;
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = METAL_SPI_CONTROL_MAPPED;
+    spi->shadow.fctrl = METAL_SPI_CONTROL_MAPPED;
+
+    /* Nothing fetched from the flash address range while memory-mapped mode
+     * was off is valid */
+    __asm__ volatile("fence.i" ::: "memory");
+}
+
+int sifive_spi0_xip_disable(struct metal_spi *gspi) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+    long control_base = __metal_driver_sifive_spi0_control_base(gspi);
+
+    if (!spi->shadow_valid) {
+        spi_read_regs(spi);
+    }
+
+    /* Nothing can run from the flash once it is switched off */
+    if (spi->xip_enabled && !spi->xip_pio_allowed) {
+        return -1;
+    }
+
+    spi_async_drain(spi);
+    spi->xip_enabled = 0;
+    spi->xip_write_enabled = 0;
+    METAL_SPI_REGW(METAL_SIFIVE_SPI0_FCTRL) = METAL_SPI_CONTROL_IO;
+    spi->shadow.fctrl = METAL_SPI_CONTROL_IO;
+    return 0;
+}
+
+void sifive_spi0_xip_allow_pio(struct metal_spi *gspi, int allow) {
+    struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
+
+    spi->xip_pio_allowed = allow;
+}
+
 int __metal_driver_sifive_spi0_get_baud_rate(struct metal_spi *gspi) {
     struct __metal_driver_sifive_spi0 *spi = (void *)gspi;
     return spi->baud_rate;
@@ -364,6 +938,9 @@ static void pre_rate_change_callback_func(void *priv) {
     long control_base =
         __metal_driver_sifive_spi0_control_base((struct metal_spi *)priv);
 
+    /* Finish the queued transfers at the old rate */
+    spi_async_drain(priv);
+
     /* Detect when the TXDATA is empty by setting the transmit watermark count
      * to one and waiting until an interrupt is pending (indicating an empty
      * TXFIFO) */
@@ -400,6 +977,8 @@ void __metal_driver_sifive_spi0_init(struct metal_spi *gspi, int baud_rate) {
 
     metal_spi_set_baud_rate(&(spi->spi), baud_rate);
 
+    spi_read_regs(spi);
+
     if (pinmux != NULL) {
         long pinmux_output_selector =
             __metal_driver_sifive_spi0_pinmux_output_selector(gspi);
@@ -416,6 +995,12 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_spi0) = {
     .spi.transfer = __metal_driver_sifive_spi0_transfer,
     .spi.get_baud_rate = __metal_driver_sifive_spi0_get_baud_rate,
     .spi.set_baud_rate = __metal_driver_sifive_spi0_set_baud_rate,
+    .spi.transaction = __metal_driver_sifive_spi0_transaction,
+    .spi.prepare = __metal_driver_sifive_spi0_prepare,
+    .spi.transfer_prepared = __metal_driver_sifive_spi0_transfer_prepared,
+    .spi.unprepare = __metal_driver_sifive_spi0_unprepare,
+    .spi.async_init = __metal_driver_sifive_spi0_async_init,
+    .spi.transfer_async = __metal_driver_sifive_spi0_transfer_async,
 };
 #endif /* METAL_SIFIVE_SPI0 */
 
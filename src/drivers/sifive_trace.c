@@ -5,8 +5,12 @@
 
 #ifdef METAL_SIFIVE_TRACE
 
+#include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/drivers/sifive_trace.h>
+#include <metal/lock.h>
 #include <metal/machine.h>
+#include <metal/time.h>
 
 #define TRACE_REG(offset) (((unsigned long)base + (offset)))
 #define TRACE_REG8(offset)                                                     \
@@ -16,72 +20,146 @@
 #define TRACE_REG32(offset)                                                    \
     (__METAL_ACCESS_ONCE((__metal_io_u32 *)TRACE_REG(offset)))
 
-static void write_itc_uint32(struct metal_uart *trace, uint32_t data) {
-    long base = __metal_driver_sifive_trace_base(trace);
+#define TRACE_ITCSTIMULUS(channel)                                             \
+    (METAL_SIFIVE_TRACE_ITCSTIMULUS + (4 * (channel)))
 
-    TRACE_REG32(METAL_SIFIVE_TRACE_ITCSTIMULUS) = data;
+static void write_itc_uint32(long base, unsigned int channel, uint32_t data) {
+    TRACE_REG32(TRACE_ITCSTIMULUS(channel)) = data;
 }
 
-static void write_itc_uint16(struct metal_uart *trace, uint16_t data) {
-    long base = __metal_driver_sifive_trace_base(trace);
+static void write_itc_uint16(long base, unsigned int channel, uint16_t data) {
+    TRACE_REG16(TRACE_ITCSTIMULUS(channel) + 2) = data;
+}
+
+static void write_itc_uint8(long base, unsigned int channel, uint8_t data) {
+    TRACE_REG8(TRACE_ITCSTIMULUS(channel) + 3) = data;
+}
+
+/* Every hart writes its timestamp markers to the same channel, so the two
+ * words of a marker mustn't be split by another hart's or handler's */
+METAL_LOCK_DECLARE(__metal_sifive_trace_timestamp_lock);
+
+static void __metal_sifive_trace_timestamp(long base) {
+    unsigned long long mtime = 0;
+    uintptr_t mstatus = __metal_interrupt_global_save();
+#ifdef __riscv_atomic
+    metal_lock_take(&__metal_sifive_trace_timestamp_lock);
+#endif
+
+    metal_time_get_mtime(&mtime);
+    write_itc_uint32(base, METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL,
+                     (uint32_t)mtime);
+    write_itc_uint32(base, METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL,
+                     (uint32_t)(mtime >> 32));
+
+#ifdef __riscv_atomic
+    metal_lock_give(&__metal_sifive_trace_timestamp_lock);
+#endif
+    __metal_interrupt_global_restore(mstatus);
+}
 
-    TRACE_REG16(METAL_SIFIVE_TRACE_ITCSTIMULUS + 2) = data;
+/* Other than timestamps, nothing is buffered between calls and each hart
+ * writes its own channel, so harts never share any state */
+static void __metal_sifive_trace_write(long base, unsigned int channel,
+                                       const unsigned char *buf, size_t len) {
+#ifdef METAL_SIFIVE_TRACE_TIMESTAMPS
+    __metal_sifive_trace_timestamp(base);
+#endif
+
+    for (; len >= 4; buf += 4, len -= 4) {
+        write_itc_uint32(base, channel,
+                         buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+                             ((uint32_t)buf[3] << 24));
+    }
+
+    switch (len) {
+    case 3:
+        write_itc_uint16(base, channel, buf[0] | (buf[1] << 8));
+        write_itc_uint8(base, channel, buf[2]);
+        break;
+    case 2:
+        write_itc_uint16(base, channel, buf[0] | (buf[1] << 8));
+        break;
+    case 1:
+        write_itc_uint8(base, channel, buf[0]);
+        break;
+    }
 }
 
-static void write_itc_uint8(struct metal_uart *trace, uint8_t data) {
+static int __metal_sifive_trace_hart_channel(void) {
+    return METAL_SIFIVE_TRACE_HART_CHANNEL(metal_cpu_get_current_hartid());
+}
+
+int sifive_trace_channel_enable(struct metal_uart *trace,
+                                unsigned int channel) {
     long base = __metal_driver_sifive_trace_base(trace);
 
-    TRACE_REG8(METAL_SIFIVE_TRACE_ITCSTIMULUS + 3) = data;
+    if (channel >= METAL_SIFIVE_TRACE_ITC_CHANNELS) {
+        return -1;
+    }
+    TRACE_REG32(METAL_SIFIVE_TRACE_ITCTRACEENABLE) |= (1UL << channel);
+    return 0;
 }
 
-int __metal_driver_sifive_trace_putc(struct metal_uart *trace, int c) {
-    static uint32_t buffer = 0;
-    static int bytes_in_buffer = 0;
-
-    buffer |= (((uint32_t)c) << (bytes_in_buffer * 8));
-
-    bytes_in_buffer += 1;
-
-    if (bytes_in_buffer >= 4) {
-        write_itc_uint32(trace, buffer);
-
-        buffer = 0;
-        bytes_in_buffer = 0;
-    } else if (((char)c == '\n') || ((char)c == '\r')) { // partial write
-        switch (bytes_in_buffer) {
-        case 3: // do a full word write
-            write_itc_uint16(trace, (uint16_t)(buffer));
-            write_itc_uint8(trace, (uint8_t)(buffer >> 16));
-            break;
-        case 2: // do a 16 bit write
-            write_itc_uint16(trace, (uint16_t)buffer);
-            break;
-        case 1: // do a 1 byte write
-            write_itc_uint8(trace, (uint8_t)buffer);
-            break;
-        }
-
-        buffer = 0;
-        bytes_in_buffer = 0;
+int sifive_trace_channel_write(struct metal_uart *trace, unsigned int channel,
+                               const void *buf, size_t len) {
+    if (channel >= METAL_SIFIVE_TRACE_ITC_CHANNELS) {
+        return -1;
     }
+    __metal_sifive_trace_write(__metal_driver_sifive_trace_base(trace), channel,
+                               buf, len);
+    return 0;
+}
+
+int sifive_trace_channel_write_uint32(struct metal_uart *trace,
+                                      unsigned int channel, uint32_t value) {
+    if (channel >= METAL_SIFIVE_TRACE_ITC_CHANNELS) {
+        return -1;
+    }
+    write_itc_uint32(__metal_driver_sifive_trace_base(trace), channel, value);
+    return 0;
+}
 
+int sifive_trace_timestamp(struct metal_uart *trace) {
+    __metal_sifive_trace_timestamp(__metal_driver_sifive_trace_base(trace));
+    return 0;
+}
+
+int __metal_driver_sifive_trace_write(struct metal_uart *trace,
+                                      const char *buf, size_t len) {
+    return sifive_trace_channel_write(
+        trace, __metal_sifive_trace_hart_channel(), buf, len);
+}
+
+int __metal_driver_sifive_trace_putc(struct metal_uart *trace, int c) {
+    unsigned char ch = c;
+
+    sifive_trace_channel_write(trace, __metal_sifive_trace_hart_channel(), &ch,
+                               1);
     return c;
 }
 
 void __metal_driver_sifive_trace_init(struct metal_uart *trace, int baud_rate) {
-    // The only init we do here is to make sure ITC 0 is enabled. It is up to
-    // Freedom Studio or other mechanisms to make sure tracing is enabled. If we
-    // try to enable tracing here, it will likely conflict with Freedom Studio,
-    // and they will just fight with each other.
+    // The only init we do here is to make sure the ITC channels we write to
+    // are enabled. It is up to Freedom Studio or other mechanisms to make sure
+    // tracing is enabled. If we try to enable tracing here, it will likely
+    // conflict with Freedom Studio, and they will just fight with each other.
 
-    long base = __metal_driver_sifive_trace_base(trace);
-
-    TRACE_REG32(METAL_SIFIVE_TRACE_ITCTRACEENABLE) |= 0x00000001;
+    for (int i = 0; i < __METAL_DT_MAX_HARTS; i++) {
+        sifive_trace_channel_enable(trace, METAL_SIFIVE_TRACE_HART_CHANNEL(i));
+    }
+#ifdef METAL_SIFIVE_TRACE_TIMESTAMPS
+    sifive_trace_channel_enable(trace, METAL_SIFIVE_TRACE_TIMESTAMP_CHANNEL);
+#endif
+#ifdef __riscv_atomic
+    metal_lock_init(&__metal_sifive_trace_timestamp_lock);
+#endif
 }
 
 __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_trace) = {
     .uart.init = __metal_driver_sifive_trace_init,
     .uart.putc = __metal_driver_sifive_trace_putc,
+    .uart.write = __metal_driver_sifive_trace_write,
     .uart.getc = NULL,
 
     .uart.get_baud_rate = NULL,
@@ -5,8 +5,11 @@
 
 #ifdef METAL_SIFIVE_UART0
 
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/drivers/sifive_uart0.h>
+#include <metal/lock.h>
 #include <metal/machine.h>
+#include <metal/time.h>
 
 /* TXDATA Fields */
 #define UART_TXEN (1 << 0)
@@ -27,6 +30,17 @@
 #define UART_TXWM (1 << 0)
 #define UART_RXWM (1 << 1)
 
+/* Refill the transmit FIFO from the ring once fewer than this many entries
+ * are left in it */
+#define UART_TX_WATERMARK 4
+
+/* Raise RXWM as soon as a single character is waiting, the handler then
+ * drains everything in the receive FIFO */
+#define UART_RX_WATERMARK 0
+
+#define UART_TX_RING_MASK (METAL_SIFIVE_UART0_TX_RING_SIZE - 1)
+#define UART_RX_RING_MASK (METAL_SIFIVE_UART0_RX_RING_SIZE - 1)
+
 #define UART_REG(offset) (((unsigned long)control_base + offset))
 #define UART_REGB(offset)                                                      \
     (__METAL_ACCESS_ONCE((__metal_io_u8 *)UART_REG(offset)))
@@ -80,6 +94,7 @@ int __metal_driver_sifive_uart0_set_tx_watermark(struct metal_uart *uart,
                                                  size_t level) {
     long control_base = __metal_driver_sifive_uart0_control_base(uart);
 
+    UART_REGW(METAL_SIFIVE_UART0_TXCTRL) &= ~(UART_TXCNT(0x7));
     UART_REGW(METAL_SIFIVE_UART0_TXCTRL) |= UART_TXCNT(level);
     return 0;
 }
@@ -94,6 +109,7 @@ int __metal_driver_sifive_uart0_set_rx_watermark(struct metal_uart *uart,
                                                  size_t level) {
     long control_base = __metal_driver_sifive_uart0_control_base(uart);
 
+    UART_REGW(METAL_SIFIVE_UART0_RXCTRL) &= ~(UART_RXCNT(0x7));
     UART_REGW(METAL_SIFIVE_UART0_RXCTRL) |= UART_RXCNT(level);
     return 0;
 }
@@ -104,26 +120,186 @@ size_t __metal_driver_sifive_uart0_get_rx_watermark(struct metal_uart *uart) {
     return ((UART_REGW(METAL_SIFIVE_UART0_RXCTRL) >> 16) & 0x7);
 }
 
-int __metal_driver_sifive_uart0_putc(struct metal_uart *uart, int c) {
+static void __metal_sifive_uart0_putc_polled(struct metal_uart *uart, int c) {
     long control_base = __metal_driver_sifive_uart0_control_base(uart);
 
     while (__metal_driver_sifive_uart0_txready(uart) != 0) {
         /* wait */
     }
     UART_REGW(METAL_SIFIVE_UART0_TXDATA) = c;
+}
+
+/* Serializes every access to the rings and to the FIFOs behind them, between
+ * the interrupt handler, which may run on any hart the interrupt controller
+ * delivers the UART interrupt to, and callers on every hart */
+METAL_LOCK_DECLARE(__metal_sifive_uart0_lock);
+static int __metal_sifive_uart0_lock_done;
+
+static uintptr_t __metal_sifive_uart0_lock_take(void) {
+    uintptr_t mstatus;
+
+    /* The handler takes the lock too, so it mustn't interrupt the holder */
+    mstatus = __metal_interrupt_global_save();
+#ifdef __riscv_atomic
+    metal_lock_take(&__metal_sifive_uart0_lock);
+#endif
+    return mstatus;
+}
+
+static void __metal_sifive_uart0_lock_give(uintptr_t mstatus) {
+#ifdef __riscv_atomic
+    metal_lock_give(&__metal_sifive_uart0_lock);
+#endif
+    __metal_interrupt_global_restore(mstatus);
+}
+
+/* Move characters from the transmit ring into the hardware FIFO until either
+ * the ring is empty or the FIFO is full. Called with the lock held. */
+static void __metal_sifive_uart0_tx_drain(struct metal_uart *guart) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    long control_base = __metal_driver_sifive_uart0_control_base(guart);
+    unsigned int tail = uart->tx_tail;
+    unsigned int head = uart->tx_head;
+
+    while (tail != head) {
+        if (UART_REGW(METAL_SIFIVE_UART0_TXDATA) & UART_TXFULL) {
+            break;
+        }
+        UART_REGW(METAL_SIFIVE_UART0_TXDATA) =
+            uart->tx_ring[tail & UART_TX_RING_MASK];
+        tail++;
+    }
+    uart->tx_tail = tail;
+
+    if (tail == head) {
+        UART_REGW(METAL_SIFIVE_UART0_IE) &= ~UART_TXWM;
+    } else if (uart->buffered) {
+        UART_REGW(METAL_SIFIVE_UART0_IE) |= UART_TXWM;
+    }
+}
+
+/* Move every character waiting in the receive FIFO into the receive ring.
+ * Characters which arrive while the ring is full are dropped. Called with the
+ * lock held. */
+static void __metal_sifive_uart0_rx_fill(struct metal_uart *guart) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    long control_base = __metal_driver_sifive_uart0_control_base(guart);
+    unsigned int head = uart->rx_head;
+    uint32_t ch;
+
+    while (!((ch = UART_REGW(METAL_SIFIVE_UART0_RXDATA)) & UART_RXEMPTY)) {
+        if ((head - uart->rx_tail) < METAL_SIFIVE_UART0_RX_RING_SIZE) {
+            uart->rx_ring[head & UART_RX_RING_MASK] = ch & 0x0ff;
+            head++;
+        }
+    }
+    uart->rx_head = head;
+}
+
+static void __metal_driver_sifive_uart0_handler(int id, void *priv) {
+    struct __metal_driver_sifive_uart0 *uart = priv;
+    long control_base =
+        __metal_driver_sifive_uart0_control_base((struct metal_uart *)priv);
+    uintptr_t mstatus = __metal_sifive_uart0_lock_take();
+    uint32_t ip = UART_REGW(METAL_SIFIVE_UART0_IP);
+
+    if (ip & UART_RXWM) {
+        __metal_sifive_uart0_rx_fill(&uart->uart);
+    }
+    if (ip & UART_TXWM) {
+        __metal_sifive_uart0_tx_drain(&uart->uart);
+    }
+    __metal_sifive_uart0_lock_give(mstatus);
+}
+
+int __metal_driver_sifive_uart0_flush(struct metal_uart *guart) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    int empty;
+
+    /* Empty the ring from here rather than waiting for the interrupt, which
+     * may be delivered to a hart that isn't taking it right now */
+    do {
+        uintptr_t mstatus = __metal_sifive_uart0_lock_take();
+
+        __metal_sifive_uart0_tx_drain(guart);
+        empty = (uart->tx_tail == uart->tx_head);
+        __metal_sifive_uart0_lock_give(mstatus);
+    } while (!empty);
+    return 0;
+}
+
+int __metal_driver_sifive_uart0_write(struct metal_uart *guart, const char *buf,
+                                      size_t len) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    long control_base = __metal_driver_sifive_uart0_control_base(guart);
+
+    while (len > 0) {
+        uintptr_t mstatus = __metal_sifive_uart0_lock_take();
+        unsigned int head = uart->tx_head;
+
+        /* If nothing is queued, skip the ring for as many characters as
+         * the hardware FIFO will take right now */
+        if (head == uart->tx_tail) {
+            while (len > 0 &&
+                   !(UART_REGW(METAL_SIFIVE_UART0_TXDATA) & UART_TXFULL)) {
+                UART_REGW(METAL_SIFIVE_UART0_TXDATA) = (unsigned char)*buf++;
+                len--;
+            }
+        }
+
+        size_t space = METAL_SIFIVE_UART0_TX_RING_SIZE - (head - uart->tx_tail);
+        size_t count = __METAL_MIN(space, len);
+        for (size_t i = 0; i < count; i++) {
+            uart->tx_ring[(head + i) & UART_TX_RING_MASK] = buf[i];
+        }
+        uart->tx_head = head + count;
+        buf += count;
+        len -= count;
+
+        /* Once the ring is full, this keeps making room for the rest by
+         * feeding the FIFO from here */
+        __metal_sifive_uart0_tx_drain(guart);
+        __metal_sifive_uart0_lock_give(mstatus);
+    }
+
+    /* Without the interrupt nothing else empties the ring */
+    if (!uart->buffered) {
+        __metal_driver_sifive_uart0_flush(guart);
+    }
     return 0;
 }
 
+int __metal_driver_sifive_uart0_putc(struct metal_uart *uart, int c) {
+    char ch = c;
+
+    return __metal_driver_sifive_uart0_write(uart, &ch, 1);
+}
+
+int __metal_driver_sifive_uart0_read(struct metal_uart *guart, char *buf,
+                                     size_t len) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    uintptr_t mstatus = __metal_sifive_uart0_lock_take();
+    unsigned int tail = uart->rx_tail;
+    size_t count = 0;
+
+    /* Pick up whatever the RXWM interrupt hasn't moved into the ring yet */
+    __metal_sifive_uart0_rx_fill(guart);
+    while ((count < len) && (tail != uart->rx_head)) {
+        buf[count++] = uart->rx_ring[tail & UART_RX_RING_MASK];
+        tail++;
+    }
+    uart->rx_tail = tail;
+    __metal_sifive_uart0_lock_give(mstatus);
+    return count;
+}
+
 int __metal_driver_sifive_uart0_getc(struct metal_uart *uart, int *c) {
-    uint32_t ch;
-    long control_base = __metal_driver_sifive_uart0_control_base(uart);
-    /* No seperate status register, we get status and the byte at same time */
-    ch = UART_REGW(METAL_SIFIVE_UART0_RXDATA);
-    ;
-    if (ch & UART_RXEMPTY) {
-        *c = -1; /* aka: EOF in most of the world */
+    char ch;
+
+    if (__metal_driver_sifive_uart0_read(uart, &ch, 1) == 1) {
+        *c = (unsigned char)ch;
     } else {
-        *c = ch & 0x0ff;
+        *c = -1; /* aka: EOF in most of the world */
     }
     return 0;
 }
@@ -154,8 +330,10 @@ static void pre_rate_change_callback_func(void *priv) {
     struct __metal_driver_sifive_uart0 *uart = priv;
     long control_base =
         __metal_driver_sifive_uart0_control_base((struct metal_uart *)priv);
-    struct metal_clock *clock =
-        __metal_driver_sifive_uart0_clock((struct metal_uart *)priv);
+
+    /* Keep the TXWM interrupt from refilling the FIFO while the baud rate
+     * divider is out of date */
+    UART_REGW(METAL_SIFIVE_UART0_IE) &= ~UART_TXWM;
 
     /* Detect when the TXDATA is empty by setting the transmit watermark count
      * to one and waiting until an interrupt is pending */
@@ -172,16 +350,22 @@ static void pre_rate_change_callback_func(void *priv) {
 
     long bits_per_symbol =
         (UART_REGW(METAL_SIFIVE_UART0_TXCTRL) & (1 << 1)) ? 9 : 10;
-    long clk_freq = clock->vtable->get_rate_hz(clock);
-    long cycles_to_wait = bits_per_symbol * clk_freq / uart->baud_rate;
 
-    for (volatile long x = 0; x < cycles_to_wait; x++)
-        __asm__("nop");
+    metal_delay_ns(bits_per_symbol * 1000000000ULL / uart->baud_rate);
 }
 
 static void post_rate_change_callback_func(void *priv) {
     struct __metal_driver_sifive_uart0 *uart = priv;
+    long control_base =
+        __metal_driver_sifive_uart0_control_base((struct metal_uart *)priv);
+
     metal_uart_set_baud_rate(&uart->uart, uart->baud_rate);
+
+    __metal_driver_sifive_uart0_set_tx_watermark(&uart->uart,
+                                                 UART_TX_WATERMARK);
+    if (uart->buffered && (uart->tx_tail != uart->tx_head)) {
+        UART_REGW(METAL_SIFIVE_UART0_IE) |= UART_TXWM;
+    }
 }
 
 void __metal_driver_sifive_uart0_init(struct metal_uart *guart, int baud_rate) {
@@ -190,6 +374,13 @@ void __metal_driver_sifive_uart0_init(struct metal_uart *guart, int baud_rate) {
     struct __metal_driver_sifive_gpio0 *pinmux =
         __metal_driver_sifive_uart0_pinmux(guart);
 
+    if (!__metal_sifive_uart0_lock_done) {
+#ifdef __riscv_atomic
+        metal_lock_init(&__metal_sifive_uart0_lock);
+#endif
+        __metal_sifive_uart0_lock_done = 1;
+    }
+
     if (clock != NULL) {
         uart->pre_rate_change_callback.callback =
             &pre_rate_change_callback_func;
@@ -206,6 +397,14 @@ void __metal_driver_sifive_uart0_init(struct metal_uart *guart, int baud_rate) {
 
     metal_uart_set_baud_rate(&(uart->uart), baud_rate);
 
+    uart->buffered = 0;
+    uart->tx_head = 0;
+    uart->tx_tail = 0;
+    uart->rx_head = 0;
+    uart->rx_tail = 0;
+    __metal_driver_sifive_uart0_set_tx_watermark(guart, UART_TX_WATERMARK);
+    __metal_driver_sifive_uart0_set_rx_watermark(guart, UART_RX_WATERMARK);
+
     if (pinmux != NULL) {
         long pinmux_output_selector =
             __metal_driver_sifive_uart0_pinmux_output_selector(guart);
@@ -217,6 +416,44 @@ void __metal_driver_sifive_uart0_init(struct metal_uart *guart, int baud_rate) {
     }
 }
 
+int sifive_uart0_set_buffered(struct metal_uart *guart, int enable) {
+    struct __metal_driver_sifive_uart0 *uart = (void *)guart;
+    long control_base = __metal_driver_sifive_uart0_control_base(guart);
+    struct metal_interrupt *intc =
+        __metal_driver_sifive_uart0_interrupt_parent(guart);
+    int id = __metal_driver_sifive_uart0_interrupt_line(guart);
+    uintptr_t mstatus;
+
+    if (intc == NULL) {
+        return -1;
+    }
+
+    if (enable) {
+        metal_interrupt_init(intc);
+        if ((metal_interrupt_register_handler(
+                 intc, id, __metal_driver_sifive_uart0_handler, uart) != 0) ||
+            (metal_interrupt_enable(intc, id) != 0)) {
+            return -1;
+        }
+    }
+
+    mstatus = __metal_sifive_uart0_lock_take();
+    uart->buffered = !!enable;
+    if (enable) {
+        UART_REGW(METAL_SIFIVE_UART0_IE) |= UART_RXWM;
+        __metal_sifive_uart0_tx_drain(guart);
+    } else {
+        UART_REGW(METAL_SIFIVE_UART0_IE) &= ~(UART_TXWM | UART_RXWM);
+    }
+    __metal_sifive_uart0_lock_give(mstatus);
+
+    if (!enable) {
+        metal_interrupt_disable(intc, id);
+        __metal_driver_sifive_uart0_flush(guart);
+    }
+    return 0;
+}
+
 __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_uart0) = {
     .uart.init = __metal_driver_sifive_uart0_init,
     .uart.putc = __metal_driver_sifive_uart0_putc,
@@ -237,6 +474,9 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_sifive_uart0) = {
     .uart.get_tx_watermark = __metal_driver_sifive_uart0_get_tx_watermark,
     .uart.set_rx_watermark = __metal_driver_sifive_uart0_set_rx_watermark,
     .uart.get_rx_watermark = __metal_driver_sifive_uart0_get_rx_watermark,
+    .uart.write = __metal_driver_sifive_uart0_write,
+    .uart.flush = __metal_driver_sifive_uart0_flush,
+    .uart.read = __metal_driver_sifive_uart0_read,
 };
 
 #endif /* METAL_SIFIVE_UART0 */
@@ -5,13 +5,34 @@
 
 #ifdef METAL_UCB_HTIF0
 
+#include <fcntl.h>
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/drivers/ucb_htif0.h>
 #include <metal/io.h>
+#include <metal/lock.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #define FINISHER_OFFSET 0
 
+/* System calls understood by the host, numbered as on RISC-V Linux */
+#define HTIF_SYS_OPENAT 56
+#define HTIF_SYS_CLOSE 57
+#define HTIF_SYS_READ 63
+#define HTIF_SYS_WRITE 64
+#define HTIF_SYS_EXIT 93
+
+#define HTIF_AT_FDCWD -100
+
+/* open() flags as the host expects them */
+#define HTIF_O_CREAT 0x040
+#define HTIF_O_EXCL 0x080
+#define HTIF_O_TRUNC 0x200
+#define HTIF_O_APPEND 0x400
+
+#define HTIF_STDOUT 1
+
 volatile uint64_t fromhost __attribute__((aligned(4096)));
 volatile uint64_t tohost __attribute__((aligned(4096)));
 
@@ -58,33 +79,152 @@ static void do_tohost_fromhost(uintptr_t dev, uintptr_t cmd, uintptr_t data) {
     }
 }
 
-void __metal_driver_ucb_htif0_init(struct metal_uart *uart, int baud_rate) {}
-
-void __metal_driver_ucb_htif0_exit(const struct __metal_shutdown *sd,
-                                   int code) {
+/* Have the host run a system call, as riscv-pk does. The host writes the
+ * result, or a negative errno, back over the first argument. */
+static long __htif_syscall(long n, long a0, long a1, long a2, long a3,
+                           long a4) {
     volatile uint64_t magic_mem[8];
-    magic_mem[0] = 93; // SYS_exit
-    magic_mem[1] = code;
-    magic_mem[2] = 0;
-    magic_mem[3] = 0;
+    magic_mem[0] = n;
+    magic_mem[1] = a0;
+    magic_mem[2] = a1;
+    magic_mem[3] = a2;
+    magic_mem[4] = a3;
+    magic_mem[5] = a4;
 
     do_tohost_fromhost(0, 0, (uintptr_t)magic_mem);
 
+    return (long)magic_mem[0];
+}
+
+/* Each round trip to the host is expensive, so console output written a
+ * character at a time is collected here and written with one system call */
+static char __htif_console_buf[METAL_UCB_HTIF0_BUFFER_SIZE];
+static size_t __htif_console_len;
+
+/* Serializes the console buffer, and the writes which keep the host's stdout
+ * in order with it, between harts and their interrupt handlers */
+METAL_LOCK_DECLARE(__htif_console_lock);
+static int __htif_console_lock_done;
+
+static uintptr_t __htif_console_lock_take(void) {
+    /* Handlers may print too, so they mustn't interrupt the holder */
+    uintptr_t mstatus = __metal_interrupt_global_save();
+#ifdef __riscv_atomic
+    metal_lock_take(&__htif_console_lock);
+#endif
+    return mstatus;
+}
+
+static void __htif_console_lock_give(uintptr_t mstatus) {
+#ifdef __riscv_atomic
+    metal_lock_give(&__htif_console_lock);
+#endif
+    __metal_interrupt_global_restore(mstatus);
+}
+
+/* Called with the lock held */
+static long __htif_console_drain(void) {
+    long rc = 0;
+
+    if (__htif_console_len > 0) {
+        rc = __htif_syscall(HTIF_SYS_WRITE, HTIF_STDOUT,
+                            (uintptr_t)__htif_console_buf, __htif_console_len,
+                            0, 0);
+        __htif_console_len = 0;
+    }
+    return rc;
+}
+
+int ucb_htif0_open(const char *name, int flags, int mode) {
+    int host_flags = flags & O_ACCMODE;
+
+    if (flags & O_CREAT)
+        host_flags |= HTIF_O_CREAT;
+    if (flags & O_EXCL)
+        host_flags |= HTIF_O_EXCL;
+    if (flags & O_TRUNC)
+        host_flags |= HTIF_O_TRUNC;
+    if (flags & O_APPEND)
+        host_flags |= HTIF_O_APPEND;
+
+    return __htif_syscall(HTIF_SYS_OPENAT, HTIF_AT_FDCWD, (uintptr_t)name,
+                          strlen(name) + 1, host_flags, mode);
+}
+
+int ucb_htif0_close(int fd) {
+    return __htif_syscall(HTIF_SYS_CLOSE, fd, 0, 0, 0, 0);
+}
+
+long ucb_htif0_read(int fd, void *buf, size_t len) {
+    return __htif_syscall(HTIF_SYS_READ, fd, (uintptr_t)buf, len, 0, 0);
+}
+
+long ucb_htif0_write(int fd, const void *buf, size_t len) {
+    uintptr_t mstatus;
+    long rc;
+
+    if (fd != HTIF_STDOUT) {
+        return __htif_syscall(HTIF_SYS_WRITE, fd, (uintptr_t)buf, len, 0, 0);
+    }
+
+    /* Keep the host's stdout in order */
+    mstatus = __htif_console_lock_take();
+    __htif_console_drain();
+    rc = __htif_syscall(HTIF_SYS_WRITE, fd, (uintptr_t)buf, len, 0, 0);
+    __htif_console_lock_give(mstatus);
+    return rc;
+}
+
+void __metal_driver_ucb_htif0_init(struct metal_uart *uart, int baud_rate) {
+    if (!__htif_console_lock_done) {
+#ifdef __riscv_atomic
+        metal_lock_init(&__htif_console_lock);
+#endif
+        __htif_console_lock_done = 1;
+    }
+}
+
+void __metal_driver_ucb_htif0_exit(const struct __metal_shutdown *sd,
+                                   int code) {
+    /* The lock is never given back, so nothing is printed after the exit */
+    __htif_console_lock_take();
+    __htif_console_drain();
+    __htif_syscall(HTIF_SYS_EXIT, code, 0, 0, 0, 0);
+
     while (1) {
         // loop forever
     }
 }
 
 int __metal_driver_ucb_htif0_putc(struct metal_uart *htif, int c) {
-    volatile uint64_t magic_mem[8];
-    magic_mem[0] = 64; // SYS_write
-    magic_mem[1] = 1;
-    magic_mem[2] = (uintptr_t)&c;
-    magic_mem[3] = 1;
+    uintptr_t mstatus = __htif_console_lock_take();
+    int rc = 0;
 
-    do_tohost_fromhost(0, 0, (uintptr_t)magic_mem);
+    __htif_console_buf[__htif_console_len++] = c;
 
-    return 0;
+    if (((char)c == '\n') ||
+        (__htif_console_len >= METAL_UCB_HTIF0_BUFFER_SIZE)) {
+        rc = (__htif_console_drain() < 0) ? -1 : 0;
+    }
+
+    __htif_console_lock_give(mstatus);
+    return rc;
+}
+
+int __metal_driver_ucb_htif0_write(struct metal_uart *htif, const char *buf,
+                                   size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    return (ucb_htif0_write(HTIF_STDOUT, buf, len) < 0) ? -1 : 0;
+}
+
+int __metal_driver_ucb_htif0_flush(struct metal_uart *htif) {
+    uintptr_t mstatus = __htif_console_lock_take();
+    long rc = __htif_console_drain();
+
+    __htif_console_lock_give(mstatus);
+    return (rc < 0) ? -1 : 0;
 }
 
 int __metal_driver_ucb_htif0_getc(struct metal_uart *htif, int *c) {
@@ -116,6 +256,8 @@ __METAL_DEFINE_VTABLE(__metal_driver_vtable_ucb_htif0_shutdown) = {
 __METAL_DEFINE_VTABLE(__metal_driver_vtable_ucb_htif0_uart) = {
     .uart.init = __metal_driver_ucb_htif0_init,
     .uart.putc = __metal_driver_ucb_htif0_putc,
+    .uart.write = __metal_driver_ucb_htif0_write,
+    .uart.flush = __metal_driver_ucb_htif0_flush,
     .uart.getc = __metal_driver_ucb_htif0_getc,
     .uart.get_baud_rate = __metal_driver_ucb_htif0_get_baud_rate,
     .uart.set_baud_rate = __metal_driver_ucb_htif0_set_baud_rate,
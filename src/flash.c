@@ -0,0 +1,428 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#include <metal/compiler.h>
+#include <metal/flash.h>
+#include <metal/time.h>
+
+/* Commands */
+#define FLASH_CMD_WRSR 0x01
+#define FLASH_CMD_PP 0x02
+#define FLASH_CMD_WRDI 0x04
+#define FLASH_CMD_RDSR 0x05
+#define FLASH_CMD_WREN 0x06
+#define FLASH_CMD_FAST_READ 0x0B
+#define FLASH_CMD_ERASE_4K 0x20
+#define FLASH_CMD_WRSR2 0x31
+#define FLASH_CMD_RDSR2 0x35
+#define FLASH_CMD_WRSR2_BIT7 0x3E
+#define FLASH_CMD_RDSR2_BIT7 0x3F
+#define FLASH_CMD_SFDP 0x5A
+#define FLASH_CMD_JEDEC_ID 0x9F
+#define FLASH_CMD_EN4B 0xB7
+#define FLASH_CMD_ERASE_64K 0xD8
+
+#define FLASH_SR_WIP 0x01
+
+#define FLASH_SIZE_4K 0x1000
+#define FLASH_SIZE_64K 0x10000
+#define FLASH_SIZE_16M 0x1000000
+
+#define FLASH_MAX_ADDR_LEN 4
+#define FLASH_MAX_DUMMY_LEN 8
+
+/* SFDP Basic Flash Parameter Table fields, by 32-bit word */
+#define SFDP_BFPT_WORDS 16
+#define SFDP_BFPT_ERASE_4K(dw) (((dw)[0] & 3) == 1)
+#define SFDP_BFPT_ERASE_4K_OPCODE(dw) (((dw)[0] >> 8) & 0xFF)
+#define SFDP_BFPT_READ_112(dw) ((dw)[0] & (1 << 16))
+#define SFDP_BFPT_ADDR_BYTES(dw) (((dw)[0] >> 17) & 3)
+#define SFDP_BFPT_READ_122(dw) ((dw)[0] & (1 << 20))
+#define SFDP_BFPT_READ_144(dw) ((dw)[0] & (1 << 21))
+#define SFDP_BFPT_READ_114(dw) ((dw)[0] & (1 << 22))
+#define SFDP_BFPT_DENSITY(dw) ((dw)[1])
+#define SFDP_BFPT_QER(dw) (((dw)[14] >> 20) & 7)
+#define SFDP_BFPT_PAGE_SIZE(dw) (1UL << (((dw)[10] >> 4) & 0xF))
+
+#define SFDP_ADDR_BYTES_3_OR_4 1
+#define SFDP_ADDR_BYTES_4 2
+
+/* Each fast read command is described by a 16-bit field holding the number
+ * of dummy clocks, the number of mode clocks and the opcode */
+#define SFDP_READ_DUMMY(field) ((field)&0x1F)
+#define SFDP_READ_MODE(field) (((field) >> 5) & 7)
+#define SFDP_READ_OPCODE(field) (((field) >> 8) & 0xFF)
+
+static unsigned int flash_lanes(unsigned int protocol) {
+    switch (protocol) {
+    case METAL_SPI_DUAL:
+        return 2;
+    case METAL_SPI_QUAD:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+/* Send a command with an address and dummy bytes, then transfer len bytes of
+ * data */
+static int flash_addr_command(struct metal_flash *flash, uint8_t opcode,
+                              size_t addr, unsigned int addr_len,
+                              unsigned int dummy_len, unsigned int addr_proto,
+                              unsigned int data_proto, char *tx_buf,
+                              char *rx_buf, size_t len) {
+    char cmd = (char)opcode;
+    char header[FLASH_MAX_ADDR_LEN + FLASH_MAX_DUMMY_LEN] = {0};
+    struct metal_spi_segment segments[3] = {
+        {&cmd, NULL, 1, METAL_SPI_SINGLE},
+        {header, NULL, addr_len + dummy_len, addr_proto},
+        {tx_buf, rx_buf, len, data_proto},
+    };
+
+    /* The address is sent most significant byte first */
+    for (unsigned int i = 0; i < addr_len; i++) {
+        header[i] = (char)((addr >> (8 * (addr_len - 1 - i))) & 0xFF);
+    }
+
+    return metal_spi_transaction(flash->spi, &flash->config, segments, 3);
+}
+
+static int flash_command(struct metal_flash *flash, uint8_t opcode,
+                         char *tx_buf, char *rx_buf, size_t len) {
+    return flash_addr_command(flash, opcode, 0, 0, 0, METAL_SPI_SINGLE,
+                              METAL_SPI_SINGLE, tx_buf, rx_buf, len);
+}
+
+static int flash_wait(struct metal_flash *flash) {
+    struct metal_deadline deadline;
+    char sr;
+
+    metal_deadline_start(&deadline, METAL_FLASH_TIMEOUT_US);
+
+    do {
+        if (flash_command(flash, FLASH_CMD_RDSR, NULL, &sr, 1) != 0) {
+            return -1;
+        }
+        if (!(sr & FLASH_SR_WIP)) {
+            return 0;
+        }
+    } while (!metal_deadline_expired(&deadline));
+
+    return -1;
+}
+
+/* Write enable, then send a command which sets the part busy */
+static int flash_write_command(struct metal_flash *flash, uint8_t opcode,
+                               size_t addr, unsigned int addr_len,
+                               char *tx_buf, size_t len) {
+    if ((flash_command(flash, FLASH_CMD_WREN, NULL, NULL, 0) != 0) ||
+        (flash_addr_command(flash, opcode, addr, addr_len, 0, METAL_SPI_SINGLE,
+                            METAL_SPI_SINGLE, tx_buf, NULL, len) != 0)) {
+        return -1;
+    }
+    return flash_wait(flash);
+}
+
+/* Set the Quad Enable bit, in whichever register the Quad Enable
+ * Requirements field of the SFDP table says it is */
+static int flash_quad_enable(struct metal_flash *flash, unsigned int qer) {
+    char sr[2];
+
+    switch (qer) {
+    case 0:
+        /* No Quad Enable bit */
+        return 0;
+    case 1:
+        /* Bit 1 of status register 2, which can't be read back */
+        if (flash_command(flash, FLASH_CMD_RDSR, NULL, &sr[0], 1) != 0) {
+            return -1;
+        }
+        sr[1] = 0x02;
+        return flash_write_command(flash, FLASH_CMD_WRSR, 0, 0, sr, 2);
+    case 2:
+        /* Bit 6 of status register 1 */
+        if (flash_command(flash, FLASH_CMD_RDSR, NULL, &sr[0], 1) != 0) {
+            return -1;
+        }
+        if (sr[0] & 0x40) {
+            return 0;
+        }
+        sr[0] |= 0x40;
+        return flash_write_command(flash, FLASH_CMD_WRSR, 0, 0, sr, 1);
+    case 3:
+        /* Bit 7 of status register 2, with its own commands */
+        if (flash_command(flash, FLASH_CMD_RDSR2_BIT7, NULL, &sr[0], 1) != 0) {
+            return -1;
+        }
+        if (sr[0] & 0x80) {
+            return 0;
+        }
+        sr[0] |= 0x80;
+        return flash_write_command(flash, FLASH_CMD_WRSR2_BIT7, 0, 0, sr, 1);
+    case 4:
+    case 5:
+        /* Bit 1 of status register 2, written along with register 1 */
+        if ((flash_command(flash, FLASH_CMD_RDSR, NULL, &sr[0], 1) != 0) ||
+            (flash_command(flash, FLASH_CMD_RDSR2, NULL, &sr[1], 1) != 0)) {
+            return -1;
+        }
+        if (sr[1] & 0x02) {
+            return 0;
+        }
+        sr[1] |= 0x02;
+        return flash_write_command(flash, FLASH_CMD_WRSR, 0, 0, sr, 2);
+    case 6:
+        /* Bit 1 of status register 2, written on its own */
+        if (flash_command(flash, FLASH_CMD_RDSR2, NULL, &sr[0], 1) != 0) {
+            return -1;
+        }
+        if (sr[0] & 0x02) {
+            return 0;
+        }
+        sr[0] |= 0x02;
+        return flash_write_command(flash, FLASH_CMD_WRSR2, 0, 0, sr, 1);
+    default:
+        return -1;
+    }
+}
+
+/* Use a fast read command if the controller can send its dummy and mode
+ * clocks as whole frames */
+static int flash_set_read(struct metal_flash *flash, uint32_t field,
+                          unsigned int addr_proto, unsigned int data_proto) {
+    unsigned int clocks = SFDP_READ_DUMMY(field) + SFDP_READ_MODE(field);
+    unsigned int bits = clocks * flash_lanes(addr_proto);
+
+    if ((SFDP_READ_OPCODE(field) == 0) || ((bits % 8) != 0) ||
+        ((bits / 8) > FLASH_MAX_DUMMY_LEN)) {
+        return -1;
+    }
+
+    flash->read.opcode = SFDP_READ_OPCODE(field);
+    flash->read.addr_proto = addr_proto;
+    flash->read.data_proto = data_proto;
+    flash->read.dummy_len = bits / 8;
+    return 0;
+}
+
+static int flash_sfdp_read(struct metal_flash *flash, size_t addr,
+                           uint8_t *buf, size_t len) {
+    /* SFDP is always read with a 3 byte address and 8 dummy clocks */
+    return flash_addr_command(flash, FLASH_CMD_SFDP, addr, 3, 1,
+                              METAL_SPI_SINGLE, METAL_SPI_SINGLE, NULL,
+                              (char *)buf, len);
+}
+
+static void flash_sfdp_probe(struct metal_flash *flash) {
+    uint8_t header[16];
+    uint8_t table[SFDP_BFPT_WORDS * 4];
+    uint32_t dw[SFDP_BFPT_WORDS] = {0};
+    unsigned int words;
+    size_t ptp;
+    int quad = 0;
+
+    if ((flash_sfdp_read(flash, 0, header, sizeof(header)) != 0) ||
+        (header[0] != 'S') || (header[1] != 'F') || (header[2] != 'D') ||
+        (header[3] != 'P')) {
+        return;
+    }
+
+    /* The first parameter header is always the Basic Flash Parameter Table */
+    if ((header[8] != 0x00) || (header[15] != 0xFF)) {
+        return;
+    }
+    words = __METAL_MIN(header[11], SFDP_BFPT_WORDS);
+    ptp = header[12] | (header[13] << 8) | ((size_t)header[14] << 16);
+    if ((words < 9) || (flash_sfdp_read(flash, ptp, table, words * 4) != 0)) {
+        return;
+    }
+    for (unsigned int i = 0; i < words; i++) {
+        dw[i] = table[i * 4] | (table[(i * 4) + 1] << 8) |
+                ((uint32_t)table[(i * 4) + 2] << 16) |
+                ((uint32_t)table[(i * 4) + 3] << 24);
+    }
+
+    /* Density is in bits */
+    if (SFDP_BFPT_DENSITY(dw) & 0x80000000UL) {
+        uint32_t n = SFDP_BFPT_DENSITY(dw) & 0x7FFFFFFFUL;
+        if ((n > 3) && ((n - 3) < (8 * sizeof(size_t)))) {
+            flash->size = (size_t)1 << (n - 3);
+        }
+    } else {
+        flash->size = (SFDP_BFPT_DENSITY(dw) / 8) + 1;
+    }
+
+    if (SFDP_BFPT_ADDR_BYTES(dw) == SFDP_ADDR_BYTES_4) {
+        flash->addr_len = 4;
+    } else if ((SFDP_BFPT_ADDR_BYTES(dw) == SFDP_ADDR_BYTES_3_OR_4) &&
+               (flash->size > FLASH_SIZE_16M)) {
+        flash_command(flash, FLASH_CMD_WREN, NULL, NULL, 0);
+        flash_command(flash, FLASH_CMD_EN4B, NULL, NULL, 0);
+        flash_command(flash, FLASH_CMD_WRDI, NULL, NULL, 0);
+        flash->addr_len = 4;
+    }
+
+    /* Erase types, each a size as a power of two and an opcode */
+    flash->erase_4k_opcode = 0;
+    flash->erase_64k_opcode = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        uint32_t type = dw[7 + (i / 2)] >> (16 * (i % 2));
+
+        if ((type & 0xFF) == 12) {
+            flash->erase_4k_opcode = (type >> 8) & 0xFF;
+        } else if ((type & 0xFF) == 16) {
+            flash->erase_64k_opcode = (type >> 8) & 0xFF;
+        }
+    }
+    if ((flash->erase_4k_opcode == 0) && SFDP_BFPT_ERASE_4K(dw)) {
+        flash->erase_4k_opcode = SFDP_BFPT_ERASE_4K_OPCODE(dw);
+    }
+
+    if (words >= 11) {
+        flash->page_size = SFDP_BFPT_PAGE_SIZE(dw);
+    }
+
+    /* Quad reads are only used if the table says how to enable them */
+    if ((words >= 15) && (SFDP_BFPT_READ_144(dw) || SFDP_BFPT_READ_114(dw))) {
+        quad = (flash_quad_enable(flash, SFDP_BFPT_QER(dw)) == 0);
+    }
+
+    /* Pick the fastest read command */
+    if (quad && SFDP_BFPT_READ_144(dw) &&
+        (flash_set_read(flash, dw[2] & 0xFFFF, METAL_SPI_QUAD,
+                        METAL_SPI_QUAD) == 0)) {
+        return;
+    }
+    if (quad && SFDP_BFPT_READ_114(dw) &&
+        (flash_set_read(flash, dw[2] >> 16, METAL_SPI_SINGLE,
+                        METAL_SPI_QUAD) == 0)) {
+        return;
+    }
+    if (SFDP_BFPT_READ_122(dw) &&
+        (flash_set_read(flash, dw[3] >> 16, METAL_SPI_DUAL, METAL_SPI_DUAL) ==
+         0)) {
+        return;
+    }
+    if (SFDP_BFPT_READ_112(dw)) {
+        flash_set_read(flash, dw[3] & 0xFFFF, METAL_SPI_SINGLE,
+                       METAL_SPI_DUAL);
+    }
+}
+
+int metal_flash_init(struct metal_flash *flash, struct metal_spi *spi,
+                     unsigned int csid) {
+    char id[3];
+
+    flash->spi = spi;
+    flash->config = (struct metal_spi_config){
+        .protocol = METAL_SPI_SINGLE,
+        .polarity = 0,
+        .phase = 0,
+        .little_endian = 0,
+        .cs_active_high = 0,
+        .csid = csid,
+    };
+
+    if (flash_command(flash, FLASH_CMD_JEDEC_ID, NULL, id, 3) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        flash->jedec_id[i] = (uint8_t)id[i];
+    }
+    if (((flash->jedec_id[0] == 0x00) && (flash->jedec_id[1] == 0x00)) ||
+        ((flash->jedec_id[0] == 0xFF) && (flash->jedec_id[1] == 0xFF))) {
+        return -1;
+    }
+
+    /* Defaults for parts without SFDP, which almost all of them support */
+    flash->size = 0;
+    flash->page_size = 256;
+    flash->addr_len = 3;
+    flash->read.opcode = FLASH_CMD_FAST_READ;
+    flash->read.addr_proto = METAL_SPI_SINGLE;
+    flash->read.data_proto = METAL_SPI_SINGLE;
+    flash->read.dummy_len = 1;
+    flash->erase_4k_opcode = FLASH_CMD_ERASE_4K;
+    flash->erase_64k_opcode = FLASH_CMD_ERASE_64K;
+
+    flash_sfdp_probe(flash);
+
+    return 0;
+}
+
+static int flash_check_range(struct metal_flash *flash, size_t addr,
+                             size_t len) {
+    if ((flash->size != 0) &&
+        ((addr > flash->size) || (len > (flash->size - addr)))) {
+        return -1;
+    }
+    return 0;
+}
+
+int metal_flash_read(struct metal_flash *flash, size_t addr, void *buf,
+                     size_t len) {
+    if (flash_check_range(flash, addr, len) != 0) {
+        return -1;
+    }
+
+    return flash_addr_command(flash, flash->read.opcode, addr, flash->addr_len,
+                              flash->read.dummy_len, flash->read.addr_proto,
+                              flash->read.data_proto, NULL, buf, len);
+}
+
+int metal_flash_program(struct metal_flash *flash, size_t addr,
+                        const void *buf, size_t len) {
+    const char *data = buf;
+
+    if (flash_check_range(flash, addr, len) != 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        /* A program wraps around within its page */
+        size_t count =
+            __METAL_MIN(len, flash->page_size - (addr % flash->page_size));
+
+        if (flash_write_command(flash, FLASH_CMD_PP, addr, flash->addr_len,
+                                (char *)data, count) != 0) {
+            return -1;
+        }
+        addr += count;
+        data += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+int metal_flash_erase(struct metal_flash *flash, size_t addr, size_t len) {
+    size_t min = flash->erase_4k_opcode ? FLASH_SIZE_4K : FLASH_SIZE_64K;
+
+    if ((flash->erase_4k_opcode == 0) && (flash->erase_64k_opcode == 0)) {
+        return -1;
+    }
+    if (((addr % min) != 0) || ((len % min) != 0) ||
+        (flash_check_range(flash, addr, len) != 0)) {
+        return -1;
+    }
+
+    while (len > 0) {
+        uint8_t opcode = flash->erase_4k_opcode;
+        size_t count = FLASH_SIZE_4K;
+
+        if ((flash->erase_64k_opcode != 0) && ((addr % FLASH_SIZE_64K) == 0) &&
+            (len >= FLASH_SIZE_64K)) {
+            opcode = flash->erase_64k_opcode;
+            count = FLASH_SIZE_64K;
+        }
+
+        if (flash_write_command(flash, opcode, addr, flash->addr_len, NULL,
+                                0) != 0) {
+            return -1;
+        }
+        addr += count;
+        len -= count;
+    }
+
+    return 0;
+}
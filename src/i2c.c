@@ -15,6 +15,13 @@ extern inline int metal_i2c_read(struct metal_i2c *i2c, unsigned int addr,
 extern inline int metal_i2c_transfer(struct metal_i2c *i2c, unsigned int addr,
                                      unsigned char txbuf[], unsigned int txlen,
                                      unsigned char rxbuf[], unsigned int rxlen);
+extern inline int metal_i2c_transfer_msgs(struct metal_i2c *i2c,
+                                          struct metal_i2c_msg msgs[],
+                                          unsigned int count);
+extern inline int metal_i2c_async_init(struct metal_i2c *i2c,
+                                       struct metal_interrupt *intc, int id);
+extern inline int metal_i2c_transfer_async(struct metal_i2c *i2c,
+                                           struct metal_i2c_request *request);
 extern inline int metal_i2c_get_baud_rate(struct metal_i2c *i2c);
 extern inline int metal_i2c_set_baud_rate(struct metal_i2c *i2c, int baud_rate);
 
@@ -64,6 +64,9 @@ extern __inline__ unsigned int
 metal_interrupt_get_preemptive_level(struct metal_interrupt *controller,
                                      int id);
 
+extern __inline__ int
+metal_interrupt_set_nesting(struct metal_interrupt *controller, int enable);
+
 extern __inline__ int metal_interrupt_clear(struct metal_interrupt *controller,
                                             int id);
 
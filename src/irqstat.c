@@ -0,0 +1,217 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#include <metal/compiler.h>
+#include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
+#include <metal/irqstat.h>
+#include <metal/machine.h>
+#include <metal/tty.h>
+#include <string.h>
+
+volatile int __metal_irqstat_enabled;
+
+#ifdef METAL_IRQSTAT
+
+/* Each hart only writes its own table, from its interrupt handlers */
+static struct metal_irqstat
+    __metal_irqstat_table[__METAL_DT_MAX_HARTS][METAL_IRQSTAT_CONTROLLERS]
+                         [METAL_IRQSTAT_MAX_ID];
+
+static unsigned long __metal_irqstat_budget;
+static unsigned long __metal_irqstat_window;
+static metal_irqstat_policy_t __metal_irqstat_policy;
+
+static const char *const __metal_irqstat_names[METAL_IRQSTAT_CONTROLLERS] = {
+    "cpu", "plic", "clic"};
+
+/* Whether the line cascades to the PLIC. Masking it would mask every
+ * external interrupt, so it is measured but never throttled, and the budget
+ * applies to the PLIC sources behind it instead. */
+static int __metal_irqstat_cascade(metal_irqstat_controller type, int id) {
+    return ((type == METAL_IRQSTAT_CPU) || (type == METAL_IRQSTAT_CLIC)) &&
+           (id == METAL_INTERRUPT_ID_EXT);
+}
+
+static unsigned int __metal_irqstat_bucket(unsigned long long value) {
+    unsigned int bucket = 0;
+
+    while ((value >>= 1) != 0) {
+        bucket++;
+    }
+    return __METAL_MIN(bucket, METAL_IRQSTAT_BUCKETS - 1);
+}
+
+void __metal_irqstat_record(struct metal_interrupt *controller,
+                            metal_irqstat_controller type, int id,
+                            unsigned long cycles, long long latency) {
+    int hartid = __metal_myhart_id();
+    struct metal_irqstat *stat;
+    unsigned long now;
+
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS) || (id < 0) ||
+        (id >= METAL_IRQSTAT_MAX_ID)) {
+        return;
+    }
+    stat = &__metal_irqstat_table[hartid][type][id];
+
+    stat->count++;
+    stat->cycles += cycles;
+    stat->max_cycles = __METAL_MAX(stat->max_cycles, cycles);
+    stat->cycles_hist[__metal_irqstat_bucket(cycles)]++;
+    if (latency >= 0) {
+        stat->latency_hist[__metal_irqstat_bucket(latency)]++;
+    }
+
+    if ((__metal_irqstat_budget == 0) || __metal_irqstat_cascade(type, id)) {
+        return;
+    }
+
+    now = __metal_irqstat_cycles();
+    if ((now - stat->window_start) > __metal_irqstat_window) {
+        stat->window_start = now;
+        stat->window_count = 0;
+    }
+    if (++stat->window_count <= __metal_irqstat_budget) {
+        return;
+    }
+
+    if ((__metal_irqstat_policy == NULL) ||
+        __metal_irqstat_policy(controller, id, stat)) {
+        metal_interrupt_disable(controller, id);
+        stat->throttled++;
+    }
+    /* Start a new window, so a policy which leaves the interrupt enabled is
+     * asked again once it exceeds the next one */
+    stat->window_start = now;
+    stat->window_count = 0;
+}
+
+void metal_irqstat_enable(int enable) { __metal_irqstat_enabled = enable; }
+
+void metal_irqstat_reset(void) {
+    memset(__metal_irqstat_table, 0, sizeof(__metal_irqstat_table));
+}
+
+int metal_irqstat_get(int hartid, metal_irqstat_controller controller, int id,
+                      struct metal_irqstat *stat) {
+    uintptr_t mstatus;
+
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS) ||
+        (controller < 0) || (controller >= METAL_IRQSTAT_CONTROLLERS) ||
+        (id < 0) || (id >= METAL_IRQSTAT_MAX_ID)) {
+        return -1;
+    }
+
+    /* Copy the statistics of this hart without its handlers updating them
+     * half way through. Those of other harts may be torn. */
+    mstatus = __metal_interrupt_global_save();
+    *stat = __metal_irqstat_table[hartid][controller][id];
+    __metal_interrupt_global_restore(mstatus);
+    return 0;
+}
+
+void metal_irqstat_set_budget(unsigned long count, unsigned long window) {
+    __metal_irqstat_window = window;
+    __metal_irqstat_budget = count;
+}
+
+void metal_irqstat_set_policy(metal_irqstat_policy_t policy) {
+    __metal_irqstat_policy = policy;
+}
+
+static void __metal_irqstat_puts(const char *s) {
+    metal_tty_write(s, strlen(s));
+}
+
+static void __metal_irqstat_putu(unsigned long long value) {
+    char buf[20];
+    int i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    metal_tty_write(&buf[i], sizeof(buf) - i);
+}
+
+static void __metal_irqstat_put_hist(const char *name,
+                                     const unsigned long *hist) {
+    int i = 0;
+
+    while ((i < METAL_IRQSTAT_BUCKETS) && (hist[i] == 0)) {
+        i++;
+    }
+    if (i == METAL_IRQSTAT_BUCKETS) {
+        return;
+    }
+
+    __metal_irqstat_puts(name);
+    for (; i < METAL_IRQSTAT_BUCKETS; i++) {
+        if (hist[i] != 0) {
+            __metal_irqstat_puts(" ");
+            __metal_irqstat_putu(1ULL << i);
+            __metal_irqstat_puts(":");
+            __metal_irqstat_putu(hist[i]);
+        }
+    }
+    __metal_irqstat_puts("\n");
+}
+
+void metal_irqstat_dump(void) {
+    struct metal_irqstat stat;
+
+    for (int hart = 0; hart < __METAL_DT_MAX_HARTS; hart++) {
+        for (int type = 0; type < METAL_IRQSTAT_CONTROLLERS; type++) {
+            for (int id = 0; id < METAL_IRQSTAT_MAX_ID; id++) {
+                metal_irqstat_get(hart, type, id, &stat);
+                if (stat.count == 0) {
+                    continue;
+                }
+
+                __metal_irqstat_puts("hart ");
+                __metal_irqstat_putu(hart);
+                __metal_irqstat_puts(" ");
+                __metal_irqstat_puts(__metal_irqstat_names[type]);
+                __metal_irqstat_puts(" ");
+                __metal_irqstat_putu(id);
+                __metal_irqstat_puts(": count ");
+                __metal_irqstat_putu(stat.count);
+                __metal_irqstat_puts(" cycles ");
+                __metal_irqstat_putu(stat.cycles);
+                __metal_irqstat_puts(" max ");
+                __metal_irqstat_putu(stat.max_cycles);
+                __metal_irqstat_puts(" throttled ");
+                __metal_irqstat_putu(stat.throttled);
+                __metal_irqstat_puts("\n");
+
+                __metal_irqstat_put_hist("  cycles", stat.cycles_hist);
+                __metal_irqstat_put_hist("  latency", stat.latency_hist);
+            }
+        }
+    }
+    metal_tty_flush();
+}
+
+#else
+
+void __metal_irqstat_record(struct metal_interrupt *controller,
+                            metal_irqstat_controller type, int id,
+                            unsigned long cycles, long long latency) {}
+
+void metal_irqstat_enable(int enable) {}
+
+void metal_irqstat_reset(void) {}
+
+int metal_irqstat_get(int hartid, metal_irqstat_controller controller, int id,
+                      struct metal_irqstat *stat) {
+    return -1;
+}
+
+void metal_irqstat_set_budget(unsigned long count, unsigned long window) {}
+
+void metal_irqstat_set_policy(metal_irqstat_policy_t policy) {}
+
+void metal_irqstat_dump(void) {}
+
+#endif
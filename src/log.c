@@ -0,0 +1,198 @@
+/* Copyright 2020 SiFive, Inc */
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
+#include <metal/init.h>
+#include <metal/lock.h>
+#include <metal/log.h>
+#include <metal/machine.h>
+#include <metal/time.h>
+#include <metal/tty.h>
+#include <metal/uart.h>
+
+#define LOG_RING_MASK (METAL_LOG_BUFFER_SIZE - 1)
+#define LOG_HEADER_WORDS 3
+#define LOG_ARG_WORDS (sizeof(uintptr_t) / sizeof(uint32_t))
+
+#if (METAL_LOG_BUFFER_SIZE & LOG_RING_MASK) != 0
+#error "METAL_LOG_BUFFER_SIZE must be a power of two"
+#endif
+
+/* Each hart logs into its own ring, so the only writers a ring can have at
+ * the same time are the hart and its own interrupt handlers. The rings are
+ * emptied by whichever hart calls metal_log_flush(). */
+struct __metal_log_ring {
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    volatile unsigned int dropped;
+    unsigned int reported;
+    uint32_t words[METAL_LOG_BUFFER_SIZE];
+};
+
+static struct __metal_log_ring __metal_log_rings[__METAL_DT_MAX_HARTS];
+static struct metal_uart *__metal_log_device;
+
+METAL_LOCK_DECLARE(__metal_log_lock);
+
+static uint32_t __metal_log_header(unsigned int nargs, int hartid) {
+    return METAL_LOG_SYNC | (nargs << 8) | ((uint32_t)hartid << 16) |
+           (LOG_ARG_WORDS << 24);
+}
+
+static int __metal_log_ring_put(struct __metal_log_ring *ring, uint32_t header,
+                                uint32_t id, uint32_t timestamp,
+                                unsigned int nargs, const uintptr_t *args) {
+    unsigned int len = LOG_HEADER_WORDS + (nargs * LOG_ARG_WORDS);
+    unsigned int head = ring->head;
+
+    if ((METAL_LOG_BUFFER_SIZE - (head - ring->tail)) < len) {
+        return -1;
+    }
+
+    ring->words[head++ & LOG_RING_MASK] = header;
+    ring->words[head++ & LOG_RING_MASK] = id;
+    ring->words[head++ & LOG_RING_MASK] = timestamp;
+    for (unsigned int i = 0; i < nargs; i++) {
+        uintptr_t arg = args[i];
+        for (unsigned int w = 0; w < LOG_ARG_WORDS; w++) {
+            ring->words[head++ & LOG_RING_MASK] = (uint32_t)arg;
+            /* Shifting by the width of uintptr_t is undefined on RV32 */
+            arg >>= 16;
+            arg >>= 16;
+        }
+    }
+
+    /* Publish the record before the new head */
+    __asm__ volatile("fence rw, w" ::: "memory");
+    ring->head = head;
+    return 0;
+}
+
+void __metal_log_emit(const char *fmt, unsigned int nargs,
+                      const uintptr_t *args) {
+    int hartid = metal_cpu_get_current_hartid();
+    struct __metal_log_ring *ring;
+    unsigned long long mtime = 0;
+    uintptr_t mstatus;
+
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS)) {
+        return;
+    }
+    ring = &__metal_log_rings[hartid];
+
+    metal_time_get_mtime(&mtime);
+
+    /* Keep interrupt handlers on this hart which log from seeing a
+     * half-written record */
+    mstatus = __metal_interrupt_global_save();
+
+    if (__metal_log_ring_put(ring, __metal_log_header(nargs, hartid),
+                             (uint32_t)(uintptr_t)fmt, (uint32_t)mtime, nargs,
+                             args) != 0) {
+        ring->dropped++;
+    }
+
+    __metal_interrupt_global_restore(mstatus);
+}
+
+static int __metal_log_write(const uint32_t *words, unsigned int count) {
+    const char *buf = (const char *)words;
+    size_t len = count * sizeof(uint32_t);
+
+    if (__metal_log_device != NULL) {
+        return metal_uart_write(__metal_log_device, buf, len);
+    }
+    /* The records are binary, so newlines in them mustn't commit half a
+     * record to the console */
+    return metal_tty_write_raw(buf, len);
+}
+
+static int __metal_log_ring_drain(struct __metal_log_ring *ring, int hartid) {
+    unsigned int tail = ring->tail;
+    unsigned int head = ring->head;
+    unsigned int dropped;
+    int rc = 0;
+
+    /* Don't read the record before its head */
+    __asm__ volatile("fence r, r" ::: "memory");
+
+    /* Each record is written out in one piece, so that other output can't
+     * land in the middle of it */
+    while ((rc == 0) && (tail != head)) {
+        uint32_t record[LOG_HEADER_WORDS + METAL_LOG_MAX_ARGS * LOG_ARG_WORDS];
+        unsigned int nargs = (ring->words[tail & LOG_RING_MASK] >> 8) & 0xff;
+        unsigned int count =
+            LOG_HEADER_WORDS +
+            (__METAL_MIN(nargs, METAL_LOG_MAX_ARGS) * LOG_ARG_WORDS);
+
+        for (unsigned int i = 0; i < count; i++) {
+            record[i] = ring->words[(tail + i) & LOG_RING_MASK];
+        }
+        rc = __metal_log_write(record, count);
+        tail += count;
+
+        /* Finish reading the record before handing the slots back */
+        __asm__ volatile("fence r, w" ::: "memory");
+        ring->tail = tail;
+    }
+
+    dropped = ring->dropped;
+    if ((rc == 0) && (dropped != ring->reported)) {
+        uint32_t record[LOG_HEADER_WORDS + LOG_ARG_WORDS] = {
+            __metal_log_header(1, hartid), METAL_LOG_ID_DROPPED, 0,
+            dropped - ring->reported};
+
+        rc = __metal_log_write(record, LOG_HEADER_WORDS + LOG_ARG_WORDS);
+        ring->reported = dropped;
+    }
+    return rc;
+}
+
+void metal_log_set_device(struct metal_uart *uart) {
+    __metal_log_device = uart;
+}
+
+int metal_log_flush(void) {
+    int rc = 0;
+
+    /* metal_lock traps on harts without atomics, which leaves nothing to
+     * protect against */
+#ifdef __riscv_atomic
+    metal_lock_take(&__metal_log_lock);
+#endif
+    for (int i = 0; i < __METAL_DT_MAX_HARTS; i++) {
+        if (__metal_log_ring_drain(&__metal_log_rings[i], i) != 0) {
+            rc = -1;
+        }
+    }
+#ifdef __riscv_atomic
+    metal_lock_give(&__metal_log_lock);
+#endif
+
+    if (__metal_log_device != NULL) {
+        if (metal_uart_flush(__metal_log_device) != 0) {
+            rc = -1;
+        }
+    } else if (metal_tty_flush() != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+unsigned int metal_log_dropped(void) {
+    unsigned int dropped = 0;
+
+    for (int i = 0; i < __METAL_DT_MAX_HARTS; i++) {
+        dropped += __metal_log_rings[i].dropped;
+    }
+    return dropped;
+}
+
+METAL_CONSTRUCTOR(metal_log_init) {
+#ifdef __riscv_atomic
+    metal_lock_init(&__metal_log_lock);
+#endif
+}
+
+METAL_DESTRUCTOR(metal_log_fini) { metal_log_flush(); }
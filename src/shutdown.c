@@ -1,20 +1,36 @@
 /* Copyright 2018 SiFive, Inc */
 /* SPDX-License-Identifier: Apache-2.0 */
 
+#include <metal/log.h>
 #include <metal/machine.h>
 #include <metal/shutdown.h>
+#include <metal/tty.h>
+
+/* Only flush logged messages if the application uses METAL_LOG(), without
+ * pulling the log buffers into every program */
+int metal_log_flush(void) __attribute__((weak));
+
+static void __metal_shutdown_flush(void) {
+    if (metal_log_flush) {
+        metal_log_flush();
+    }
+    metal_tty_flush();
+}
 
 extern __inline__ void __metal_shutdown_exit(const struct __metal_shutdown *sd,
                                              int code);
 
 #if defined(__METAL_DT_SHUTDOWN_HANDLE)
 void metal_shutdown(int code) {
+    /* Don't lose buffered output, stdio is flushed after metal_fini() */
+    __metal_shutdown_flush();
     __metal_shutdown_exit(__METAL_DT_SHUTDOWN_HANDLE, code);
 }
 #else
 #pragma message(                                                               \
     "There is no defined shutdown mechanism, metal_shutdown() will spin.")
 void metal_shutdown(int code) {
+    __metal_shutdown_flush();
     while (1) {
         __asm__ volatile("nop");
     }
@@ -9,6 +9,22 @@ extern __inline__ int metal_spi_transfer(struct metal_spi *spi,
                                          struct metal_spi_config *config,
                                          size_t len, char *tx_buf,
                                          char *rx_buf);
+extern __inline__ int metal_spi_transaction(struct metal_spi *spi,
+                                            struct metal_spi_config *config,
+                                            struct metal_spi_segment *segments,
+                                            unsigned int count);
+extern __inline__ int metal_spi_prepare(struct metal_spi *spi,
+                                        struct metal_spi_config *config);
+extern __inline__ int metal_spi_transfer_prepared(struct metal_spi *spi,
+                                                  int handle, size_t len,
+                                                  char *tx_buf, char *rx_buf);
+extern __inline__ void metal_spi_unprepare(struct metal_spi *spi, int handle);
+extern __inline__ int metal_spi_async_init(struct metal_spi *spi,
+                                           struct metal_interrupt *intc,
+                                           int id);
+extern __inline__ int
+metal_spi_transfer_async(struct metal_spi *spi,
+                         struct metal_spi_request *request);
 extern __inline__ int metal_spi_get_baud_rate(struct metal_spi *spi);
 extern __inline__ int metal_spi_set_baud_rate(struct metal_spi *spi,
                                               int baud_rate);
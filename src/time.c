@@ -1,24 +1,294 @@
 /* Copyright 2019 SiFive, Inc */
 /* SPDX-License-Identifier: Apache-2.0 */
 
+#include <metal/clock.h>
+#include <metal/compiler.h>
+#include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
+#include <metal/init.h>
+#include <metal/machine.h>
+#include <metal/rtc.h>
 #include <metal/time.h>
 #include <metal/timer.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
-int metal_gettimeofday(struct timeval *tp, void *tzp) {
-    int rv;
-    unsigned long long mcc, timebase;
-    rv = metal_timer_get_cyclecount(0, &mcc);
-    if (rv != 0) {
+extern __inline__ void metal_deadline_start(struct metal_deadline *deadline,
+                                            unsigned int timeout);
+
+/* A counter and the multipliers and shifts which convert between its counts
+ * and nanoseconds, computed whenever its rate is set so that neither
+ * direction needs a division */
+struct __metal_clocksource {
+    unsigned long long rate;
+    uint32_t mult;
+    unsigned int shift;
+    uint32_t inv_mult;
+    unsigned int inv_shift;
+};
+
+static struct __metal_clocksource __metal_time_mtime;
+static struct __metal_clocksource __metal_time_cycles;
+static struct __metal_clocksource __metal_time_rtc;
+
+static struct metal_interrupt *__metal_time_mtime_timer;
+static struct metal_clock *__metal_time_clock;
+static metal_clock_callback __metal_time_pre_rate_change_callback;
+static metal_clock_callback __metal_time_post_rate_change_callback;
+static unsigned long long __metal_time_saved_realtime;
+static unsigned long long __metal_time_saved_mtime;
+static int __metal_time_saved_realtime_valid;
+static int __metal_time_saved_mtime_valid;
+static struct metal_rtc *__metal_time_rtc_device;
+static int __metal_time_rtc_probed;
+static long long __metal_time_realtime_offset;
+
+/* The most precise multiplier that fits in 32 bits for scaling by to / from,
+ * with round added before dividing. Capping the shift at 32 lets the
+ * conversion split the value into halves. */
+static uint32_t __metal_clocksource_mult(unsigned long long to,
+                                         unsigned long long from,
+                                         unsigned long long round,
+                                         unsigned int *shift) {
+    unsigned long long mult = 0;
+
+    for (*shift = 32; (from != 0) && (*shift > 0); (*shift)--) {
+        if ((to > (UINT64_MAX >> *shift)) ||
+            ((to << *shift) > (UINT64_MAX - round))) {
+            continue;
+        }
+        mult = ((to << *shift) + round) / from;
+        if (mult <= UINT32_MAX) {
+            break;
+        }
+    }
+    return __METAL_MIN(mult, UINT32_MAX);
+}
+
+static void __metal_clocksource_set_rate(struct __metal_clocksource *cs,
+                                         unsigned long long rate) {
+    cs->mult =
+        __metal_clocksource_mult(1000000000ULL, rate, rate / 2, &cs->shift);
+    /* Rounded up, so that timeouts are never shorter than asked */
+    cs->inv_mult = __metal_clocksource_mult(rate, 1000000000ULL,
+                                            1000000000ULL - 1, &cs->inv_shift);
+    cs->rate = rate;
+}
+
+/* (value * mult) >> shift, rounded up if asked */
+static unsigned long long __metal_clocksource_scale(unsigned long long value,
+                                                    uint32_t mult,
+                                                    unsigned int shift,
+                                                    int round_up) {
+    unsigned long long round = round_up ? ((1ULL << shift) - 1) : 0;
+#ifdef __SIZEOF_INT128__
+    return ((unsigned __int128)value * mult + round) >> shift;
+#else
+    /* value * mult takes up to 96 bits, so multiply the halves of value on
+     * their own. The shift is at most 32, so the low bits of the upper half's
+     * product are never shifted out. */
+    unsigned long long lo = (value & UINT32_MAX) * mult;
+    unsigned long long hi = (value >> 32) * mult;
+
+    return (hi << (32 - shift)) + ((lo + round) >> shift);
+#endif
+}
+
+static unsigned long long
+__metal_clocksource_ns(const struct __metal_clocksource *cs,
+                       unsigned long long count) {
+    return __metal_clocksource_scale(count, cs->mult, cs->shift, 0);
+}
+
+/* The number of counts in ns nanoseconds, rounded up */
+static unsigned long long
+__metal_clocksource_counts(const struct __metal_clocksource *cs,
+                           unsigned long long ns) {
+    return __metal_clocksource_scale(ns, cs->inv_mult, cs->inv_shift, 1);
+}
+
+static unsigned long long
+__metal_clocksource_resolution(const struct __metal_clocksource *cs) {
+    return __METAL_MAX((1000000000ULL + cs->rate - 1) / cs->rate, 1);
+}
+
+/* ns / 10^9 is ((ns >> 9) * mult) >> (64 + shift), exactly for every 64-bit
+ * ns, as 10^9 is 2^9 * 1953125 */
+#define __METAL_TIME_SEC_MULT 0x44B82FA09B5A53ULL
+#define __METAL_TIME_SEC_SHIFT 11
+
+unsigned long long metal_time_split_ns(unsigned long long ns,
+                                       unsigned long *nsec) {
+    unsigned long long value = ns >> 9;
+    unsigned long long sec;
+#ifdef __SIZEOF_INT128__
+    sec = ((unsigned __int128)value * __METAL_TIME_SEC_MULT) >> 64;
+#else
+    /* The upper 64 bits of the 128-bit product, from the 32-bit halves */
+    unsigned long long lo = (value & UINT32_MAX) *
+                            (__METAL_TIME_SEC_MULT & UINT32_MAX);
+    unsigned long long mid1 = (value >> 32) *
+                                  (__METAL_TIME_SEC_MULT & UINT32_MAX) +
+                              (lo >> 32);
+    unsigned long long mid2 = (value & UINT32_MAX) *
+                                  (__METAL_TIME_SEC_MULT >> 32) +
+                              (mid1 & UINT32_MAX);
+
+    sec = (value >> 32) * (__METAL_TIME_SEC_MULT >> 32) + (mid1 >> 32) +
+          (mid2 >> 32);
+#endif
+    sec >>= __METAL_TIME_SEC_SHIFT;
+    *nsec = ns - sec * 1000000000ULL;
+    return sec;
+}
+
+static void __metal_time_rtc_probe(void) {
+    __metal_time_rtc_device = metal_rtc_get_device(0);
+    if (__metal_time_rtc_device != NULL) {
+        __metal_clocksource_set_rate(
+            &__metal_time_rtc, metal_rtc_get_rate(__metal_time_rtc_device));
+        if (__metal_time_rtc.rate == 0) {
+            __metal_time_rtc_device = NULL;
+        }
+    }
+    __metal_time_rtc_probed = 1;
+}
+
+/* The realtime clock before the offset set by metal_time_set_realtime_ns() */
+static int __metal_time_realtime_base(unsigned long long *ns) {
+    if (!__metal_time_rtc_probed) {
+        __metal_time_rtc_probe();
+    }
+    if (__metal_time_rtc_device != NULL) {
+        *ns = __metal_clocksource_ns(
+            &__metal_time_rtc, metal_rtc_get_count(__metal_time_rtc_device));
+        return 0;
+    }
+    return metal_time_get_ns(METAL_TIME_MONOTONIC, ns);
+}
+
+int metal_time_get_ns(metal_time_clock clock, unsigned long long *ns) {
+    unsigned long long count;
+    struct metal_cpu *cpu;
+
+    switch (clock) {
+    case METAL_TIME_MONOTONIC:
+    case METAL_TIME_MONOTONIC_RAW:
+        if ((metal_time_get_mtime(&count) != 0) ||
+            (__metal_time_mtime.rate == 0)) {
+            return -1;
+        }
+        *ns = __metal_clocksource_ns(&__metal_time_mtime, count);
+        return 0;
+    case METAL_TIME_REALTIME:
+        if (__metal_time_realtime_base(ns) != 0) {
+            return -1;
+        }
+        *ns += __metal_time_realtime_offset;
+        return 0;
+    case METAL_TIME_CPUTIME:
+        if (__metal_time_cycles.rate == 0) {
+            metal_delay_calibrate();
+        }
+        cpu = metal_cpu_get(metal_cpu_get_current_hartid());
+        if ((cpu == NULL) || (__metal_time_cycles.rate == 0)) {
+            return -1;
+        }
+        *ns = __metal_clocksource_ns(&__metal_time_cycles,
+                                     metal_cpu_get_timer(cpu));
+        return 0;
+    }
+    return -1;
+}
+
+int metal_time_get_resolution_ns(metal_time_clock clock,
+                                 unsigned long long *ns) {
+    unsigned long long now;
+
+    /* Reading the clock sets up its rate */
+    if (metal_time_get_ns(clock, &now) != 0) {
         return -1;
     }
-    rv = metal_timer_get_timebase_frequency(0, &timebase);
-    if (rv != 0) {
+
+    switch (clock) {
+    case METAL_TIME_MONOTONIC:
+    case METAL_TIME_MONOTONIC_RAW:
+        *ns = __metal_clocksource_resolution(&__metal_time_mtime);
+        return 0;
+    case METAL_TIME_REALTIME:
+        *ns = __metal_clocksource_resolution(__metal_time_rtc_device
+                                                 ? &__metal_time_rtc
+                                                 : &__metal_time_mtime);
+        return 0;
+    case METAL_TIME_CPUTIME:
+        *ns = __metal_clocksource_resolution(&__metal_time_cycles);
+        return 0;
+    }
+    return -1;
+}
+
+int metal_time_set_realtime_ns(unsigned long long ns) {
+    unsigned long long base;
+
+    if (__metal_time_realtime_base(&base) != 0) {
+        return -1;
+    }
+    __metal_time_realtime_offset = (long long)(ns - base);
+    return 0;
+}
+
+/* Save METAL_TIME_REALTIME before the rates change, along with mtime to
+ * measure how long the change takes */
+static void __metal_time_pre_rate_change(void *priv) {
+    __metal_time_saved_realtime_valid = (metal_time_get_ns(
+        METAL_TIME_REALTIME, &__metal_time_saved_realtime) == 0);
+    __metal_time_saved_mtime_valid =
+        (metal_time_get_mtime(&__metal_time_saved_mtime) == 0);
+}
+
+static void __metal_time_post_rate_change(void *priv) {
+    struct metal_cpu *cpu = metal_cpu_get(metal_cpu_get_current_hartid());
+    unsigned long long realtime = __metal_time_saved_realtime;
+    unsigned long long mtime;
+
+    if (cpu != NULL) {
+        __metal_clocksource_set_rate(&__metal_time_mtime,
+                                     metal_cpu_get_timebase(cpu));
+    }
+    __metal_time_rtc_probe();
+    /* The cycle counter may run at a new rate from now on */
+    if (__metal_time_cycles.rate != 0) {
+        metal_delay_calibrate();
+    }
+
+    /* Carry the realtime clock across a change of the RTC rate */
+    if (!__metal_time_saved_realtime_valid) {
+        return;
+    }
+    if (__metal_time_saved_mtime_valid && (__metal_time_mtime.rate != 0) &&
+        (metal_time_get_mtime(&mtime) == 0)) {
+        realtime += __metal_clocksource_ns(&__metal_time_mtime,
+                                           mtime - __metal_time_saved_mtime);
+    }
+    metal_time_set_realtime_ns(realtime);
+    __metal_time_saved_realtime_valid = 0;
+}
+
+void metal_time_update_rates(void) {
+    __metal_time_pre_rate_change(NULL);
+    __metal_time_post_rate_change(NULL);
+}
+
+int metal_gettimeofday(struct timeval *tp, void *tzp) {
+    unsigned long long ns;
+    unsigned long nsec;
+
+    if (metal_time_get_ns(METAL_TIME_REALTIME, &ns) != 0) {
         return -1;
     }
-    tp->tv_sec = mcc / timebase;
-    tp->tv_usec = mcc % timebase * 1000000 / timebase;
+    tp->tv_sec = metal_time_split_ns(ns, &nsec);
+    tp->tv_usec = nsec / 1000;
     return 0;
 }
 
@@ -30,3 +300,170 @@ time_t metal_time(void) {
 
     return now.tv_sec;
 }
+
+int metal_time_get_mtime(unsigned long long *mtime) {
+    /* Read mtime through the timer interrupt controller directly, since the
+     * CPU driver only knows about it once timer interrupts have been set up */
+    if (__metal_time_mtime_timer == NULL) {
+        struct metal_cpu *cpu = metal_cpu_get(metal_cpu_get_current_hartid());
+
+        if (cpu == NULL) {
+            return -1;
+        }
+        __metal_clocksource_set_rate(&__metal_time_mtime,
+                                     metal_cpu_get_timebase(cpu));
+        __metal_time_mtime_timer = metal_cpu_timer_interrupt_controller(cpu);
+        if (__metal_time_mtime_timer == NULL) {
+            return -1;
+        }
+    }
+    return __metal_time_mtime_timer->vtable->command_request(
+        __metal_time_mtime_timer, METAL_TIMER_MTIME_GET, mtime);
+}
+
+int metal_deadline_expired(struct metal_deadline *deadline) {
+    unsigned long long now;
+
+    if (metal_time_get_mtime(&now) != 0) {
+        return 0;
+    }
+
+    if (!deadline->running) {
+        deadline->expiry = now;
+        if (deadline->timeout != 0) {
+            /* The current tick may be almost over, so wait for one more */
+            deadline->expiry +=
+                __metal_clocksource_counts(&__metal_time_mtime,
+                                           deadline->timeout * 1000ULL) +
+                1;
+        }
+        deadline->running = 1;
+        return 0;
+    }
+    return (now >= deadline->expiry);
+}
+
+static void __metal_time_wakeup(struct metal_timer *timer) {}
+
+int metal_time_sleep_until(unsigned long long deadline) {
+    struct metal_timer timer = {0};
+    unsigned long long now;
+    uintptr_t mstatus;
+    int armed;
+
+    if (metal_time_get_mtime(&now) != 0) {
+        return -1;
+    }
+    if (now >= deadline) {
+        return 0;
+    }
+
+    /* The timer makes sure mtimecmp is no later than the deadline. Its
+     * interrupt wakes wfi up even while interrupts are disabled. */
+    armed = (metal_timer_start(&timer, deadline, __metal_time_wakeup) == 0);
+
+    /* Check mtime and wait with interrupts disabled, so that an interrupt
+     * which arrives in between can't be taken before the wfi and leave it
+     * waiting for the next one. Pending interrupts are taken after waking. */
+    mstatus = __metal_interrupt_global_save();
+    while ((metal_time_get_mtime(&now) == 0) && (now < deadline)) {
+        if (armed) {
+            __asm__ volatile("wfi");
+        }
+        __metal_interrupt_global_restore(mstatus);
+        __metal_interrupt_global_save();
+    }
+    __metal_interrupt_global_restore(mstatus);
+
+    if (armed) {
+        metal_timer_cancel(&timer);
+    }
+    return 0;
+}
+
+static unsigned long __metal_delay_cycles(void) {
+    unsigned long cycles;
+
+    __asm__ volatile("csrr %0, mcycle" : "=r"(cycles));
+    return cycles;
+}
+
+void metal_delay_calibrate(void) {
+    unsigned long long start, now;
+    unsigned long cycles;
+
+    if ((metal_time_get_mtime(&start) != 0) || (__metal_time_mtime.rate == 0)) {
+        return;
+    }
+
+    /* Count from the start of a tick */
+    do {
+        metal_time_get_mtime(&now);
+    } while (now == start);
+    cycles = __metal_delay_cycles();
+    start = now;
+
+    do {
+        metal_time_get_mtime(&now);
+    } while ((now - start) < METAL_DELAY_CALIBRATE_TICKS);
+    cycles = __metal_delay_cycles() - cycles;
+
+    __metal_clocksource_set_rate(&__metal_time_cycles,
+                                 cycles * __metal_time_mtime.rate /
+                                     (now - start));
+}
+
+void metal_delay_ns(unsigned long long ns) {
+    unsigned long long ticks, start, now;
+    unsigned long cycles, begin;
+
+    if (__metal_time_cycles.rate == 0) {
+        metal_delay_calibrate();
+        if (__metal_time_cycles.rate == 0) {
+            return;
+        }
+    }
+
+    ticks = __metal_clocksource_counts(&__metal_time_mtime, ns);
+    if (ticks > 1) {
+        /* The first tick may be partly over already, so wait for one more */
+        metal_time_get_mtime(&start);
+        do {
+            metal_time_get_mtime(&now);
+        } while ((now - start) <= ticks);
+        return;
+    }
+
+    /* Up to a tick, which is short enough for mcycle not to wrap */
+    cycles = __metal_clocksource_counts(&__metal_time_cycles, ns);
+    begin = __metal_delay_cycles();
+    while ((__metal_delay_cycles() - begin) < cycles)
+        ;
+}
+
+int metal_time_register_clock(struct metal_clock *clock) {
+    if (__metal_time_clock != NULL) {
+        return (clock == __metal_time_clock) ? 0 : -1;
+    }
+    __metal_time_clock = clock;
+
+    __metal_time_pre_rate_change_callback.callback =
+        &__metal_time_pre_rate_change;
+    __metal_time_pre_rate_change_callback.priv = NULL;
+    metal_clock_register_pre_rate_change_callback(
+        clock, &__metal_time_pre_rate_change_callback);
+
+    __metal_time_post_rate_change_callback.callback =
+        &__metal_time_post_rate_change;
+    __metal_time_post_rate_change_callback.priv = NULL;
+    metal_clock_register_post_rate_change_callback(
+        clock, &__metal_time_post_rate_change_callback);
+    return 0;
+}
+
+#ifdef __METAL_DT_SIFIVE_FE310_G000_PLL_HANDLE
+/* The PLL drives the harts of the FE310 */
+METAL_CONSTRUCTOR(metal_time_init) {
+    metal_time_register_clock(&__METAL_DT_SIFIVE_FE310_G000_PLL_HANDLE->clock);
+}
+#endif
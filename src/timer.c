@@ -1,15 +1,21 @@
 /* Copyright 2018 SiFive, Inc */
 /* SPDX-License-Identifier: Apache-2.0 */
 
+#include <metal/compiler.h>
 #include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
+#include <metal/interrupt.h>
 #include <metal/machine.h>
 #include <metal/timer.h>
+#include <stdint.h>
 #ifndef __SEGGER_LIBC__
 #include <sys/time.h>
 #include <sys/times.h>
 #endif
 
 #if defined(__METAL_DT_MAX_HARTS)
+static int __metal_timer_wheel_owns(int hartid);
+
 /* This implementation serves as a small shim that interfaces with the first
  * timer on a system. */
 int metal_timer_get_cyclecount(int hartid, unsigned long long *mcc) {
@@ -45,12 +51,324 @@ int metal_timer_get_machine_time(int hartid) {
 int metal_timer_set_machine_time(int hartid, unsigned long long time) {
     struct metal_cpu *cpu = metal_cpu_get(hartid);
 
-    if (cpu) {
+    if (cpu && !__metal_timer_wheel_owns(hartid)) {
         return metal_cpu_set_mtimecmp(cpu, time);
     }
     return -1;
 }
 
+int metal_timer_set_tick(int hartid, int second) {
+    struct metal_cpu *cpu = metal_cpu_get(hartid);
+
+    if (cpu && !__metal_timer_wheel_owns(hartid)) {
+        return metal_cpu_set_mtimecmp(cpu,
+                                      metal_cpu_get_mtime(cpu) +
+                                          (metal_cpu_get_timebase(cpu) *
+                                           (unsigned long long)second));
+    }
+    return -1;
+}
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * METAL_TIMER_WHEEL_LEVELS))
+#define WHEEL_NEVER (~0ULL)
+
+#if (METAL_TIMER_WHEEL_LEVELS < 1) ||                                          \
+    ((WHEEL_BITS * METAL_TIMER_WHEEL_LEVELS) > 60)
+#error "METAL_TIMER_WHEEL_LEVELS must be between 1 and 10"
+#endif
+
+/* Level n of the wheel has a slot for every 64^n mtime ticks. A timer is kept
+ * in the lowest level whose slots are fine enough to hold it without
+ * wrapping, and is moved down a level each time the wheel reaches its slot,
+ * until it expires from level 0. Each level has a bitmap of its non-empty
+ * slots, so the next slot to process is found without walking the wheel. */
+struct __metal_timer_wheel {
+    /* The first mtime tick which hasn't been processed */
+    unsigned long long now;
+    /* The value mtimecmp was last programmed with */
+    unsigned long long programmed;
+    struct metal_cpu *cpu;
+    int init_done;
+    int running;
+    uint64_t occupied[METAL_TIMER_WHEEL_LEVELS];
+    struct metal_timer *slots[METAL_TIMER_WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static struct __metal_timer_wheel __metal_timer_wheels[__METAL_DT_MAX_HARTS];
+
+/* Once the wheel runs on a hart, mtimecmp is only written by the wheel, so
+ * that no timer misses its interrupt */
+static int __metal_timer_wheel_owns(int hartid) {
+    return (hartid >= 0) && (hartid < __METAL_DT_MAX_HARTS) &&
+           __metal_timer_wheels[hartid].init_done;
+}
+
+static uintptr_t __metal_timer_wheel_enter(void) {
+    /* The wheel is only shared with this hart's timer interrupt */
+    return __metal_interrupt_global_save();
+}
+
+static void __metal_timer_wheel_exit(uintptr_t mstatus) {
+    __metal_interrupt_global_restore(mstatus);
+}
+
+static int __metal_timer_wheel_empty(struct __metal_timer_wheel *wheel) {
+    for (int level = 0; level < METAL_TIMER_WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void __metal_timer_wheel_insert(struct __metal_timer_wheel *wheel,
+                                       struct metal_timer *timer) {
+    unsigned long long expires = __METAL_MAX(timer->expires, wheel->now);
+    unsigned long long delta = expires - wheel->now;
+    struct metal_timer **head;
+    unsigned int level = 0, slot;
+
+    /* Park timers beyond the end of the wheel in the furthest slot, to be
+     * placed again when the wheel reaches it */
+    if (delta >= WHEEL_SPAN) {
+        expires = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    while (delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = (level * WHEEL_SLOTS) + slot;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void __metal_timer_wheel_remove(struct __metal_timer_wheel *wheel,
+                                       struct metal_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (timer->slot >= 0) {
+        unsigned int level = timer->slot / WHEEL_SLOTS;
+        unsigned int slot = timer->slot % WHEEL_SLOTS;
+
+        if (wheel->slots[level][slot] == NULL) {
+            wheel->occupied[level] &= ~(1ULL << slot);
+        }
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Take the timers out of a slot, into a list which they can still be removed
+ * from while it is being worked through */
+static void __metal_timer_wheel_take(struct __metal_timer_wheel *wheel,
+                                     unsigned int level, unsigned int slot,
+                                     struct metal_timer **list) {
+    *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    if (*list) {
+        (*list)->pprev = list;
+    }
+    for (struct metal_timer *timer = *list; timer; timer = timer->next) {
+        timer->slot = -1;
+    }
+}
+
+/* The first tick at or after now at which a timer expires or has to move
+ * down a level, or WHEEL_NEVER if the wheel is empty */
+static unsigned long long
+__metal_timer_wheel_next(struct __metal_timer_wheel *wheel) {
+    unsigned long long next = WHEEL_NEVER;
+
+    for (unsigned int level = 0; level < METAL_TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = WHEEL_BITS * level;
+        uint64_t occupied = wheel->occupied[level];
+        unsigned long long base;
+        unsigned int index;
+
+        if (occupied == 0) {
+            continue;
+        }
+
+        /* The first slot boundary of this level at or after now */
+        base = (wheel->now + (1ULL << shift) - 1) >> shift;
+        index = base & WHEEL_MASK;
+        occupied = (occupied >> index) | (occupied << ((64 - index) & 63));
+        next = __METAL_MIN(next, (base + __builtin_ctzll(occupied)) << shift);
+    }
+    return next;
+}
+
+static void __metal_timer_wheel_program(struct __metal_timer_wheel *wheel) {
+    unsigned long long next = __metal_timer_wheel_next(wheel);
+
+    if (next != wheel->programmed) {
+        wheel->programmed = next;
+        metal_cpu_set_mtimecmp(wheel->cpu, next);
+    }
+}
+
+static void __metal_timer_wheel_handler(int id, void *priv) {
+    struct __metal_timer_wheel *wheel = priv;
+    unsigned long long mtime = metal_cpu_get_mtime(wheel->cpu);
+    unsigned long long tick;
+
+    wheel->running = 1;
+
+    /* Skip straight from one occupied slot to the next, running every timer
+     * which expired by the time the interrupt was taken */
+    while ((tick = __metal_timer_wheel_next(wheel)) <= mtime) {
+        struct metal_timer *list, *timer;
+
+        wheel->now = tick;
+        for (unsigned int level = 1; level < METAL_TIMER_WHEEL_LEVELS;
+             level++) {
+            unsigned int shift = WHEEL_BITS * level;
+
+            if (tick & ((1ULL << shift) - 1)) {
+                break;
+            }
+            __metal_timer_wheel_take(wheel, level, (tick >> shift) & WHEEL_MASK,
+                                     &list);
+            while ((timer = list) != NULL) {
+                __metal_timer_wheel_remove(wheel, timer);
+                __metal_timer_wheel_insert(wheel, timer);
+            }
+        }
+
+        /* Timers started by the callbacks for this tick or earlier run on the
+         * next pass, so that a callback restarting its own timer in the past
+         * can't keep the loop going forever */
+        __metal_timer_wheel_take(wheel, 0, tick & WHEEL_MASK, &list);
+        wheel->now = tick + 1;
+        while ((timer = list) != NULL) {
+            __metal_timer_wheel_remove(wheel, timer);
+            if (timer->period) {
+                timer->expires += timer->period;
+                __metal_timer_wheel_insert(wheel, timer);
+            }
+            timer->callback(timer);
+        }
+    }
+
+    wheel->running = 0;
+    __metal_timer_wheel_program(wheel);
+}
+
+static struct __metal_timer_wheel *__metal_timer_wheel_get(void) {
+    int hartid = metal_cpu_get_current_hartid();
+    struct __metal_timer_wheel *wheel;
+    struct metal_interrupt *tmr_intc;
+    int tmr_id;
+
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS)) {
+        return NULL;
+    }
+    wheel = &__metal_timer_wheels[hartid];
+    if (wheel->init_done) {
+        return wheel;
+    }
+
+    wheel->cpu = metal_cpu_get(hartid);
+    if (wheel->cpu == NULL) {
+        return NULL;
+    }
+    tmr_intc = metal_cpu_timer_interrupt_controller(wheel->cpu);
+    if (tmr_intc == NULL) {
+        return NULL;
+    }
+    metal_interrupt_init(tmr_intc);
+    tmr_id = metal_cpu_timer_get_interrupt_id(wheel->cpu);
+
+    /* Leave the timer interrupt to the application if it handles it */
+    if (__metal_driver_cpu_timer_handler(wheel->cpu) != NULL) {
+        return NULL;
+    }
+
+    if (metal_interrupt_register_handler(tmr_intc, tmr_id,
+                                         __metal_timer_wheel_handler,
+                                         wheel) != 0) {
+        return NULL;
+    }
+    wheel->programmed = WHEEL_NEVER;
+    metal_cpu_set_mtimecmp(wheel->cpu, WHEEL_NEVER);
+    metal_interrupt_enable(tmr_intc, tmr_id);
+    wheel->init_done = 1;
+    return wheel;
+}
+
+int metal_timer_start_periodic(struct metal_timer *timer,
+                               unsigned long long deadline,
+                               unsigned long long period,
+                               metal_timer_callback callback) {
+    struct __metal_timer_wheel *wheel = __metal_timer_wheel_get();
+    uintptr_t mstatus;
+
+    if (wheel == NULL) {
+        return -1;
+    }
+
+    mstatus = __metal_timer_wheel_enter();
+    if (timer->pprev) {
+        __metal_timer_wheel_remove(wheel, timer);
+    }
+    /* An idle wheel may be far behind mtime, catch it up so that the timer
+     * doesn't have to work its way down from the top level */
+    if (!wheel->running && __metal_timer_wheel_empty(wheel)) {
+        wheel->now = metal_cpu_get_mtime(wheel->cpu);
+    }
+    timer->expires = deadline;
+    timer->period = period;
+    timer->callback = callback;
+    __metal_timer_wheel_insert(wheel, timer);
+    if (!wheel->running) {
+        __metal_timer_wheel_program(wheel);
+    }
+    __metal_timer_wheel_exit(mstatus);
+    return 0;
+}
+
+int metal_timer_start(struct metal_timer *timer, unsigned long long deadline,
+                      metal_timer_callback callback) {
+    return metal_timer_start_periodic(timer, deadline, 0, callback);
+}
+
+int metal_timer_cancel(struct metal_timer *timer) {
+    struct __metal_timer_wheel *wheel = __metal_timer_wheel_get();
+    uintptr_t mstatus;
+    int pending = 0;
+
+    if (wheel == NULL) {
+        return 0;
+    }
+
+    mstatus = __metal_timer_wheel_enter();
+    if (timer->pprev) {
+        __metal_timer_wheel_remove(wheel, timer);
+        pending = 1;
+        if (!wheel->running) {
+            __metal_timer_wheel_program(wheel);
+        }
+    }
+    timer->period = 0;
+    __metal_timer_wheel_exit(mstatus);
+    return pending;
+}
+
 #else
 
 /* This implementation of gettimeofday doesn't actually do anything, it's just
@@ -80,4 +398,18 @@ int metal_timer_set_tick(int second) __attribute__((weak, alias("nop_tick"))) {
     "There is no default timer device, metal_timer_set_tick) will always return -1.")
 }
 
+int metal_timer_start_periodic(struct metal_timer *timer,
+                               unsigned long long deadline,
+                               unsigned long long period,
+                               metal_timer_callback callback) {
+    return -1;
+}
+
+int metal_timer_start(struct metal_timer *timer, unsigned long long deadline,
+                      metal_timer_callback callback) {
+    return -1;
+}
+
+int metal_timer_cancel(struct metal_timer *timer) { return 0; }
+
 #endif
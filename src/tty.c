@@ -1,6 +1,9 @@
 /* Copyright 2018 SiFive, Inc */
 /* SPDX-License-Identifier: Apache-2.0 */
 
+#include <metal/atomic.h>
+#include <metal/cpu.h>
+#include <metal/drivers/riscv_cpu.h>
 #include <metal/init.h>
 #include <metal/machine.h>
 #include <metal/tty.h>
@@ -9,11 +12,281 @@
 #if defined(__METAL_DT_STDOUT_UART_HANDLE)
 /* This implementation serves as a small shim that interfaces with the first
  * UART on a system. */
+
+#if METAL_TTY_BUFFER_MODE != METAL_TTY_UNBUFFERED
+#define TTY_RING_MASK (METAL_TTY_BUFFER_SIZE - 1)
+
+#if (METAL_TTY_BUFFER_SIZE & TTY_RING_MASK) != 0
+#error "METAL_TTY_BUFFER_SIZE must be a power of two"
+#endif
+
+/* Each hart writes its output into its own ring without taking any lock, so
+ * a hart never waits for another hart's output to reach the UART. Output
+ * becomes ready to send once it is committed: at the end of each line when
+ * line buffered, or once the ring fills up or is flushed.
+ *
+ * One hart at a time drains the rings into the UART. It only ever takes
+ * committed output, and empties one ring before moving on to the next, so
+ * lines from different harts are never mixed together. */
+struct __metal_tty_ring {
+    volatile unsigned int head;
+    volatile unsigned int commit;
+    volatile unsigned int tail;
+    char buf[METAL_TTY_BUFFER_SIZE];
+};
+
+static struct __metal_tty_ring __metal_tty_rings[__METAL_DT_MAX_HARTS];
+
+METAL_ATOMIC_DECLARE(__metal_tty_draining);
+static volatile int __metal_tty_drainer = -1;
+
+static int __metal_tty_drain_take(int hartid) {
+#ifdef __riscv_atomic
+    if (metal_atomic_swap(&__metal_tty_draining, 1) != 0) {
+        return 0;
+    }
+    __asm__ volatile("fence r, rw" ::: "memory");
+#else
+    uintptr_t mstatus;
+    int busy;
+
+    /* Without atomics there is only this hart and its interrupt handlers */
+    mstatus = __metal_interrupt_global_save();
+    busy = __metal_tty_draining;
+    __metal_tty_draining = 1;
+    __metal_interrupt_global_restore(mstatus);
+    if (busy) {
+        return 0;
+    }
+#endif
+    __metal_tty_drainer = hartid;
+    return 1;
+}
+
+static void __metal_tty_drain_give(void) {
+    __metal_tty_drainer = -1;
+    __asm__ volatile("fence rw, w" ::: "memory");
+    __metal_tty_draining = 0;
+    /* Order the release before the drainer looks for more output, see
+     * __metal_tty_drain() */
+    __asm__ volatile("fence rw, rw" ::: "memory");
+}
+
+static int __metal_tty_pending(void) {
+    for (int i = 0; i < __METAL_DT_MAX_HARTS; i++) {
+        if (__metal_tty_rings[i].commit != __metal_tty_rings[i].tail) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int __metal_tty_ring_drain(struct __metal_tty_ring *ring) {
+    unsigned int tail = ring->tail;
+    unsigned int commit = ring->commit;
+    int rc = 0;
+
+    /* Don't read the output before its commit */
+    __asm__ volatile("fence r, r" ::: "memory");
+
+    while (tail != commit) {
+        unsigned int start = tail & TTY_RING_MASK;
+        unsigned int count =
+            __METAL_MIN(commit - tail, METAL_TTY_BUFFER_SIZE - start);
+
+        rc |= metal_uart_write(__METAL_DT_STDOUT_UART_HANDLE, ring->buf + start,
+                               count);
+        tail += count;
+
+        /* Finish reading the output before handing the space back */
+        __asm__ volatile("fence r, w" ::: "memory");
+        ring->tail = tail;
+    }
+    return rc;
+}
+
+/* Drain every hart's ring, unless another drain is already in progress */
+static int __metal_tty_drain(int hartid) {
+    int rc = 0;
+
+    while (__metal_tty_drain_take(hartid)) {
+        for (int i = 0; i < __METAL_DT_MAX_HARTS; i++) {
+            rc |= __metal_tty_ring_drain(&__metal_tty_rings[i]);
+        }
+        __metal_tty_drain_give();
+
+        /* A hart which committed output after its ring was drained, but
+         * before the drain was given back, left it for us. Writers commit
+         * before trying to drain, so either they get the drain or we see
+         * their output here. */
+        if (!__metal_tty_pending()) {
+            break;
+        }
+    }
+    return rc;
+}
+
+/* Whether this hart drains the rings whenever it commits output, rather than
+ * only when it needs space or is flushing */
+static int __metal_tty_drains(int hartid) {
+#ifdef METAL_TTY_DRAIN_HART
+    return (hartid == METAL_TTY_DRAIN_HART);
+#else
+    return 1;
+#endif
+}
+
+/* Wait until everything committed to this hart's ring has been drained */
+static int __metal_tty_ring_wait(struct __metal_tty_ring *ring, int hartid) {
+    unsigned int commit = ring->commit;
+    int rc = 0;
+
+    while ((int)(commit - ring->tail) > 0) {
+        /* If this hart was interrupted while draining, nothing else is going
+         * to make space */
+        if (__metal_tty_drainer == hartid) {
+            return -1;
+        }
+        rc |= __metal_tty_drain(hartid);
+    }
+    return rc;
+}
+
+/* Commit everything written to this hart's ring so far */
+static void __metal_tty_commit(struct __metal_tty_ring *ring) {
+    uintptr_t mstatus = __metal_interrupt_global_save();
+    ring->commit = ring->head;
+    __metal_interrupt_global_restore(mstatus);
+    __asm__ volatile("fence rw, rw" ::: "memory");
+}
+
+/* Raw writes are committed as a whole rather than at each newline */
+static int __metal_tty_write(const char *buf, size_t len, int raw) {
+    int hartid = metal_cpu_get_current_hartid();
+    struct __metal_tty_ring *ring;
+    uintptr_t mstatus;
+    int rc = 0;
+
+    /* Harts without a ring write straight to the UART */
+    if ((hartid < 0) || (hartid >= __METAL_DT_MAX_HARTS)) {
+        return metal_uart_write(__METAL_DT_STDOUT_UART_HANDLE, buf, len);
+    }
+    ring = &__metal_tty_rings[hartid];
+
+    /* Make room for the whole of a raw write first, so that it doesn't get
+     * committed in pieces when the ring fills */
+    if (raw && (len <= METAL_TTY_BUFFER_SIZE) &&
+        ((METAL_TTY_BUFFER_SIZE - (ring->head - ring->tail)) < len)) {
+        __metal_tty_commit(ring);
+        if (__metal_tty_ring_wait(ring, hartid) != 0) {
+            return -1;
+        }
+    }
+
+    while (len > 0) {
+        /* Keep interrupt handlers on this hart which print from seeing a
+         * half-updated ring */
+        mstatus = __metal_interrupt_global_save();
+
+        unsigned int head = ring->head;
+        unsigned int commit = ring->commit;
+        size_t count =
+            __METAL_MIN(METAL_TTY_BUFFER_SIZE - (head - ring->tail), len);
+
+        for (size_t i = 0; i < count; i++) {
+            ring->buf[(head + i) & TTY_RING_MASK] = buf[i];
+#if METAL_TTY_BUFFER_MODE == METAL_TTY_LINE_BUFFERED
+            if (!raw && (buf[i] == '\n')) {
+                commit = head + i + 1;
+            }
+#endif
+        }
+        head += count;
+
+        /* Lines longer than the ring are sent in pieces */
+        if (raw || ((head - ring->tail) == METAL_TTY_BUFFER_SIZE)) {
+            commit = head;
+        }
+
+        /* Publish the output before the new commit */
+        __asm__ volatile("fence rw, w" ::: "memory");
+        ring->head = head;
+        ring->commit = commit;
+
+        __metal_interrupt_global_restore(mstatus);
+
+        buf += count;
+        len -= count;
+
+        if (len > 0) {
+            /* The ring is full, the rest of the output is lost if it can't
+             * be drained */
+            if (__metal_tty_ring_wait(ring, hartid) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    /* Commit before trying to drain, see __metal_tty_drain() */
+    __asm__ volatile("fence rw, rw" ::: "memory");
+    if (__metal_tty_drains(hartid) && (ring->commit != ring->tail)) {
+        rc = __metal_tty_drain(hartid);
+    }
+    return rc ? -1 : 0;
+}
+#endif
+
+int metal_tty_write(const char *buf, size_t len) {
+#if METAL_TTY_BUFFER_MODE == METAL_TTY_UNBUFFERED
+    return metal_uart_write(__METAL_DT_STDOUT_UART_HANDLE, buf, len);
+#else
+    return __metal_tty_write(buf, len, 0);
+#endif
+}
+
+int metal_tty_write_raw(const char *buf, size_t len) {
+#if METAL_TTY_BUFFER_MODE == METAL_TTY_UNBUFFERED
+    return metal_uart_write(__METAL_DT_STDOUT_UART_HANDLE, buf, len);
+#else
+    return __metal_tty_write(buf, len, 1);
+#endif
+}
+
+int metal_tty_drain(void) {
+#if METAL_TTY_BUFFER_MODE != METAL_TTY_UNBUFFERED
+    if (__metal_tty_drain(metal_cpu_get_current_hartid()) != 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int metal_tty_flush(void) {
+    int rc = 0;
+
+#if METAL_TTY_BUFFER_MODE != METAL_TTY_UNBUFFERED
+    int hartid = metal_cpu_get_current_hartid();
+
+    if ((hartid >= 0) && (hartid < __METAL_DT_MAX_HARTS)) {
+        struct __metal_tty_ring *ring = &__metal_tty_rings[hartid];
+
+        __metal_tty_commit(ring);
+        rc |= __metal_tty_ring_wait(ring, hartid);
+    }
+#endif
+    rc |= metal_uart_flush(__METAL_DT_STDOUT_UART_HANDLE);
+    return rc ? -1 : 0;
+}
+
 int metal_tty_putc(int c) {
-    return metal_uart_putc(__METAL_DT_STDOUT_UART_HANDLE, c);
+    char ch = c;
+
+    return metal_tty_write(&ch, 1);
 }
 
 int metal_tty_getc(int *c) {
+    /* Make sure any prompt has been printed before waiting for input */
+    metal_tty_flush();
     do {
         metal_uart_getc(__METAL_DT_STDOUT_UART_HANDLE, c);
         /* -1 means no key pressed, getc waits */
@@ -21,6 +294,10 @@ int metal_tty_getc(int *c) {
     return 0;
 }
 
+int metal_tty_read(char *buf, size_t len, unsigned int timeout) {
+    return metal_uart_read(__METAL_DT_STDOUT_UART_HANDLE, buf, len, timeout);
+}
+
 #ifndef __METAL_DT_STDOUT_UART_BAUD
 #define __METAL_DT_STDOUT_UART_BAUD 115200
 #endif
@@ -28,6 +305,11 @@ int metal_tty_getc(int *c) {
 METAL_CONSTRUCTOR(metal_tty_init) {
     metal_uart_init(__METAL_DT_STDOUT_UART_HANDLE, __METAL_DT_STDOUT_UART_BAUD);
 }
+
+/* Run last, so that output from other destructors is flushed as well */
+METAL_DESTRUCTOR_PRIO(metal_tty_fini, METAL_INIT_LOWEST_PRIORITY) {
+    metal_tty_flush();
+}
 #else
 /* This implementation of putc doesn't actually do anything, it's just there to
  * provide a shim that eats all the characters so we can ensure that everything
@@ -47,6 +329,24 @@ int nop_putc(int c) {
     return -1;
 }
 int metal_tty_putc(int c) __attribute__((weak, alias("nop_putc")));
+int metal_tty_write(const char *buf, size_t len) {
+    /* Pass each character through metal_tty_putc() so that the NOP hint
+     * above still sees every character */
+    for (size_t i = 0; i < len; i++) {
+        metal_tty_putc((unsigned char)buf[i]);
+    }
+    return 0;
+}
+int metal_tty_write_raw(const char *buf, size_t len) {
+    return metal_tty_write(buf, len);
+}
+int metal_tty_drain(void) { return 0; }
+int metal_tty_flush(void) { return 0; }
+int nop_read(char *buf, size_t len, unsigned int timeout)
+    __attribute__((section(".text.metal.nop.read")));
+int nop_read(char *buf, size_t len, unsigned int timeout) { return -1; }
+int metal_tty_read(char *buf, size_t len, unsigned int timeout)
+    __attribute__((weak, alias("nop_read")));
 #pragma message(                                                               \
     "There is no default output device, metal_tty_putc() will throw away all input.")
 #endif
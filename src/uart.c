@@ -2,10 +2,14 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 
 #include <metal/machine.h>
+#include <metal/time.h>
 #include <metal/uart.h>
 
 extern __inline__ void metal_uart_init(struct metal_uart *uart, int baud_rate);
 extern __inline__ int metal_uart_putc(struct metal_uart *uart, int c);
+extern __inline__ int metal_uart_write(struct metal_uart *uart, const char *buf,
+                                       size_t len);
+extern __inline__ int metal_uart_flush(struct metal_uart *uart);
 extern __inline__ int metal_uart_txready(struct metal_uart *uart);
 extern __inline__ int metal_uart_getc(struct metal_uart *uart, int *c);
 extern __inline__ int metal_uart_get_baud_rate(struct metal_uart *uart);
@@ -40,3 +44,49 @@ struct metal_uart *metal_uart_get_device(unsigned int device_num) {
 
     return NULL;
 }
+
+static size_t __metal_uart_read_available(struct metal_uart *uart, char *buf,
+                                          size_t len) {
+    size_t count = 0;
+    int c;
+
+    if (uart->vtable->read) {
+        int rc = uart->vtable->read(uart, buf, len);
+        return (rc > 0) ? rc : 0;
+    }
+
+    while (count < len) {
+        if ((uart->vtable->getc(uart, &c) != 0) || (c == -1)) {
+            break;
+        }
+        buf[count++] = c;
+    }
+    return count;
+}
+
+int metal_uart_read(struct metal_uart *uart, char *buf, size_t len,
+                    unsigned int timeout) {
+    struct metal_deadline idle;
+    unsigned long long now;
+    size_t count;
+
+    count = __metal_uart_read_available(uart, buf, len);
+    if ((count == len) || (timeout == 0) ||
+        (metal_time_get_mtime(&now) != 0)) {
+        return count;
+    }
+
+    metal_deadline_start(&idle, timeout);
+    while (count < len) {
+        size_t n = __metal_uart_read_available(uart, buf + count, len - count);
+
+        if (n > 0) {
+            /* Restart the idle timeout whenever new characters arrive */
+            count += n;
+            metal_deadline_start(&idle, timeout);
+        } else if (metal_deadline_expired(&idle)) {
+            break;
+        }
+    }
+    return count;
+}